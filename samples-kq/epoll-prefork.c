@@ -0,0 +1,320 @@
+/* Kernel Queue The Complete Guide: epoll-prefork.c: Prefork worker processes sharing one listening socket
+Usage:
+	$ ./epoll-prefork 4
+	$ curl 127.0.0.1:64000/
+	$ curl 127.0.0.1:64000/crash
+	$ ./epoll-prefork bench 4 20000
+
+The master process creates the listening socket and forks N worker processes.
+Each worker has its own epoll object with the inherited listening socket registered with EPOLLEXCLUSIVE:
+ a new connection wakes up only one of the waiting workers, not all of them.
+If a worker crashes, the other workers continue serving, and the master starts a new worker in its place.
+The master keeps SIGCHLD, SIGINT and SIGTERM blocked and receives them with sigtimedwait(),
+ so a signal can't arrive between checking the quit flag and going to sleep.
+A worker that dies within 1 second after the start is restarted with a delay that doubles each time (up to 10 seconds),
+ so a worker crashing on startup doesn't make the master fork in a busy loop.
+*/
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define PORT  64000
+#define WORKERS_MAX  64
+#define RESTART_DELAY_MIN_MS  100
+#define RESTART_DELAY_MAX_MS  10000
+
+// the structure associated with a socket descriptor
+struct context {
+	int sk;
+	void (*rhandler)(struct context *object);
+};
+
+struct worker {
+	pid_t pid; // 0: waiting for restart
+	double start;
+	double restart_at;
+	unsigned int delay_ms; // the current restart delay
+};
+
+int lsock;
+struct worker workers[WORKERS_MAX];
+unsigned int n_workers;
+
+double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Get the set of signals the master process handles synchronously */
+void master_sigset(sigset_t *mask)
+{
+	sigemptyset(mask);
+	sigaddset(mask, SIGCHLD);
+	sigaddset(mask, SIGINT);
+	sigaddset(mask, SIGTERM);
+}
+
+void accept_handler(struct context *obj)
+{
+	for (;;) {
+		int csock = accept(obj->sk, NULL, 0);
+		if (csock == -1) {
+			assert(errno == EAGAIN || errno == ECONNABORTED || errno == EINTR);
+			if (errno == EAGAIN)
+				break; // no more pending connections
+			continue;
+		}
+
+		char buf[1000];
+		int r = recv(csock, buf, sizeof(buf) - 1, 0);
+		if (r > 0) {
+			buf[r] = '\0';
+			if (!strncmp(buf, "GET /crash ", 11))
+				abort(); // simulate a bug in the worker
+
+			char data[] = "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\nHello";
+			send(csock, data, sizeof(data)-1, 0);
+		}
+		close(csock);
+	}
+}
+
+/** Worker process: serve connections until killed */
+void worker()
+{
+	int kq = epoll_create(1);
+	assert(kq != -1);
+
+	struct context obj = {};
+	obj.sk = lsock;
+	obj.rhandler = accept_handler;
+
+	// attach the shared listening socket: wake up only 1 worker per event
+	struct epoll_event event = {};
+	event.events = EPOLLIN | EPOLLEXCLUSIVE;
+	event.data.ptr = &obj;
+	assert(0 == epoll_ctl(kq, EPOLL_CTL_ADD, lsock, &event));
+
+	for (;;) {
+		struct epoll_event events[1];
+		int n = epoll_wait(kq, events, 1, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		assert(n > 0);
+
+		struct context *o = events[0].data.ptr;
+		if (events[0].events & (EPOLLIN | EPOLLERR))
+			o->rhandler(o);
+	}
+}
+
+pid_t worker_start()
+{
+	pid_t p = fork();
+	assert(p != -1);
+	if (p == 0) {
+		sigset_t mask;
+		master_sigset(&mask);
+		sigprocmask(SIG_UNBLOCK, &mask, NULL);
+		worker();
+		_exit(0);
+	}
+	return p;
+}
+
+void listen_start()
+{
+	lsock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	assert(lsock != -1);
+	int val = 1;
+	setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &val, 4);
+
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = ntohs(PORT);
+	assert(0 == bind(lsock, (struct sockaddr*)&addr, sizeof(addr)));
+	assert(0 == listen(lsock, 1024));
+}
+
+void workers_start(unsigned int n)
+{
+	n_workers = n;
+	for (unsigned int i = 0;  i != n;  i++) {
+		workers[i].pid = worker_start();
+		workers[i].start = time_sec();
+		workers[i].delay_ms = 0;
+	}
+}
+
+void workers_stop()
+{
+	for (unsigned int i = 0;  i != n_workers;  i++) {
+		if (workers[i].pid != 0)
+			kill(workers[i].pid, SIGTERM);
+	}
+	for (unsigned int i = 0;  i != n_workers;  i++) {
+		if (workers[i].pid != 0)
+			waitpid(workers[i].pid, NULL, 0);
+	}
+	n_workers = 0;
+}
+
+/** A worker has exited: schedule its restart */
+void worker_exited(struct worker *w, int status)
+{
+	double now = time_sec();
+	if (now - w->start < 1) {
+		// crashed right after the start: wait longer each time
+		w->delay_ms = (w->delay_ms == 0) ? RESTART_DELAY_MIN_MS : w->delay_ms * 2;
+		if (w->delay_ms > RESTART_DELAY_MAX_MS)
+			w->delay_ms = RESTART_DELAY_MAX_MS;
+	} else {
+		w->delay_ms = 0;
+	}
+	w->restart_at = now + w->delay_ms / 1000.0;
+
+	printf("worker %d exited (%s %d), restarting in %ums\n"
+		, (int)w->pid
+		, (WIFSIGNALED(status)) ? "signal" : "code"
+		, (WIFSIGNALED(status)) ? WTERMSIG(status) : WEXITSTATUS(status)
+		, w->delay_ms);
+	fflush(stdout);
+	w->pid = 0;
+}
+
+/** Master process: restart the workers that have exited.
+The signals from master_sigset() must be blocked before the workers are started. */
+void master()
+{
+	sigset_t mask;
+	master_sigset(&mask);
+
+	for (;;) {
+		// start the workers whose delay has passed; find the nearest restart time
+		double now = time_sec(), next = 0;
+		for (unsigned int i = 0;  i != n_workers;  i++) {
+			struct worker *w = &workers[i];
+			if (w->pid != 0)
+				continue;
+			if (w->restart_at <= now) {
+				w->pid = worker_start();
+				w->start = now;
+			} else if (next == 0 || w->restart_at < next) {
+				next = w->restart_at;
+			}
+		}
+
+		struct timespec ts, *timeout = NULL;
+		if (next != 0) {
+			double left = next - now;
+			ts.tv_sec = (time_t)left;
+			ts.tv_nsec = (long)((left - ts.tv_sec) * 1e9);
+			timeout = &ts;
+		}
+		siginfo_t si;
+		int sig = sigtimedwait(&mask, &si, timeout);
+		if (sig == -1) {
+			assert(errno == EAGAIN || errno == EINTR);
+			continue; // a restart is due
+		}
+		if (sig != SIGCHLD)
+			break; // SIGINT, SIGTERM
+
+		// several SIGCHLD may be merged into one: reap all exited children
+		int status;
+		pid_t p;
+		while (0 < (p = waitpid(-1, &status, WNOHANG))) {
+			for (unsigned int i = 0;  i != n_workers;  i++) {
+				if (workers[i].pid == p) {
+					worker_exited(&workers[i], status);
+					break;
+				}
+			}
+		}
+	}
+	workers_stop();
+}
+
+unsigned int bench_requests; // per client thread
+
+void* bench_client(void *param)
+{
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = ntohs(PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (unsigned int i = 0;  i != bench_requests;  i++) {
+		int sk = socket(AF_INET, SOCK_STREAM, 0);
+		assert(sk != -1);
+		assert(0 == connect(sk, (struct sockaddr*)&addr, sizeof(addr)));
+		char req[] = "GET / HTTP/1.1\r\n\r\n";
+		assert(sizeof(req)-1 == send(sk, req, sizeof(req)-1, 0));
+		char buf[1000];
+		while (0 < recv(sk, buf, sizeof(buf), 0)) {
+		}
+		close(sk);
+	}
+	return NULL;
+}
+
+/** Single process vs. N workers: 8 client threads make 'requests' connections in total */
+void bench(unsigned int n, unsigned int requests)
+{
+	unsigned int variants[] = { 1, n };
+	for (unsigned int v = 0;  v != 2;  v++) {
+		workers_start(variants[v]);
+
+		bench_requests = requests / 8;
+		pthread_t th[8];
+		double t = time_sec();
+		for (unsigned int i = 0;  i != 8;  i++) {
+			pthread_create(&th[i], NULL, bench_client, NULL);
+		}
+		for (unsigned int i = 0;  i != 8;  i++) {
+			pthread_join(th[i], NULL);
+		}
+		t = time_sec() - t;
+		printf("%s %u:  %.3fs  %.0f requests/s\n"
+			, (variants[v] == 1) ? "single process" : "workers", variants[v]
+			, t, bench_requests * 8 / t);
+		workers_stop();
+	}
+}
+
+void main(int argc, char **argv)
+{
+	listen_start();
+
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		unsigned int n = (argc > 2) ? atoi(argv[2]) : 4;
+		unsigned int requests = (argc > 3) ? atoi(argv[3]) : 20000;
+		assert(n != 0 && n <= WORKERS_MAX);
+		bench(n, requests);
+		close(lsock);
+		return;
+	}
+
+	unsigned int n = (argc > 1) ? atoi(argv[1]) : 4;
+	assert(n != 0 && n <= WORKERS_MAX);
+	sigset_t mask;
+	master_sigset(&mask);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	workers_start(n);
+	printf("listening on port %u with %u workers\n", PORT, n);
+	fflush(stdout);
+	master();
+	close(lsock);
+}
@@ -0,0 +1,583 @@
+/* Cross-Platform System Programming Guide: Linux: incremental directory tree index driven by inotify
+Usage:
+	./dir-index-inotify DIR
+	count
+	exists d1/file
+	ls d1
+	./dir-index-inotify test
+
+The tree is scanned once to build an in-memory index, and an inotify watch is added for each directory.
+Then inotify events are read from the epoll loop and applied to the index: create, delete, rename.
+A rename is a pair of IN_MOVED_FROM/IN_MOVED_TO events with the same cookie;
+ a moved directory keeps its watch and its indexed subtree.
+When the kernel's event queue overflows (IN_Q_OVERFLOW), we don't know what was lost,
+ so we compare each directory's mtime with the remembered one and rescan only the changed directories.
+After the events are applied, the remembered mtime of the changed directories is updated,
+ but only if the event queue is still empty after stat(): otherwise the new mtime may include a change whose event is lost.
+Queries are read line by line; several lines may arrive with one read().
+Queries (read from stdin) are answered from memory.
+The directories waiting to be scanned are kept in an explicit stack, and the getdents64() and path buffers are allocated once,
+ so the stack usage doesn't depend on the depth of the tree.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct node {
+	struct node *parent;
+	struct node *child; // the first child
+	struct node *prev, *next; // siblings
+	struct node *hnext; // hash chain
+	struct node *scan_next; // directories waiting to be scanned
+	char *name;
+	int wd; // directory: inotify watch descriptor
+	unsigned int is_dir;
+	struct timespec mtime; // directory: modification time at the moment of the last scan
+};
+
+#define INDEX_BUCKETS  (1024*1024)
+
+struct index {
+	int ino; // inotify descriptor
+	char *root_path;
+	struct node *root;
+	struct node **buckets; // (parent, name) -> node
+	struct node **wds; // watch descriptor -> directory node
+	size_t wds_cap;
+	unsigned long long files, dirs;
+	unsigned long long rescans;
+	struct node *scan_top; // directories waiting to be scanned
+	unsigned int scanning;
+	char *path; // PATH_MAX
+	char *dents; // getdents64() buffer
+	int *touched; // watch descriptors of the directories changed by the applied events
+	struct timespec *touched_mtime;
+	size_t ntouched, touched_cap;
+};
+
+#define DENTS_BUF  (64*1024)
+
+#define WATCH_MASK  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR)
+
+static unsigned int node_hash(const struct node *parent, const char *name)
+{
+	unsigned int h = 2166136261U ^ (unsigned int)((size_t)parent >> 4); // FNV-1a
+	for (;  *name != '\0';  name++) {
+		h = (h ^ (unsigned char)*name) * 16777619U;
+	}
+	return h & (INDEX_BUCKETS - 1);
+}
+
+static struct node* index_find_child(struct index *x, const struct node *parent, const char *name)
+{
+	for (struct node *n = x->buckets[node_hash(parent, name)];  n != NULL;  n = n->hnext) {
+		if (n->parent == parent && !strcmp(n->name, name))
+			return n;
+	}
+	return NULL;
+}
+
+static void _hash_remove(struct index *x, struct node *n)
+{
+	struct node **pp = &x->buckets[node_hash(n->parent, n->name)];
+	while (*pp != n)
+		pp = &(*pp)->hnext;
+	*pp = n->hnext;
+}
+
+/** Attach node to the parent under the specified name */
+static void _node_link(struct index *x, struct node *parent, struct node *n)
+{
+	n->parent = parent;
+	n->prev = NULL;
+	n->next = parent->child;
+	if (parent->child != NULL)
+		parent->child->prev = n;
+	parent->child = n;
+
+	unsigned int h = node_hash(parent, n->name);
+	n->hnext = x->buckets[h];
+	x->buckets[h] = n;
+}
+
+static void _node_unlink(struct index *x, struct node *n)
+{
+	_hash_remove(x, n);
+	if (n->prev != NULL)
+		n->prev->next = n->next;
+	else
+		n->parent->child = n->next;
+	if (n->next != NULL)
+		n->next->prev = n->prev;
+}
+
+/** Get the full path of the node */
+static void node_path(const struct index *x, const struct node *n, char *buf, size_t cap)
+{
+	if (n == x->root) {
+		snprintf(buf, cap, "%s", x->root_path);
+		return;
+	}
+	node_path(x, n->parent, buf, cap);
+	size_t len = strlen(buf);
+	snprintf(buf + len, cap - len, "/%s", n->name);
+}
+
+/** Remove the node and its subtree from the index */
+static void index_remove(struct index *x, struct node *n)
+{
+	while (n->child != NULL)
+		index_remove(x, n->child);
+
+	if (n->is_dir) {
+		if (n->wd >= 0) {
+			inotify_rm_watch(x->ino, n->wd); // fails if the kernel has already removed the watch
+			x->wds[n->wd] = NULL;
+		}
+		x->dirs--;
+	} else {
+		x->files--;
+	}
+	if (n->parent != NULL)
+		_node_unlink(x, n);
+	free(n->name);
+	free(n);
+}
+
+static void index_scan_dir(struct index *x, struct node *d);
+
+/** Add a new entry to the index; scan a new directory */
+static struct node* index_add(struct index *x, struct node *parent, const char *name, unsigned int is_dir)
+{
+	struct node *n = index_find_child(x, parent, name);
+	if (n != NULL)
+		return n;
+
+	n = calloc(1, sizeof(struct node));
+	n->name = strdup(name);
+	n->is_dir = is_dir;
+	n->wd = -1;
+	_node_link(x, parent, n);
+
+	if (is_dir) {
+		x->dirs++;
+		index_scan_dir(x, n);
+	} else {
+		x->files++;
+	}
+	return n;
+}
+
+/** Watch the directory, then read its contents and add them to the index.
+The watch is added first, so no changes are missed between the scan and the watch.
+The new subdirectories are pushed onto the scan stack. */
+static void _index_scan_one(struct index *x, struct node *d)
+{
+	char *path = x->path;
+	node_path(x, d, path, PATH_MAX);
+
+	if (d->wd < 0) {
+		d->wd = inotify_add_watch(x->ino, path, WATCH_MASK);
+		if (d->wd >= 0) {
+			if ((size_t)d->wd >= x->wds_cap) {
+				size_t cap = (d->wd + 1) * 2;
+				x->wds = realloc(x->wds, cap * sizeof(struct node*));
+				memset(x->wds + x->wds_cap, 0, (cap - x->wds_cap) * sizeof(struct node*));
+				x->wds_cap = cap;
+			}
+			x->wds[d->wd] = d;
+		}
+	}
+
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	struct stat st;
+	if (0 == fstat(fd, &st))
+		d->mtime = st.st_mtim;
+
+	char *buf = x->dents;
+	ssize_t r;
+	while (0 < (r = getdents64(fd, buf, DENTS_BUF))) {
+		for (ssize_t off = 0;  off < r;) {
+			const struct dirent64 *de = (void*)(buf + off);
+			off += de->d_reclen;
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+			index_add(x, d, de->d_name, (de->d_type == DT_DIR));
+		}
+	}
+	close(fd);
+}
+
+/** Scan the directory and all its new subdirectories */
+static void index_scan_dir(struct index *x, struct node *d)
+{
+	d->scan_next = x->scan_top;
+	x->scan_top = d;
+	if (x->scanning)
+		return; // called from _index_scan_one(): the caller's loop will pop it
+
+	x->scanning = 1;
+	while (x->scan_top != NULL) {
+		d = x->scan_top;
+		x->scan_top = d->scan_next;
+		_index_scan_one(x, d);
+	}
+	x->scanning = 0;
+}
+
+/** Rescan the directory: add new entries, remove the deleted ones */
+static void index_rescan_dir(struct index *x, struct node *d)
+{
+	x->rescans++;
+	char *path = x->path;
+	node_path(x, d, path, PATH_MAX);
+
+	// remove the entries that don't exist anymore
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	for (struct node *n = d->child, *next;  n != NULL;  n = next) {
+		next = n->next;
+		struct stat st;
+		if (fd < 0 || 0 != fstatat(fd, n->name, &st, AT_SYMLINK_NOFOLLOW)
+			|| !!S_ISDIR(st.st_mode) != n->is_dir)
+			index_remove(x, n);
+	}
+	if (fd >= 0)
+		close(fd);
+
+	// add new entries
+	index_scan_dir(x, d);
+}
+
+/** Get the first directory node in the sibling list */
+static struct node* _first_dir(struct node *n)
+{
+	while (n != NULL && !n->is_dir)
+		n = n->next;
+	return n;
+}
+
+/** After the queue overflow: rescan only the directories whose mtime has changed.
+The tree is walked in pre-order by following the parent and sibling links, without recursion. */
+static void index_rescan_changed(struct index *x)
+{
+	struct node *d = x->root;
+	for (;;) {
+		node_path(x, d, x->path, PATH_MAX);
+		struct stat st;
+		if (0 == stat(x->path, &st)
+			&& (st.st_mtim.tv_sec != d->mtime.tv_sec || st.st_mtim.tv_nsec != d->mtime.tv_nsec))
+			index_rescan_dir(x, d);
+
+		struct node *n = _first_dir(d->child);
+		while (n == NULL && d != x->root) {
+			n = _first_dir(d->next);
+			d = d->parent;
+		}
+		if (n == NULL)
+			break;
+		d = n;
+	}
+}
+
+int index_init(struct index *x, const char *path)
+{
+	x->ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (x->ino < 0)
+		return -1;
+	x->buckets = calloc(INDEX_BUCKETS, sizeof(struct node*));
+	x->path = malloc(PATH_MAX);
+	x->dents = malloc(DENTS_BUF);
+	x->root_path = strdup(path);
+	x->root = calloc(1, sizeof(struct node));
+	x->root->name = strdup("");
+	x->root->is_dir = 1;
+	x->root->wd = -1;
+	index_scan_dir(x, x->root);
+	return (x->root->wd >= 0) ? 0 : -1;
+}
+
+/** Find node by path relative to the root */
+struct node* index_lookup(struct index *x, const char *path)
+{
+	struct node *n = x->root;
+	char name[256];
+	while (*path != '\0' && n != NULL) {
+		const char *slash = strchrnul(path, '/');
+		size_t len = slash - path;
+		if (len >= sizeof(name))
+			return NULL; // longer than NAME_MAX: can't exist
+		if (len != 0) {
+			memcpy(name, path, len);
+			name[len] = '\0';
+			n = index_find_child(x, n, name);
+		}
+		path = (*slash != '\0') ? slash + 1 : slash;
+	}
+	return n;
+}
+
+/** Remember the directory changed by an event */
+static void _index_touch(struct index *x, int wd)
+{
+	if (x->ntouched != 0 && x->touched[x->ntouched - 1] == wd)
+		return;
+	if (x->ntouched == x->touched_cap) {
+		x->touched_cap = (x->touched_cap != 0) ? x->touched_cap * 2 : 64;
+		x->touched = realloc(x->touched, x->touched_cap * sizeof(int));
+		x->touched_mtime = realloc(x->touched_mtime, x->touched_cap * sizeof(struct timespec));
+	}
+	x->touched[x->ntouched++] = wd;
+}
+
+/** The events are applied: update mtime of the changed directories,
+ so that the next overflow doesn't rescan them again.
+A change made before stat() either has its event (or IN_Q_OVERFLOW) in the queue by now, or isn't in mtime:
+ if the queue isn't empty, keep the old values. */
+static void _index_touched_refresh(struct index *x)
+{
+	for (size_t i = 0;  i != x->ntouched;  i++) {
+		struct node *d = ((size_t)x->touched[i] < x->wds_cap) ? x->wds[x->touched[i]] : NULL;
+		struct stat st;
+		x->touched_mtime[i].tv_nsec = -1;
+		if (d != NULL) {
+			node_path(x, d, x->path, PATH_MAX);
+			if (0 == stat(x->path, &st))
+				x->touched_mtime[i] = st.st_mtim;
+		}
+	}
+
+	int queued;
+	if (0 == ioctl(x->ino, FIONREAD, &queued) && queued == 0) {
+		for (size_t i = 0;  i != x->ntouched;  i++) {
+			struct node *d = ((size_t)x->touched[i] < x->wds_cap) ? x->wds[x->touched[i]] : NULL;
+			if (d != NULL && x->touched_mtime[i].tv_nsec != -1)
+				d->mtime = x->touched_mtime[i];
+		}
+	}
+	x->ntouched = 0;
+}
+
+/** Read and apply all pending inotify events */
+void index_process_events(struct index *x)
+{
+	char buf[64*1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+	for (;;) {
+		ssize_t r = read(x->ino, buf, sizeof(buf));
+		if (r <= 0)
+			break;
+
+		// the node moved out of its directory, waiting for the IN_MOVED_TO event
+		struct node *moved = NULL;
+		unsigned int moved_cookie = 0;
+
+		for (ssize_t off = 0;  off < r;) {
+			const struct inotify_event *ev = (void*)(buf + off);
+			off += sizeof(struct inotify_event) + ev->len;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				index_rescan_changed(x);
+				continue;
+			}
+
+			struct node *d = (ev->wd >= 0 && (size_t)ev->wd < x->wds_cap) ? x->wds[ev->wd] : NULL;
+			if (d == NULL)
+				continue;
+
+			if (ev->mask & IN_IGNORED) {
+				// the watched directory was deleted
+				d->wd = -1;
+				x->wds[ev->wd] = NULL;
+				continue;
+			}
+			if (ev->len == 0)
+				continue;
+			_index_touch(x, ev->wd);
+
+			unsigned int is_dir = !!(ev->mask & IN_ISDIR);
+			struct node *n;
+
+			if (ev->mask & IN_CREATE) {
+				index_add(x, d, ev->name, is_dir);
+
+			} else if (ev->mask & IN_DELETE) {
+				if (NULL != (n = index_find_child(x, d, ev->name)))
+					index_remove(x, n);
+
+			} else if (ev->mask & IN_MOVED_FROM) {
+				if (moved != NULL)
+					index_remove(x, moved); // moved outside of the watched tree
+				moved = NULL;
+				if (NULL != (n = index_find_child(x, d, ev->name))) {
+					_node_unlink(x, n);
+					free(n->name);
+					n->name = strdup(""); // can't be found by name anymore
+					n->parent = NULL;
+					moved = n;
+					moved_cookie = ev->cookie;
+				}
+
+			} else if (ev->mask & IN_MOVED_TO) {
+				if (NULL != (n = index_find_child(x, d, ev->name)))
+					index_remove(x, n); // the target was replaced
+
+				if (moved != NULL && moved_cookie == ev->cookie) {
+					// rename within the tree: keep the node and its subtree
+					free(moved->name);
+					moved->name = strdup(ev->name);
+					_node_link(x, d, moved);
+					moved = NULL;
+				} else {
+					index_add(x, d, ev->name, is_dir); // moved into the watched tree
+				}
+			}
+		}
+
+		if (moved != NULL)
+			index_remove(x, moved);
+	}
+
+	if (x->ntouched != 0)
+		_index_touched_refresh(x);
+}
+
+/** Execute a query and print the result */
+void index_query(struct index *x, char *cmd)
+{
+	cmd[strcspn(cmd, "\r\n")] = '\0';
+	struct node *n;
+
+	if (!strcmp(cmd, "count")) {
+		printf("files:%llu  dirs:%llu  rescans:%llu\n", x->files, x->dirs, x->rescans);
+
+	} else if (!strncmp(cmd, "exists ", 7)) {
+		n = index_lookup(x, cmd + 7);
+		printf("%s\n", (n != NULL) ? "yes" : "no");
+
+	} else if (!strncmp(cmd, "ls", 2)) {
+		n = index_lookup(x, (cmd[2] == ' ') ? cmd + 3 : "");
+		for (n = (n != NULL) ? n->child : NULL;  n != NULL;  n = n->next) {
+			printf("%s%s\n", n->name, (n->is_dir) ? "/" : "");
+		}
+	}
+	fflush(stdout);
+}
+
+static void touch(const char *path)
+{
+	int f = open(path, O_CREAT | O_WRONLY | O_CLOEXEC, 0666);
+	assert(f >= 0);
+	close(f);
+}
+
+/** Create a test tree, change it and check that the index follows the changes */
+void test()
+{
+	system("rm -rf dir-index.tmp");
+	assert(0 == mkdir("dir-index.tmp", 0777));
+	assert(0 == mkdir("dir-index.tmp/d1", 0777));
+	touch("dir-index.tmp/d1/f1");
+
+	struct index x = {};
+	assert(0 == index_init(&x, "dir-index.tmp"));
+	assert(x.files == 1 && x.dirs == 1);
+
+	assert(0 == mkdir("dir-index.tmp/d2", 0777));
+	touch("dir-index.tmp/d2/f2");
+	assert(0 == rename("dir-index.tmp/d1", "dir-index.tmp/d2/d1"));
+	assert(0 == unlink("dir-index.tmp/d2/d1/f1"));
+	touch("dir-index.tmp/d2/d1/f3");
+	index_process_events(&x);
+
+	assert(NULL == index_lookup(&x, "d1"));
+	assert(NULL != index_lookup(&x, "d2/f2"));
+	assert(NULL == index_lookup(&x, "d2/d1/f1"));
+	assert(NULL != index_lookup(&x, "d2/d1/f3"));
+	index_query(&x, strdup("count"));
+
+	system("rm -rf dir-index.tmp");
+}
+
+void main(int argc, char **argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "test")) {
+		test();
+		return;
+	}
+
+	struct index x = {};
+	assert(0 == index_init(&x, (argc > 1) ? argv[1] : "."));
+	printf("indexed files:%llu  dirs:%llu\n", x.files, x.dirs);
+	fflush(stdout);
+
+	int kq = epoll_create1(EPOLL_CLOEXEC);
+	assert(kq != -1);
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = x.ino;
+	assert(0 == epoll_ctl(kq, EPOLL_CTL_ADD, x.ino, &event));
+	event.data.fd = STDIN_FILENO;
+	assert(0 == epoll_ctl(kq, EPOLL_CTL_ADD, STDIN_FILENO, &event));
+
+	char cmd[4096];
+	size_t cmd_len = 0;
+
+	for (;;) {
+		struct epoll_event events[2];
+		int n = epoll_wait(kq, events, 2, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		assert(n > 0);
+
+		for (int i = 0;  i != n;  i++) {
+			if (events[i].data.fd == x.ino) {
+				index_process_events(&x);
+
+			} else {
+				ssize_t r = read(STDIN_FILENO, cmd + cmd_len, sizeof(cmd) - 1 - cmd_len);
+				if (r <= 0) {
+					if (cmd_len != 0) {
+						// the last line without '\n'
+						cmd[cmd_len] = '\0';
+						index_process_events(&x);
+						index_query(&x, cmd);
+					}
+					return;
+				}
+				cmd_len += r;
+				// apply all changes made before the queries
+				index_process_events(&x);
+
+				// execute each complete line; keep the incomplete one for the next read
+				char *line = cmd, *end = cmd + cmd_len, *eol;
+				while (NULL != (eol = memchr(line, '\n', end - line))) {
+					*eol = '\0';
+					index_query(&x, line);
+					line = eol + 1;
+				}
+				cmd_len = end - line;
+				if (cmd_len == sizeof(cmd) - 1) {
+					// the line is too long: execute what we have
+					cmd[cmd_len] = '\0';
+					index_query(&x, cmd);
+					cmd_len = 0;
+				}
+				memmove(cmd, line, cmd_len);
+			}
+		}
+	}
+}
@@ -0,0 +1,439 @@
+/* Cross-Platform System Programming Guide: Linux: parallel recursive directory tree walker
+Usage:
+	./dir-walk DIR [THREADS]
+	./dir-walk create DIR 4 10 100
+	./dir-walk bench DIR [cold]
+
+Each worker thread owns a queue of directories to scan.
+A directory is read with getdents64(), the entry type is taken from d_type, so no stat() calls are needed.
+New subdirectories go to the back of the thread's own queue;
+ an idle thread steals the oldest directory (usually the biggest subtree) from the front of another thread's queue.
+When there's nothing to steal, the idle thread sleeps on a condition variable until a directory is queued
+ or the walk is complete.
+A queued directory is stored by its path and opened only when it's scanned,
+ so a thread holds only the descriptors of the directories it's currently reading.
+When the own queue is full, a subdirectory is opened with openat() relative to its parent's descriptor
+ and scanned recursively in place, so memory and descriptor usage is bounded.
+A directory that can't be opened is reported, the walk continues.
+Symbolic links inside the tree aren't followed, but the root directory itself may be a symbolic link.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/** User's callback; called concurrently from all worker threads.
+dir: path of the parent directory
+type: DT_* */
+typedef void (*walk_cb)(void *udata, const char *dir, const char *name, unsigned int type);
+
+struct walk_item {
+	char *path;
+	unsigned int root; // follow the symbolic link: this path is specified by the user
+};
+
+#define WALK_QUEUE_CAP  1024
+#define WALK_BUF_SIZE  (256*1024)
+
+struct walk_queue {
+	pthread_mutex_t lock;
+	struct walk_item items[WALK_QUEUE_CAP]; // circular buffer
+	unsigned int head, n;
+};
+
+struct walk_thread {
+	struct walk *w;
+	struct walk_queue q;
+	pthread_t th;
+	char **bufs; // getdents64() buffers for each level of in-place recursion
+	unsigned int nbufs;
+	unsigned long long entries;
+};
+
+typedef struct walk {
+	walk_cb cb;
+	void *udata;
+	unsigned int nthreads;
+	struct walk_thread *threads;
+	unsigned long long pending; // N of directories queued or being scanned (atomic)
+	unsigned long long errors; // (atomic)
+
+	// idle threads wait here for new items or the end of the walk
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	unsigned int queued; // N of items in all queues (atomic)
+	unsigned int sleepers; // (atomic)
+} walk;
+
+/** Owner: add item to the back.
+Return 0 if the queue is full */
+static int queue_push(struct walk_queue *q, struct walk_item it)
+{
+	int r = 0;
+	pthread_mutex_lock(&q->lock);
+	if (q->n != WALK_QUEUE_CAP) {
+		q->items[(q->head + q->n) % WALK_QUEUE_CAP] = it;
+		q->n++;
+		r = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return r;
+}
+
+/** Owner: take the newest item from the back (depth-first order keeps the queue short) */
+static int queue_pop(struct walk_queue *q, struct walk_item *it)
+{
+	int r = 0;
+	pthread_mutex_lock(&q->lock);
+	if (q->n != 0) {
+		q->n--;
+		*it = q->items[(q->head + q->n) % WALK_QUEUE_CAP];
+		r = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return r;
+}
+
+/** Thief: take the oldest item from the front */
+static int queue_steal(struct walk_queue *q, struct walk_item *it)
+{
+	if (__atomic_load_n(&q->n, __ATOMIC_RELAXED) == 0)
+		return 0;
+
+	int r = 0;
+	pthread_mutex_lock(&q->lock);
+	if (q->n != 0) {
+		*it = q->items[q->head];
+		q->head = (q->head + 1) % WALK_QUEUE_CAP;
+		q->n--;
+		r = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return r;
+}
+
+/** An item has been pushed to a queue: wake up an idle thread */
+static void walk_queued(walk *w)
+{
+	__atomic_fetch_add(&w->queued, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&w->sleepers, __ATOMIC_SEQ_CST) != 0) {
+		pthread_mutex_lock(&w->idle_lock);
+		pthread_cond_signal(&w->idle_cond);
+		pthread_mutex_unlock(&w->idle_lock);
+	}
+}
+
+/** A directory has been scanned (or skipped): wake up all threads when the walk is complete */
+static void walk_done(walk *w)
+{
+	if (1 == __atomic_fetch_sub(&w->pending, 1, __ATOMIC_ACQ_REL)) {
+		pthread_mutex_lock(&w->idle_lock);
+		pthread_cond_broadcast(&w->idle_cond);
+		pthread_mutex_unlock(&w->idle_lock);
+	}
+}
+
+/** Sleep until there's an item to steal or the walk is complete.
+The checks are made after 'sleepers' is incremented, and walk_queued() increments 'queued' before checking 'sleepers',
+ so either we see the new item or the producer sees us and signals. */
+static void walk_idle(walk *w)
+{
+	pthread_mutex_lock(&w->idle_lock);
+	__atomic_fetch_add(&w->sleepers, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&w->queued, __ATOMIC_SEQ_CST) == 0
+		&& __atomic_load_n(&w->pending, __ATOMIC_ACQUIRE) != 0)
+		pthread_cond_wait(&w->idle_cond, &w->idle_lock);
+	__atomic_fetch_sub(&w->sleepers, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&w->idle_lock);
+}
+
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char* path_join(const char *dir, const char *name)
+{
+	size_t dl = strlen(dir), nl = strlen(name);
+	char *p = malloc(dl + 1 + nl + 1);
+	memcpy(p, dir, dl);
+	p[dl] = '/';
+	memcpy(p + dl + 1, name, nl + 1);
+	return p;
+}
+
+static void walk_error(walk *w, const char *dir, const char *name)
+{
+	int e = errno;
+	__atomic_fetch_add(&w->errors, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&print_lock);
+	fprintf(stderr, "%s%s%s: %s\n", dir, (name != NULL) ? "/" : "", (name != NULL) ? name : "", strerror(e));
+	pthread_mutex_unlock(&print_lock);
+}
+
+/** Read all entries of the directory, then close it.
+level: recursion level; 0 for the items taken from a queue */
+static void walk_scan(struct walk_thread *t, int fd, struct walk_item it, unsigned int level)
+{
+	walk *w = t->w;
+	if (level == t->nbufs) {
+		t->bufs = realloc(t->bufs, (t->nbufs + 1) * sizeof(char*));
+		t->bufs[t->nbufs++] = malloc(WALK_BUF_SIZE);
+	}
+	char *buf = t->bufs[level];
+
+	for (;;) {
+		ssize_t r = getdents64(fd, buf, WALK_BUF_SIZE);
+		if (r < 0)
+			walk_error(w, it.path, NULL);
+		if (r <= 0)
+			break;
+
+		for (ssize_t off = 0;  off < r;) {
+			const struct dirent64 *de = (void*)(buf + off);
+			off += de->d_reclen;
+			if (de->d_name[0] == '.'
+				&& (de->d_name[1] == '\0'
+					|| (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+				continue;
+
+			unsigned int type = de->d_type;
+			if (type == DT_UNKNOWN) {
+				// some file systems don't fill d_type
+				struct stat st;
+				if (0 == fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+					type = (S_ISDIR(st.st_mode)) ? DT_DIR : DT_REG;
+			}
+
+			t->entries++;
+			if (w->cb != NULL)
+				w->cb(w->udata, it.path, de->d_name, type);
+
+			if (type != DT_DIR)
+				continue;
+
+			struct walk_item sub;
+			sub.path = path_join(it.path, de->d_name);
+			sub.root = 0;
+			__atomic_fetch_add(&w->pending, 1, __ATOMIC_RELAXED);
+			if (queue_push(&t->q, sub)) {
+				walk_queued(w);
+				continue;
+			}
+
+			// the queue is full: process the subtree right now
+			int sub_fd = openat(fd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (sub_fd < 0) {
+				walk_error(w, it.path, de->d_name);
+				free(sub.path);
+				walk_done(w);
+				continue;
+			}
+			walk_scan(t, sub_fd, sub, level + 1);
+		}
+	}
+
+	close(fd);
+	free(it.path);
+	walk_done(w);
+}
+
+/** Open and scan the directory taken from a queue */
+static void walk_scan_queued(struct walk_thread *t, struct walk_item it)
+{
+	int fd = open(it.path, O_RDONLY | O_DIRECTORY | ((it.root) ? 0 : O_NOFOLLOW) | O_CLOEXEC);
+	if (fd < 0) {
+		walk_error(t->w, it.path, NULL);
+		free(it.path);
+		walk_done(t->w);
+		return;
+	}
+	walk_scan(t, fd, it, 0);
+}
+
+static void* walk_worker(void *param)
+{
+	struct walk_thread *t = param;
+	walk *w = t->w;
+	unsigned int self = t - w->threads, victim = self;
+
+	for (;;) {
+		struct walk_item it;
+		if (queue_pop(&t->q, &it)) {
+			__atomic_fetch_sub(&w->queued, 1, __ATOMIC_SEQ_CST);
+			walk_scan_queued(t, it);
+			continue;
+		}
+
+		// try to steal work from other threads
+		int found = 0;
+		for (unsigned int i = 0;  i != w->nthreads;  i++) {
+			victim = (victim + 1) % w->nthreads;
+			if (victim != self && queue_steal(&w->threads[victim].q, &it)) {
+				found = 1;
+				break;
+			}
+		}
+		if (found) {
+			__atomic_fetch_sub(&w->queued, 1, __ATOMIC_SEQ_CST);
+			walk_scan_queued(t, it);
+			continue;
+		}
+
+		if (__atomic_load_n(&w->pending, __ATOMIC_ACQUIRE) == 0)
+			break;
+		walk_idle(w);
+	}
+	return NULL;
+}
+
+/** Walk the directory tree.
+errors: (optional) N of directories that couldn't be read; they're reported to stderr
+Return N of entries found;
+  <0 on error */
+long long walk_run(const char *path, unsigned int nthreads, walk_cb cb, void *udata, unsigned long long *errors)
+{
+	walk w = {};
+	w.cb = cb;
+	w.udata = udata;
+	w.nthreads = nthreads;
+	w.threads = calloc(nthreads, sizeof(struct walk_thread));
+
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		free(w.threads);
+		return -1;
+	}
+	close(fd);
+	struct walk_item root;
+	root.path = strdup(path);
+	root.root = 1;
+	w.pending = 1;
+	w.queued = 1;
+	pthread_mutex_init(&w.idle_lock, NULL);
+	pthread_cond_init(&w.idle_cond, NULL);
+
+	for (unsigned int i = 0;  i != nthreads;  i++) {
+		struct walk_thread *t = &w.threads[i];
+		t->w = &w;
+		pthread_mutex_init(&t->q.lock, NULL);
+	}
+	queue_push(&w.threads[0].q, root);
+
+	for (unsigned int i = 0;  i != nthreads;  i++) {
+		pthread_create(&w.threads[i].th, NULL, walk_worker, &w.threads[i]);
+	}
+
+	long long total = 0;
+	for (unsigned int i = 0;  i != nthreads;  i++) {
+		pthread_join(w.threads[i].th, NULL);
+		total += w.threads[i].entries;
+		pthread_mutex_destroy(&w.threads[i].q.lock);
+		for (unsigned int j = 0;  j != w.threads[i].nbufs;  j++) {
+			free(w.threads[i].bufs[j]);
+		}
+		free(w.threads[i].bufs);
+	}
+	free(w.threads);
+	pthread_cond_destroy(&w.idle_cond);
+	pthread_mutex_destroy(&w.idle_lock);
+	if (errors != NULL)
+		*errors = w.errors;
+	return total;
+}
+
+
+static void print_entry(void *udata, const char *dir, const char *name, unsigned int type)
+{
+	pthread_mutex_lock(&print_lock);
+	printf("%s/%s%s\n", dir, name, (type == DT_DIR) ? "/" : "");
+	pthread_mutex_unlock(&print_lock);
+}
+
+/** Create a test tree: 'fanout' subdirectories per level and 'files' files in each directory */
+static void create_tree(int dfd, unsigned int depth, unsigned int fanout, unsigned int files)
+{
+	char name[32];
+	for (unsigned int i = 0;  i != files;  i++) {
+		snprintf(name, sizeof(name), "f%u", i);
+		int f = openat(dfd, name, O_CREAT | O_WRONLY | O_CLOEXEC, 0666);
+		assert(f >= 0);
+		close(f);
+	}
+	if (depth == 0)
+		return;
+
+	for (unsigned int i = 0;  i != fanout;  i++) {
+		snprintf(name, sizeof(name), "d%u", i);
+		mkdirat(dfd, name, 0777);
+		int sub = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		assert(sub >= 0);
+		create_tree(sub, depth - 1, fanout, files);
+		close(sub);
+	}
+}
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Drop dentry and inode caches (root only) */
+static int drop_caches()
+{
+	sync();
+	int f = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (f < 0)
+		return -1;
+	int r = (2 == write(f, "2\n", 2)) ? 0 : -1;
+	close(f);
+	return r;
+}
+
+void main(int argc, char **argv)
+{
+	if (argc > 5 && !strcmp(argv[1], "create")) {
+		mkdir(argv[2], 0777);
+		int dfd = open(argv[2], O_RDONLY | O_DIRECTORY);
+		assert(dfd >= 0);
+		create_tree(dfd, atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+		close(dfd);
+		return;
+	}
+
+	if (argc > 2 && !strcmp(argv[1], "bench")) {
+		int cold = (argc > 3 && !strcmp(argv[3], "cold"));
+		for (unsigned int n = 1;  n <= 32;  n *= 2) {
+			if (cold && 0 != drop_caches()) {
+				puts("can't drop caches: need root");
+				cold = 0;
+			}
+			double t = time_sec();
+			long long entries = walk_run(argv[2], n, NULL, NULL, NULL);
+			assert(entries >= 0);
+			t = time_sec() - t;
+			printf("threads:%2u  %s  entries:%lld  %.3fs  %.0f entries/s\n"
+				, n, (cold) ? "cold" : "warm", entries, t, entries / t);
+		}
+		return;
+	}
+
+	const char *path = (argc > 1) ? argv[1] : ".";
+	unsigned int threads = (argc > 2) ? atoi(argv[2]) : 4;
+	if (threads == 0) {
+		fprintf(stderr, "THREADS must be at least 1\n");
+		return;
+	}
+	unsigned long long errors;
+	assert(0 <= walk_run(path, threads, print_entry, NULL, &errors));
+	if (errors != 0)
+		fprintf(stderr, "%llu directories couldn't be read\n", errors);
+}
@@ -0,0 +1,445 @@
+/* Cross-Platform System Programming Guide: Linux: fiber stacks with guard pages and overflow detection
+Usage:
+	./fiber-stack
+	./fiber-stack overflow
+	./fiber-stack bench [FIBERS] [STACK_KB]
+
+Each fiber (a coroutine switched with swapcontext()) needs its own stack.
+The stack pool reserves address space for many stacks with one mmap() call (a slab),
+ the physical memory is committed only for the pages the fiber actually touches,
+ so 100k fibers with 64KB stacks use only a few hundred MB of RAM.
+Below each stack there's a guard page: a fiber that overflows its stack hits the guard page
+ instead of silently corrupting the neighbouring stack.
+On Linux 6.13+ the guard pages are installed with madvise(MADV_GUARD_INSTALL),
+ which doesn't split the mapping: with mprotect(PROT_NONE) each stack would need 2 VMAs,
+ and the default limit is 65530 VMAs per process (/proc/sys/vm/max_map_count).
+The freed stacks are kept in the pool for the next fibers; their memory is released lazily with MADV_FREE.
+The SIGSEGV handler runs on the alternate signal stack (see signal-cpu-exception.c: CPSIG_STACK),
+ finds the stack that contains the fault address and reports which fiber has overflowed.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#ifndef MADV_GUARD_INSTALL
+	#define MADV_GUARD_INSTALL  102
+#endif
+
+#define SLAB_STACKS  1024
+#define SLABS_MAX  1024
+
+struct slab {
+	char *base;
+	void *owners[SLAB_STACKS]; // the user object of each stack, NULL if free
+};
+
+struct stack_pool {
+	size_t page, stack_size, slot_size; // slot: [guard page][stack]
+	int mprotect_guard; // MADV_GUARD_INSTALL isn't supported
+	struct slab *slabs[SLABS_MAX];
+	unsigned int n_slabs;
+	char **free; // free stacks (slot addresses)
+	size_t n_free, cap_free;
+};
+
+/** Initialize the pool of stacks of the specified size (rounded up to the page size) */
+void stack_pool_init(struct stack_pool *p, size_t stack_size)
+{
+	memset(p, 0, sizeof(*p));
+	p->page = sysconf(_SC_PAGESIZE);
+	p->stack_size = (stack_size + p->page - 1) & ~(p->page - 1);
+	p->slot_size = p->page + p->stack_size;
+}
+
+/** Reserve address space for SLAB_STACKS more stacks.
+Return 0 on success */
+static int stack_pool_grow(struct stack_pool *p)
+{
+	if (p->n_slabs == SLABS_MAX)
+		return -1;
+
+	size_t size = p->slot_size * SLAB_STACKS;
+	// no memory is committed until a page is touched
+	char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED)
+		return -1;
+
+	for (unsigned int i = 0;  i != SLAB_STACKS;  i++) {
+		char *guard = base + i * p->slot_size;
+		if (!p->mprotect_guard
+			&& 0 != madvise(guard, p->page, MADV_GUARD_INSTALL)) {
+			// EINVAL: old kernel; a seccomp policy may also return EPERM or ENOSYS
+			p->mprotect_guard = 1;
+		}
+		if (p->mprotect_guard
+			&& 0 != mprotect(guard, p->page, PROT_NONE)) {
+			int e = errno;
+			munmap(base, size);
+			errno = e;
+			return -1; // probably ENOMEM: the VMA limit is reached
+		}
+	}
+
+	struct slab *s = calloc(1, sizeof(struct slab));
+	s->base = base;
+
+	// the list must hold all stacks when they're returned
+	p->cap_free = (p->n_slabs + 1) * SLAB_STACKS;
+	p->free = realloc(p->free, p->cap_free * sizeof(char*));
+	// the first stacks are taken first: they're at the end of the list
+	for (unsigned int i = SLAB_STACKS;  i != 0;  i--) {
+		p->free[p->n_free++] = base + (i - 1) * p->slot_size;
+	}
+
+	// publish the slab only after it's ready: the signal handler may read it at any time
+	__atomic_store_n(&p->slabs[p->n_slabs], s, __ATOMIC_RELEASE);
+	__atomic_store_n(&p->n_slabs, p->n_slabs + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/** Get a stack.
+owner: user object associated with the stack (for stack_pool_find())
+Return the lowest address of the stack (its size is p->stack_size);
+  NULL on error */
+void* stack_get(struct stack_pool *p, void *owner)
+{
+	if (p->n_free == 0 && 0 != stack_pool_grow(p))
+		return NULL;
+
+	char *slot = p->free[--p->n_free];
+	for (unsigned int i = 0;  i != p->n_slabs;  i++) {
+		struct slab *s = p->slabs[i];
+		if (slot >= s->base && slot < s->base + p->slot_size * SLAB_STACKS) {
+			s->owners[(slot - s->base) / p->slot_size] = owner;
+			break;
+		}
+	}
+	return slot + p->page;
+}
+
+/** Return the stack to the pool */
+void stack_put(struct stack_pool *p, void *stack)
+{
+	char *slot = (char*)stack - p->page;
+	for (unsigned int i = 0;  i != p->n_slabs;  i++) {
+		struct slab *s = p->slabs[i];
+		if (slot >= s->base && slot < s->base + p->slot_size * SLAB_STACKS) {
+			s->owners[(slot - s->base) / p->slot_size] = NULL;
+			break;
+		}
+	}
+
+	// the top page is in use by every fiber: keep it;
+	//  the deeper pages may be reclaimed by the kernel if there's memory pressure
+	madvise(stack, p->stack_size - p->page, MADV_FREE);
+	p->free[p->n_free++] = slot;
+}
+
+/** Find the stack that contains the address.
+Async-signal-safe.
+guard: set to 1 if the address is within the stack's guard page
+Return the stack's owner;
+  NULL if not found */
+void* stack_pool_find(struct stack_pool *p, const void *addr, int *guard)
+{
+	const char *a = addr;
+	unsigned int n = __atomic_load_n(&p->n_slabs, __ATOMIC_ACQUIRE);
+	for (unsigned int i = 0;  i != n;  i++) {
+		struct slab *s = __atomic_load_n(&p->slabs[i], __ATOMIC_ACQUIRE);
+		if (a >= s->base && a < s->base + p->slot_size * SLAB_STACKS) {
+			size_t off = a - s->base;
+			*guard = (off % p->slot_size < p->page);
+			return s->owners[off / p->slot_size];
+		}
+	}
+	return NULL;
+}
+
+void stack_pool_destroy(struct stack_pool *p)
+{
+	for (unsigned int i = 0;  i != p->n_slabs;  i++) {
+		munmap(p->slabs[i]->base, p->slot_size * SLAB_STACKS);
+		free(p->slabs[i]);
+	}
+	free(p->free);
+}
+
+
+struct fiber {
+	ucontext_t ctx;
+	unsigned int id;
+	void *stack;
+	void (*func)(unsigned int arg);
+	unsigned int arg;
+	unsigned int done;
+};
+
+struct sched {
+	ucontext_t ctx;
+	struct stack_pool pool;
+	struct fiber *cur;
+	unsigned long long switches;
+};
+
+static struct sched sch;
+
+/** Switch from the current fiber to the scheduler */
+void fiber_yield()
+{
+	sch.switches++;
+	swapcontext(&sch.cur->ctx, &sch.ctx);
+}
+
+static void fiber_entry()
+{
+	struct fiber *f = sch.cur;
+	f->func(f->arg);
+	f->done = 1;
+	// return to the scheduler via uc_link
+}
+
+/** Create a fiber.
+Return NULL on error */
+struct fiber* fiber_create(unsigned int id, void (*func)(unsigned int arg), unsigned int arg)
+{
+	struct fiber *f = calloc(1, sizeof(struct fiber));
+	f->id = id;
+	f->func = func;
+	f->arg = arg;
+	f->stack = stack_get(&sch.pool, f);
+	if (f->stack == NULL) {
+		free(f);
+		return NULL;
+	}
+	getcontext(&f->ctx);
+	f->ctx.uc_stack.ss_sp = f->stack;
+	f->ctx.uc_stack.ss_size = sch.pool.stack_size;
+	f->ctx.uc_link = &sch.ctx;
+	makecontext(&f->ctx, fiber_entry, 0);
+	return f;
+}
+
+void fiber_free(struct fiber *f)
+{
+	stack_put(&sch.pool, f->stack);
+	free(f);
+}
+
+/** Run the fibers round-robin until all of them have finished; the finished fibers are freed */
+void fibers_run(struct fiber **fibers, unsigned int n)
+{
+	while (n != 0) {
+		for (unsigned int i = 0;  i < n;) {
+			struct fiber *f = fibers[i];
+			sch.cur = f;
+			swapcontext(&sch.ctx, &f->ctx);
+			if (f->done) {
+				fiber_free(f);
+				fibers[i] = fibers[--n];
+				continue;
+			}
+			i++;
+		}
+	}
+	sch.cur = NULL;
+}
+
+
+/** Async-signal-safe output */
+static void print_str(char *buf, size_t *len, const char *s)
+{
+	size_t n = strlen(s);
+	memcpy(buf + *len, s, n);
+	*len += n;
+}
+
+static void print_num(char *buf, size_t *len, unsigned long long v, unsigned int base)
+{
+	char s[24];
+	unsigned int i = sizeof(s);
+	do {
+		s[--i] = "0123456789abcdef"[v % base];
+		v /= base;
+	} while (v != 0);
+	memcpy(buf + *len, s + i, sizeof(s) - i);
+	*len += sizeof(s) - i;
+}
+
+static void segv_handler(int sig, siginfo_t *info, void *ucontext)
+{
+	char buf[256];
+	size_t n = 0;
+	int guard = 0;
+	struct fiber *f = stack_pool_find(&sch.pool, info->si_addr, &guard);
+	if (f != NULL && guard) {
+		print_str(buf, &n, "Stack overflow in fiber #");
+		print_num(buf, &n, f->id, 10);
+		print_str(buf, &n, ": stack size ");
+		print_num(buf, &n, sch.pool.stack_size, 10);
+		print_str(buf, &n, ", fault address 0x");
+	} else {
+		print_str(buf, &n, "Segmentation fault at 0x");
+	}
+	print_num(buf, &n, (unsigned long long)info->si_addr, 16);
+	print_str(buf, &n, "\n");
+	write(STDERR_FILENO, buf, n);
+	// SA_RESETHAND: the faulting instruction is executed again with the default action
+}
+
+/** Set up the alternate signal stack and the SIGSEGV handler */
+static void overflow_handler_init()
+{
+	stack_t st = {};
+	st.ss_size = 64*1024;
+	st.ss_sp = malloc(st.ss_size);
+	assert(0 == sigaltstack(&st, NULL));
+
+	struct sigaction sa = {};
+	sa.sa_sigaction = segv_handler;
+	sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESETHAND;
+	assert(0 == sigaction(SIGSEGV, &sa, NULL));
+}
+
+
+static void hello(unsigned int arg)
+{
+	for (unsigned int i = 0;  i != 3;  i++) {
+		printf("fiber #%u: step %u\n", arg, i);
+		fiber_yield();
+	}
+}
+
+static int recurse(int n)
+{
+	volatile char buf[256];
+	buf[0] = n;
+	return recurse(n + 1) + buf[0];
+}
+
+static void overflow(unsigned int arg)
+{
+	fiber_yield();
+	if (arg == 2)
+		recurse(0);
+}
+
+/** A typical fiber: uses some stack and yields several times */
+static void worker(unsigned int arg)
+{
+	volatile char buf[2048];
+	for (unsigned int i = 0;  i != 10;  i++) {
+		buf[i * 200] = i;
+		fiber_yield();
+	}
+}
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Return the resident memory size (MB) */
+static double rss_mb()
+{
+	unsigned long long size = 0, rss = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f != NULL) {
+		fscanf(f, "%llu %llu", &size, &rss);
+		fclose(f);
+	}
+	return rss * sysconf(_SC_PAGESIZE) / (1024.0*1024);
+}
+
+static unsigned int vma_count()
+{
+	unsigned int n = 0;
+	FILE *f = fopen("/proc/self/maps", "r");
+	if (f != NULL) {
+		int c;
+		while (EOF != (c = fgetc(f))) {
+			if (c == '\n')
+				n++;
+		}
+		fclose(f);
+	}
+	return n;
+}
+
+/** Run 'n' fibers at once, twice: the second round takes the stacks from the pool */
+void bench(unsigned int n, unsigned int stack_kb)
+{
+	stack_pool_init(&sch.pool, stack_kb * 1024);
+	struct fiber **fibers = calloc(n, sizeof(struct fiber*));
+	double rss0 = rss_mb();
+
+	for (unsigned int round = 1;  round <= 2;  round++) {
+		sch.switches = 0;
+		double t = time_sec();
+		for (unsigned int i = 0;  i != n;  i++) {
+			fibers[i] = fiber_create(i, worker, i);
+			if (fibers[i] == NULL) {
+				// with mprotect() guard pages each stack takes 2 VMAs: vm.max_map_count is reached first
+				printf("fiber_create: %s: stopped at %u fibers%s\n"
+					, strerror(errno), i, (sch.pool.mprotect_guard) ? " (VMA limit: /proc/sys/vm/max_map_count)" : "");
+				n = i;
+				break;
+			}
+		}
+		if (n == 0)
+			break;
+		double t_create = time_sec() - t;
+
+		// all fibers are alive after the first step
+		for (unsigned int i = 0;  i != n;  i++) {
+			sch.cur = fibers[i];
+			swapcontext(&sch.ctx, &fibers[i]->ctx);
+		}
+		double rss = rss_mb();
+		unsigned int vmas = vma_count();
+		fibers_run(fibers, n);
+		t = time_sec() - t;
+
+		printf("round %u: fibers:%u  stack:%uKB  guard:%s  create:%.3fs  total:%.3fs  %.1fM switches/s\n"
+			, round, n, stack_kb, (sch.pool.mprotect_guard) ? "mprotect" : "madvise"
+			, t_create, t, sch.switches / t / 1e6);
+		printf("  reserved:%.0fMB  RSS:%.0fMB (%.1fKB per fiber)  VMAs:%u\n"
+			, (double)sch.pool.n_slabs * SLAB_STACKS * sch.pool.slot_size / (1024*1024)
+			, rss, (rss - rss0) * 1024 / n, vmas);
+	}
+
+	free(fibers);
+	stack_pool_destroy(&sch.pool);
+}
+
+void main(int argc, char **argv)
+{
+	overflow_handler_init();
+
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		unsigned int n = (argc > 2) ? atoi(argv[2]) : 100000;
+		unsigned int stack_kb = (argc > 3) ? atoi(argv[3]) : 64;
+		bench(n, stack_kb);
+		return;
+	}
+
+	stack_pool_init(&sch.pool, 64*1024);
+	int ovf = (argc > 1 && !strcmp(argv[1], "overflow"));
+	struct fiber *fibers[3];
+	for (unsigned int i = 0;  i != 3;  i++) {
+		fibers[i] = fiber_create(i + 1, (ovf) ? overflow : hello, i + 1);
+		assert(fibers[i] != NULL);
+	}
+	fibers_run(fibers, 3);
+	stack_pool_destroy(&sch.pool);
+}
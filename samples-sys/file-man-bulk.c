@@ -0,0 +1,573 @@
+/* Cross-Platform System Programming Guide: Linux: parallel bulk delete and batch rename with *at() system calls
+Usage:
+	./file-man-bulk rm DIR [THREADS] [uring]
+	./file-man-bulk rename DIR SUFFIX [uring]
+	./file-man-bulk swap PATH1 PATH2
+	./file-man-bulk bench DIR 1000000
+
+file-man.c deletes or renames one file at a time using full paths,
+ so the kernel resolves the whole path for each call.
+Here all operations are relative to an open directory descriptor: unlinkat(), renameat2().
+renameat2() has flags: RENAME_NOREPLACE fails if the target exists (no check-then-rename race),
+ RENAME_EXCHANGE atomically swaps 2 files or directories.
+Bulk delete ("rm -rf") is parallel: each worker thread takes a directory from the shared stack,
+ removes its files and pushes its subdirectories.
+A directory has a counter of unfinished subdirectories: the last finished child removes its parent.
+Optionally, the file names of each getdents64() buffer are removed in a single io_uring batch
+ (IORING_OP_UNLINKAT, IORING_OP_RENAMEAT, Linux 5.11+).
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Minimal io_uring interface without liburing */
+struct uring {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned int entries;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+};
+
+/** Create io_uring object.
+Return 0 on success */
+int uring_init(struct uring *u, unsigned int entries)
+{
+	struct io_uring_params p = {};
+	u->fd = syscall(SYS_io_uring_setup, entries, &p);
+	if (u->fd < 0)
+		return -1;
+	u->entries = p.sq_entries;
+
+	u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_size > u->sq_size)
+			u->sq_size = u->cq_size;
+		u->cq_size = u->sq_size;
+	}
+
+	u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED)
+		goto err;
+	u->cq_ptr = u->sq_ptr;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ptr == MAP_FAILED)
+			goto err;
+	}
+	u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto err;
+
+	char *sq = u->sq_ptr, *cq = u->cq_ptr;
+	u->sq_head = (void*)(sq + p.sq_off.head);
+	u->sq_tail = (void*)(sq + p.sq_off.tail);
+	u->sq_mask = (void*)(sq + p.sq_off.ring_mask);
+	u->sq_array = (void*)(sq + p.sq_off.array);
+	u->cq_head = (void*)(cq + p.cq_off.head);
+	u->cq_tail = (void*)(cq + p.cq_off.tail);
+	u->cq_mask = (void*)(cq + p.cq_off.ring_mask);
+	u->cqes = (void*)(cq + p.cq_off.cqes);
+	return 0;
+
+err:
+	close(u->fd);
+	return -1;
+}
+
+void uring_close(struct uring *u)
+{
+	munmap(u->sqes, u->entries * sizeof(struct io_uring_sqe));
+	if (u->cq_ptr != u->sq_ptr)
+		munmap(u->cq_ptr, u->cq_size);
+	munmap(u->sq_ptr, u->sq_size);
+	close(u->fd);
+}
+
+/** Get a free submission entry; it's not visible to the kernel until uring_submit() */
+struct io_uring_sqe* uring_sqe(struct uring *u)
+{
+	unsigned int tail = *u->sq_tail;
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->entries)
+		return NULL;
+	unsigned int i = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[i] = i;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+/** Submit 'n' prepared entries and wait for 'wait' completions */
+int uring_submit(struct uring *u, unsigned int n, unsigned int wait)
+{
+	return syscall(SYS_io_uring_enter, u->fd, n, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+/** Get the next completion entry.
+Return NULL if there are none */
+struct io_uring_cqe* uring_cqe(struct uring *u)
+{
+	unsigned int head = *u->cq_head;
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &u->cqes[head & *u->cq_mask];
+}
+
+/** Release the completion entry returned by uring_cqe() */
+void uring_cqe_done(struct uring *u)
+{
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/** Submit the 'n' entries prepared with uring_sqe() and wait until all of them are complete.
+cb: called for each completion entry
+If io_uring_enter() fails, the entries the kernel hasn't taken yet are dropped,
+ but we still wait for the ones it has taken: they may be using the caller's buffers.
+Return N of dropped entries (their completions never arrive) */
+unsigned int uring_run(struct uring *u, unsigned int n, void (*cb)(void *udata, const struct io_uring_cqe *cqe), void *udata)
+{
+	unsigned int start = *u->sq_tail - n, expect = n, done = 0;
+	while (done != expect) {
+		unsigned int unsubmitted = *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+		int r = uring_submit(u, unsubmitted, expect - done);
+		if (r < 0 && errno != EINTR && unsubmitted != 0) {
+			unsigned int head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+			__atomic_store_n(u->sq_tail, head, __ATOMIC_RELEASE);
+			expect = head - start;
+		}
+
+		struct io_uring_cqe *cqe;
+		while (NULL != (cqe = uring_cqe(u))) {
+			cb(udata, cqe);
+			uring_cqe_done(u);
+			done++;
+		}
+	}
+	return n - expect;
+}
+
+static void _uring_count_failed(void *udata, const struct io_uring_cqe *cqe)
+{
+	if (cqe->res < 0)
+		(*(unsigned int*)udata)++;
+}
+
+/** Submit the prepared entries and wait for all of them.
+Return N of failed operations */
+static unsigned int uring_complete(struct uring *u, unsigned int n)
+{
+	unsigned int failed = 0;
+	unsigned int dropped = uring_run(u, n, _uring_count_failed, &failed);
+	return failed + dropped;
+}
+
+/** Rename the files inside a directory: names[i] -> new_names[i].
+flags: RENAME_NOREPLACE, RENAME_EXCHANGE
+u: io_uring object or NULL
+Return N of failed operations */
+unsigned int batch_rename(int dirfd, char **names, char **new_names, size_t n, unsigned int flags, struct uring *u)
+{
+	unsigned int failed = 0;
+	if (u == NULL) {
+		for (size_t i = 0;  i != n;  i++) {
+			if (0 != renameat2(dirfd, names[i], dirfd, new_names[i], flags))
+				failed++;
+		}
+		return failed;
+	}
+
+	for (size_t base = 0;  base < n;  base += u->entries) {
+		unsigned int batch = (n - base < u->entries) ? n - base : u->entries;
+		for (unsigned int i = 0;  i != batch;  i++) {
+			struct io_uring_sqe *sqe = uring_sqe(u);
+			sqe->opcode = IORING_OP_RENAMEAT;
+			sqe->fd = dirfd;
+			sqe->addr = (unsigned long)names[base + i];
+			sqe->len = dirfd; // new directory
+			sqe->addr2 = (unsigned long)new_names[base + i];
+			sqe->rename_flags = flags;
+		}
+		failed += uring_complete(u, batch);
+	}
+	return failed;
+}
+
+
+/** A directory being removed */
+struct rm_dir {
+	struct rm_dir *parent;
+	char *name;
+	int fd;
+	unsigned int refs; // 1 (while scanning) + N of unfinished subdirectories (atomic)
+	struct rm_dir *next; // stack link
+};
+
+struct rm_tree {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct rm_dir *stack;
+	int done, use_uring;
+	int root_fd; // descriptor of the parent of the root directory
+	unsigned long long removed, failed; // atomic
+};
+
+static void rm_push(struct rm_tree *t, struct rm_dir *d)
+{
+	pthread_mutex_lock(&t->lock);
+	d->next = t->stack;
+	t->stack = d;
+	pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+}
+
+/** Wait for the next directory.
+Return NULL when the whole tree is removed */
+static struct rm_dir* rm_pop(struct rm_tree *t)
+{
+	pthread_mutex_lock(&t->lock);
+	while (t->stack == NULL && !t->done) {
+		pthread_cond_wait(&t->cond, &t->lock);
+	}
+	struct rm_dir *d = t->stack;
+	if (d != NULL)
+		t->stack = d->next;
+	pthread_mutex_unlock(&t->lock);
+	return d;
+}
+
+/** Release the reference; remove the directory when it's empty, then release its parent */
+static void rm_release(struct rm_tree *t, struct rm_dir *d)
+{
+	while (d != NULL && 1 == __atomic_fetch_sub(&d->refs, 1, __ATOMIC_ACQ_REL)) {
+		struct rm_dir *parent = d->parent;
+		int opened = (d->fd >= 0);
+		if (opened)
+			close(d->fd);
+		int pfd = (parent != NULL) ? parent->fd : t->root_fd;
+		if (0 == unlinkat(pfd, d->name, AT_REMOVEDIR))
+			__atomic_fetch_add(&t->removed, 1, __ATOMIC_RELAXED);
+		else if (opened) // otherwise the error is already counted by rm_scan()
+			__atomic_fetch_add(&t->failed, 1, __ATOMIC_RELAXED);
+		free(d->name);
+		free(d);
+
+		if (parent == NULL) {
+			pthread_mutex_lock(&t->lock);
+			t->done = 1;
+			pthread_cond_broadcast(&t->cond);
+			pthread_mutex_unlock(&t->lock);
+		}
+		d = parent;
+	}
+}
+
+#define RM_BUF_SIZE  (256*1024)
+
+/** Remove all files in the directory, queue its subdirectories */
+static void rm_scan(struct rm_tree *t, struct rm_dir *d, char *buf, struct uring *u)
+{
+	int pfd = (d->parent != NULL) ? d->parent->fd : t->root_fd;
+	d->fd = openat(pfd, d->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (d->fd < 0) {
+		__atomic_fetch_add(&t->failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	ssize_t r;
+	while (0 < (r = getdents64(d->fd, buf, RM_BUF_SIZE))) {
+		unsigned int batch = 0, n = 0;
+		for (ssize_t off = 0;  off < r;) {
+			const struct dirent64 *de = (void*)(buf + off);
+			off += de->d_reclen;
+			if (de->d_name[0] == '.'
+				&& (de->d_name[1] == '\0'
+					|| (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+				continue;
+
+			unsigned int type = de->d_type;
+			if (type == DT_UNKNOWN) {
+				struct stat st;
+				if (0 == fstatat(d->fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+					type = (S_ISDIR(st.st_mode)) ? DT_DIR : DT_REG;
+			}
+
+			if (type == DT_DIR) {
+				struct rm_dir *sub = calloc(1, sizeof(struct rm_dir));
+				sub->parent = d;
+				sub->name = strdup(de->d_name);
+				sub->fd = -1;
+				sub->refs = 1;
+				__atomic_fetch_add(&d->refs, 1, __ATOMIC_RELAXED);
+				rm_push(t, sub);
+				continue;
+			}
+
+			n++;
+			if (u == NULL) {
+				if (0 != unlinkat(d->fd, de->d_name, 0))
+					__atomic_fetch_add(&t->failed, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+
+			// the names stay valid until the next getdents64() call
+			struct io_uring_sqe *sqe = uring_sqe(u);
+			sqe->opcode = IORING_OP_UNLINKAT;
+			sqe->fd = d->fd;
+			sqe->addr = (unsigned long)de->d_name;
+			if (++batch == u->entries) {
+				__atomic_fetch_add(&t->failed, uring_complete(u, batch), __ATOMIC_RELAXED);
+				batch = 0;
+			}
+		}
+		if (batch != 0)
+			__atomic_fetch_add(&t->failed, uring_complete(u, batch), __ATOMIC_RELAXED);
+		__atomic_fetch_add(&t->removed, n, __ATOMIC_RELAXED);
+	}
+}
+
+static void* rm_worker(void *param)
+{
+	struct rm_tree *t = param;
+	char *buf = malloc(RM_BUF_SIZE);
+	struct uring u, *pu = NULL;
+	if (t->use_uring) {
+		if (0 == uring_init(&u, 256))
+			pu = &u;
+		else
+			__atomic_fetch_add(&t->failed, 1, __ATOMIC_RELAXED); // still remove the files, but report the error
+	}
+
+	struct rm_dir *d;
+	while (NULL != (d = rm_pop(t))) {
+		rm_scan(t, d, buf, pu);
+		rm_release(t, d);
+	}
+
+	if (pu != NULL)
+		uring_close(pu);
+	free(buf);
+	return NULL;
+}
+
+/** Remove the directory tree ("rm -rf").
+use_uring: delete files via io_uring; fail without removing anything if io_uring is unavailable
+Return N of removed entries;
+  <0 if some entries couldn't be removed */
+long long tree_remove(const char *path, unsigned int nthreads, int use_uring)
+{
+	if (use_uring) {
+		struct uring u;
+		if (0 != uring_init(&u, 256))
+			return -1;
+		uring_close(&u);
+	}
+
+	struct rm_tree t = {};
+
+	// the root is removed relative to its parent directory: "a/b/" -> "a", "b"
+	char *p = strdup(path);
+	size_t len = strlen(p);
+	while (len > 1 && p[len - 1] == '/')
+		p[--len] = '\0';
+	if (!strcmp(p, "/") || len == 0) {
+		free(p);
+		errno = EINVAL; // the root directory has no parent
+		return -1;
+	}
+	char *slash = strrchr(p, '/');
+	const char *name = p;
+	if (slash != NULL) {
+		*slash = '\0';
+		name = slash + 1;
+	}
+	t.root_fd = open((slash == NULL) ? "." : (p[0] == '\0') ? "/" : p, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (t.root_fd < 0) {
+		free(p);
+		return -1;
+	}
+	pthread_mutex_init(&t.lock, NULL);
+	pthread_cond_init(&t.cond, NULL);
+	t.use_uring = use_uring;
+
+	struct rm_dir *root = calloc(1, sizeof(struct rm_dir));
+	root->name = strdup(name);
+	root->fd = -1;
+	root->refs = 1;
+	rm_push(&t, root);
+	free(p);
+
+	pthread_t *th = calloc(nthreads, sizeof(pthread_t));
+	for (unsigned int i = 0;  i != nthreads;  i++) {
+		pthread_create(&th[i], NULL, rm_worker, &t);
+	}
+	for (unsigned int i = 0;  i != nthreads;  i++) {
+		pthread_join(th[i], NULL);
+	}
+	free(th);
+
+	close(t.root_fd);
+	pthread_cond_destroy(&t.cond);
+	pthread_mutex_destroy(&t.lock);
+	return (t.failed == 0) ? (long long)t.removed : -1;
+}
+
+
+/** Read all file names from the directory */
+static char** dir_names(int dirfd, size_t *n)
+{
+	size_t cap = 1024;
+	char **names = malloc(cap * sizeof(char*));
+	*n = 0;
+	char *buf = malloc(1024*1024);
+	ssize_t r;
+	while (0 < (r = getdents64(dirfd, buf, 1024*1024))) {
+		for (ssize_t off = 0;  off < r;) {
+			const struct dirent64 *de = (void*)(buf + off);
+			off += de->d_reclen;
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") || de->d_type == DT_DIR)
+				continue;
+			if (*n == cap) {
+				cap *= 2;
+				names = realloc(names, cap * sizeof(char*));
+			}
+			names[(*n)++] = strdup(de->d_name);
+		}
+	}
+	free(buf);
+	return names;
+}
+
+/** Create a test tree with 'files' files: 1000 files per directory */
+static void create_tree(const char *path, unsigned int files)
+{
+	mkdir(path, 0777);
+	int dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	assert(dfd >= 0);
+	char name[32];
+	for (unsigned int d = 0;  d * 1000 < files;  d++) {
+		snprintf(name, sizeof(name), "d%u", d);
+		mkdirat(dfd, name, 0777);
+		int sub = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		assert(sub >= 0);
+		for (unsigned int i = d * 1000;  i != files && i != (d + 1) * 1000;  i++) {
+			snprintf(name, sizeof(name), "f%u", i);
+			int f = openat(sub, name, O_CREAT | O_WRONLY | O_CLOEXEC, 0666);
+			assert(f >= 0);
+			close(f);
+		}
+		close(sub);
+	}
+	close(dfd);
+}
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench(const char *path, unsigned int files)
+{
+	// GNU rm: single-threaded, fts walk with unlinkat() relative to directory descriptors
+	char cmd[4096];
+	create_tree(path, files);
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", path);
+	double t = time_sec();
+	assert(0 == system(cmd));
+	t = time_sec() - t;
+	printf("rm -rf:              %.3fs  %.0f files/s\n", t, files / t);
+
+	static const struct {
+		unsigned int threads, uring;
+	} modes[] = {
+		{ 1, 0 }, { 4, 0 }, { 1, 1 }, { 4, 1 },
+	};
+	for (unsigned int i = 0;  i != sizeof(modes) / sizeof(*modes);  i++) {
+		create_tree(path, files);
+		t = time_sec();
+		long long n = tree_remove(path, modes[i].threads, modes[i].uring);
+		t = time_sec() - t;
+		if (n < 0 && modes[i].uring) {
+			printf("io_uring unlinkat is not supported\n");
+			system(cmd);
+			continue;
+		}
+		assert(n >= 0);
+		printf("threads:%u  %s:  %.3fs  %.0f files/s\n"
+			, modes[i].threads, (modes[i].uring) ? "io_uring" : "unlinkat", t, files / t);
+	}
+}
+
+void main(int argc, char **argv)
+{
+	// a deep tree may need many open directory descriptors
+	struct rlimit rl;
+	if (0 == getrlimit(RLIMIT_NOFILE, &rl)) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if (argc > 2 && !strcmp(argv[1], "rm")) {
+		unsigned int threads = (argc > 3) ? atoi(argv[3]) : 4;
+		int use_uring = (argc > 4 && !strcmp(argv[4], "uring"));
+		long long n = tree_remove(argv[2], threads, use_uring);
+		assert(n >= 0);
+		printf("removed %lld entries\n", n);
+
+	} else if (argc > 3 && !strcmp(argv[1], "rename")) {
+		// add suffix to all files in the directory; never overwrite existing files
+		int dirfd = open(argv[2], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		assert(dirfd >= 0);
+		size_t n;
+		char **names = dir_names(dirfd, &n);
+		char **new_names = malloc(n * sizeof(char*));
+		for (size_t i = 0;  i != n;  i++) {
+			assert(0 < asprintf(&new_names[i], "%s%s", names[i], argv[3]));
+		}
+
+		struct uring u, *pu = NULL;
+		if (argc > 4 && !strcmp(argv[4], "uring")) {
+			assert(0 == uring_init(&u, 256));
+			pu = &u;
+		}
+		unsigned int failed = batch_rename(dirfd, names, new_names, n, RENAME_NOREPLACE, pu);
+		printf("renamed %zu files, %u failed\n", n - failed, failed);
+		if (pu != NULL)
+			uring_close(pu);
+
+		for (size_t i = 0;  i != n;  i++) {
+			free(names[i]);
+			free(new_names[i]);
+		}
+		free(names);
+		free(new_names);
+		close(dirfd);
+
+	} else if (argc > 3 && !strcmp(argv[1], "swap")) {
+		// atomically exchange 2 files or directories
+		assert(0 == renameat2(AT_FDCWD, argv[2], AT_FDCWD, argv[3], RENAME_EXCHANGE));
+
+	} else if (argc > 2 && !strcmp(argv[1], "bench")) {
+		bench(argv[2], (argc > 3) ? atoi(argv[3]) : 100000);
+	}
+}
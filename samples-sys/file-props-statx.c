@@ -0,0 +1,362 @@
+/* Cross-Platform System Programming Guide: Linux: batched file metadata collection with statx()
+Usage:
+	./file-props-statx [DIR]
+	./file-props-statx bench DIR
+
+file-props.c opens a file and calls fstat() on it.
+For millions of files we don't open anything: statx() is called relative to the directory descriptor,
+ with AT_STATX_DONT_SYNC (don't revalidate attributes on network file systems)
+ and with the mask containing only the fields we need (here: size and mtime).
+The calls may be issued asynchronously in batches via io_uring (IORING_OP_STATX, Linux 5.6+):
+ a single io_uring_enter() submits the whole batch and waits for its completion.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Minimal io_uring interface without liburing */
+struct uring {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned int entries;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+};
+
+/** Create io_uring object.
+Return 0 on success */
+int uring_init(struct uring *u, unsigned int entries)
+{
+	struct io_uring_params p = {};
+	u->fd = syscall(SYS_io_uring_setup, entries, &p);
+	if (u->fd < 0)
+		return -1;
+	u->entries = p.sq_entries;
+
+	u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_size > u->sq_size)
+			u->sq_size = u->cq_size;
+		u->cq_size = u->sq_size;
+	}
+
+	u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED)
+		goto err;
+	u->cq_ptr = u->sq_ptr;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ptr == MAP_FAILED)
+			goto err;
+	}
+	u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto err;
+
+	char *sq = u->sq_ptr, *cq = u->cq_ptr;
+	u->sq_head = (void*)(sq + p.sq_off.head);
+	u->sq_tail = (void*)(sq + p.sq_off.tail);
+	u->sq_mask = (void*)(sq + p.sq_off.ring_mask);
+	u->sq_array = (void*)(sq + p.sq_off.array);
+	u->cq_head = (void*)(cq + p.cq_off.head);
+	u->cq_tail = (void*)(cq + p.cq_off.tail);
+	u->cq_mask = (void*)(cq + p.cq_off.ring_mask);
+	u->cqes = (void*)(cq + p.cq_off.cqes);
+	return 0;
+
+err:
+	close(u->fd);
+	return -1;
+}
+
+void uring_close(struct uring *u)
+{
+	munmap(u->sqes, u->entries * sizeof(struct io_uring_sqe));
+	if (u->cq_ptr != u->sq_ptr)
+		munmap(u->cq_ptr, u->cq_size);
+	munmap(u->sq_ptr, u->sq_size);
+	close(u->fd);
+}
+
+/** Get a free submission entry; it's not visible to the kernel until uring_submit() */
+struct io_uring_sqe* uring_sqe(struct uring *u)
+{
+	unsigned int tail = *u->sq_tail;
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->entries)
+		return NULL;
+	unsigned int i = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[i] = i;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+/** Submit 'n' prepared entries and wait for 'wait' completions */
+int uring_submit(struct uring *u, unsigned int n, unsigned int wait)
+{
+	return syscall(SYS_io_uring_enter, u->fd, n, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+/** Get the next completion entry.
+Return NULL if there are none */
+struct io_uring_cqe* uring_cqe(struct uring *u)
+{
+	unsigned int head = *u->cq_head;
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &u->cqes[head & *u->cq_mask];
+}
+
+/** Release the completion entry returned by uring_cqe() */
+void uring_cqe_done(struct uring *u)
+{
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/** Submit the 'n' entries prepared with uring_sqe() and wait until all of them are complete.
+cb: called for each completion entry
+If io_uring_enter() fails, the entries the kernel hasn't taken yet are dropped,
+ but we still wait for the ones it has taken: they may be using the caller's buffers.
+Return N of dropped entries (their completions never arrive) */
+unsigned int uring_run(struct uring *u, unsigned int n, void (*cb)(void *udata, const struct io_uring_cqe *cqe), void *udata)
+{
+	unsigned int start = *u->sq_tail - n, expect = n, done = 0;
+	while (done != expect) {
+		unsigned int unsubmitted = *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+		int r = uring_submit(u, unsubmitted, expect - done);
+		if (r < 0 && errno != EINTR && unsubmitted != 0) {
+			unsigned int head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+			__atomic_store_n(u->sq_tail, head, __ATOMIC_RELEASE);
+			expect = head - start;
+		}
+
+		struct io_uring_cqe *cqe;
+		while (NULL != (cqe = uring_cqe(u))) {
+			cb(udata, cqe);
+			uring_cqe_done(u);
+			done++;
+		}
+	}
+	return n - expect;
+}
+
+
+struct fmeta {
+	unsigned long long size;
+	long long mtime_sec;
+	int err; // 0 or errno value
+};
+
+#define FMETA_MASK  (STATX_SIZE | STATX_MTIME)
+#define FMETA_FLAGS  (AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC)
+
+static void fmeta_from_statx(struct fmeta *m, const struct statx *stx)
+{
+	m->size = stx->stx_size;
+	m->mtime_sec = stx->stx_mtime.tv_sec;
+	m->err = 0;
+}
+
+/** Get metadata of the files inside a directory with synchronous statx() calls */
+void fmeta_collect(int dirfd, char **names, size_t n, struct fmeta *out)
+{
+	for (size_t i = 0;  i != n;  i++) {
+		struct statx stx;
+		if (0 != statx(dirfd, names[i], FMETA_FLAGS, FMETA_MASK, &stx)) {
+			out[i].err = errno;
+			continue;
+		}
+		fmeta_from_statx(&out[i], &stx);
+	}
+}
+
+struct fmeta_batch {
+	struct fmeta *out;
+	const struct statx *stx;
+};
+
+static void _fmeta_complete(void *udata, const struct io_uring_cqe *cqe)
+{
+	struct fmeta_batch *b = udata;
+	unsigned int i = cqe->user_data;
+	if (cqe->res < 0)
+		b->out[i].err = -cqe->res;
+	else
+		fmeta_from_statx(&b->out[i], &b->stx[i]);
+}
+
+/** Get metadata via io_uring: submit up to u->entries statx requests at once.
+Return 0 on success */
+int fmeta_collect_uring(struct uring *u, int dirfd, char **names, size_t n, struct fmeta *out)
+{
+	struct statx *stx = malloc(u->entries * sizeof(struct statx));
+	if (stx == NULL)
+		return -1;
+
+	int rc = 0;
+	for (size_t base = 0;  base < n;  base += u->entries) {
+		unsigned int batch = (n - base < u->entries) ? n - base : u->entries;
+		for (unsigned int i = 0;  i != batch;  i++) {
+			struct io_uring_sqe *sqe = uring_sqe(u);
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = dirfd;
+			sqe->addr = (unsigned long)names[base + i];
+			sqe->len = FMETA_MASK;
+			sqe->off = (unsigned long)&stx[i];
+			sqe->statx_flags = FMETA_FLAGS;
+			sqe->user_data = i;
+		}
+
+		// uring_run() returns only when the kernel doesn't use 'stx' anymore
+		struct fmeta_batch b = { out + base, stx };
+		if (0 != uring_run(u, batch, _fmeta_complete, &b)) {
+			rc = -1;
+			break;
+		}
+	}
+
+	free(stx);
+	return rc;
+}
+
+/** Read all file names from the directory */
+static char** dir_names(int dirfd, size_t *n)
+{
+	size_t cap = 1024;
+	char **names = malloc(cap * sizeof(char*));
+	*n = 0;
+	char *buf = malloc(1024*1024);
+	ssize_t r;
+	while (0 < (r = getdents64(dirfd, buf, 1024*1024))) {
+		for (ssize_t off = 0;  off < r;) {
+			const struct dirent64 *de = (void*)(buf + off);
+			off += de->d_reclen;
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+			if (*n == cap) {
+				cap *= 2;
+				names = realloc(names, cap * sizeof(char*));
+			}
+			names[(*n)++] = strdup(de->d_name);
+		}
+	}
+	free(buf);
+	return names;
+}
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long total_size(const struct fmeta *m, size_t n)
+{
+	unsigned long long total = 0;
+	for (size_t i = 0;  i != n;  i++) {
+		if (m[i].err == 0)
+			total += m[i].size;
+	}
+	return total;
+}
+
+void bench(int dirfd, char **names, size_t n)
+{
+	struct fmeta *m = calloc(n, sizeof(struct fmeta));
+
+	// file-props.c way: open + fstat + close
+	double t = time_sec();
+	for (size_t i = 0;  i != n;  i++) {
+		int f = openat(dirfd, names[i], O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+		if (f < 0)
+			continue;
+		struct stat st;
+		if (0 == fstat(f, &st))
+			m[i].size = st.st_size;
+		close(f);
+	}
+	printf("open+fstat:    %.3fs  total size:%llu\n", time_sec() - t, total_size(m, n));
+
+	t = time_sec();
+	for (size_t i = 0;  i != n;  i++) {
+		struct stat st;
+		if (0 == fstatat(dirfd, names[i], &st, AT_SYMLINK_NOFOLLOW))
+			m[i].size = st.st_size;
+	}
+	printf("fstatat:       %.3fs  total size:%llu\n", time_sec() - t, total_size(m, n));
+
+	memset(m, 0, n * sizeof(struct fmeta));
+	t = time_sec();
+	fmeta_collect(dirfd, names, n, m);
+	printf("statx:         %.3fs  total size:%llu\n", time_sec() - t, total_size(m, n));
+
+	struct uring u;
+	if (0 != uring_init(&u, 256)) {
+		printf("io_uring: %s\n", strerror(errno));
+	} else {
+		memset(m, 0, n * sizeof(struct fmeta));
+		t = time_sec();
+		assert(0 == fmeta_collect_uring(&u, dirfd, names, n, m));
+		printf("io_uring statx:%.3fs  total size:%llu\n", time_sec() - t, total_size(m, n));
+		uring_close(&u);
+	}
+	free(m);
+}
+
+void main(int argc, char **argv)
+{
+	int is_bench = (argc > 2 && !strcmp(argv[1], "bench"));
+	const char *path = (is_bench) ? argv[2] : (argc > 1) ? argv[1] : ".";
+
+	int dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	assert(dirfd >= 0);
+	size_t n;
+	char **names = dir_names(dirfd, &n);
+
+	if (is_bench) {
+		bench(dirfd, names, n);
+
+	} else {
+		struct fmeta *m = calloc(n, sizeof(struct fmeta));
+		struct uring u;
+		int ok = 0;
+		if (0 == uring_init(&u, 64)) {
+			ok = (0 == fmeta_collect_uring(&u, dirfd, names, n, m));
+			uring_close(&u);
+		}
+		if (!ok)
+			fmeta_collect(dirfd, names, n, m); // io_uring is not available
+
+		for (size_t i = 0;  i != n;  i++) {
+			if (m[i].err != 0)
+				printf("%s: %s\n", names[i], strerror(m[i].err));
+			else
+				printf("%10llu %lld %s\n", m[i].size, m[i].mtime_sec, names[i]);
+		}
+		free(m);
+	}
+
+	for (size_t i = 0;  i != n;  i++) {
+		free(names[i]);
+	}
+	free(names);
+	close(dirfd);
+}
@@ -0,0 +1,320 @@
+/* Cross-Platform System Programming Guide: Linux: serve file data directly from file mappings
+Usage:
+	./fmap-cache FILE...
+	./fmap-cache bench 64 256
+
+A file is mapped on the first request and stays in the cache until the total mapped size exceeds the limit.
+Then the least recently used mappings are evicted:
+ madvise(MADV_DONTNEED) drops their page table entries and munmap() releases the address range.
+A request is served with a single writev() call directly from the mapped memory.
+The bench mode compares this with pread() into a buffer + writev() for random slices of a hot file set.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef int file;
+#define FILE_NULL  (-1)
+#define FILE_READ  O_RDONLY
+
+file file_open(const char *name, unsigned int flags)
+{
+	return open(name, flags, 0666);
+}
+
+int file_close(file f)
+{
+	return close(f);
+}
+
+typedef int filemap;
+
+#define FMAP_READ  PROT_READ
+#define FMAP_SHARED  MAP_SHARED
+
+/** Map file region into memory
+Return NULL on error */
+void* fmap_map(filemap f, unsigned long long offset, size_t size, int prot, int flags)
+{
+	void *h = mmap(NULL, size, prot, flags, f, offset);
+	return (h != MAP_FAILED) ? h : NULL;
+}
+
+/** Unmap the previously mapped region */
+int fmap_unmap(void *p, size_t sz)
+{
+	return munmap(p, sz);
+}
+
+
+struct fcache_ent {
+	struct fcache_ent *lru_prev, *lru_next; // lru_next: less recently used
+	struct fcache_ent *hash_next;
+	char *m;
+	size_t size;
+	char *name;
+};
+
+#define FCACHE_BUCKETS  1024
+
+typedef struct {
+	struct fcache_ent *buckets[FCACHE_BUCKETS];
+	struct fcache_ent *lru_first, *lru_last; // most and least recently used
+	size_t mapped, mapped_max;
+	unsigned long long hits, misses, evictions;
+} fcache;
+
+static unsigned int fcache_hash(const char *s)
+{
+	unsigned int h = 2166136261U; // FNV-1a
+	for (;  *s != '\0';  s++) {
+		h = (h ^ (unsigned char)*s) * 16777619U;
+	}
+	return h % FCACHE_BUCKETS;
+}
+
+static void _fcache_lru_unlink(fcache *c, struct fcache_ent *e)
+{
+	if (e->lru_prev != NULL)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		c->lru_first = e->lru_next;
+	if (e->lru_next != NULL)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		c->lru_last = e->lru_prev;
+}
+
+static void _fcache_lru_push(fcache *c, struct fcache_ent *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = c->lru_first;
+	if (c->lru_first != NULL)
+		c->lru_first->lru_prev = e;
+	c->lru_first = e;
+	if (c->lru_last == NULL)
+		c->lru_last = e;
+}
+
+/** Unmap the least recently used file */
+static void _fcache_evict(fcache *c)
+{
+	struct fcache_ent *e = c->lru_last;
+	_fcache_lru_unlink(c, e);
+
+	struct fcache_ent **pp = &c->buckets[fcache_hash(e->name)];
+	while (*pp != e)
+		pp = &(*pp)->hash_next;
+	*pp = e->hash_next;
+
+	// tell the kernel we don't need these pages in our address space;
+	// the data stays in page cache and is still available for other processes
+	madvise(e->m, e->size, MADV_DONTNEED);
+	fmap_unmap(e->m, e->size);
+	c->mapped -= e->size;
+	c->evictions++;
+	free(e->name);
+	free(e);
+}
+
+/** Initialize cache.
+mapped_max: the limit for the total size of all mappings */
+void fcache_init(fcache *c, size_t mapped_max)
+{
+	memset(c, 0, sizeof(*c));
+	c->mapped_max = mapped_max;
+}
+
+void fcache_destroy(fcache *c)
+{
+	while (c->lru_last != NULL)
+		_fcache_evict(c);
+}
+
+/** Get file data; map the file on the first request.
+Return NULL on error */
+const struct fcache_ent* fcache_get(fcache *c, const char *name)
+{
+	unsigned int h = fcache_hash(name);
+	for (struct fcache_ent *e = c->buckets[h];  e != NULL;  e = e->hash_next) {
+		if (!strcmp(e->name, name)) {
+			c->hits++;
+			if (e != c->lru_first) {
+				_fcache_lru_unlink(c, e);
+				_fcache_lru_push(c, e);
+			}
+			return e;
+		}
+	}
+	c->misses++;
+
+	file f = file_open(name, FILE_READ);
+	if (f == FILE_NULL)
+		return NULL;
+	struct stat st;
+	struct fcache_ent *e = NULL;
+	if (0 != fstat(f, &st)
+		|| st.st_size == 0
+		|| NULL == (e = calloc(1, sizeof(struct fcache_ent))))
+		goto err;
+
+	e->size = st.st_size;
+	if (NULL == (e->name = strdup(name)))
+		goto err;
+	if (NULL == (e->m = fmap_map(f, 0, e->size, FMAP_READ, FMAP_SHARED)))
+		goto err;
+	file_close(f); // the mapping holds the reference to the file
+
+	while (c->lru_last != NULL && c->mapped + e->size > c->mapped_max)
+		_fcache_evict(c);
+
+	e->hash_next = c->buckets[h];
+	c->buckets[h] = e;
+	_fcache_lru_push(c, e);
+	c->mapped += e->size;
+	return e;
+
+err:
+	if (e != NULL)
+		free(e->name);
+	free(e);
+	file_close(f);
+	return NULL;
+}
+
+/** Send the header and the file slice to the output descriptor without copying the data into a buffer.
+Return N of bytes written;
+  <0 on error */
+ssize_t fcache_serve(fcache *c, int fd, const char *name, size_t off, size_t len)
+{
+	const struct fcache_ent *e = fcache_get(c, name);
+	if (e == NULL)
+		return -1;
+
+	if (off > e->size)
+		off = e->size;
+	if (len > e->size - off)
+		len = e->size - off;
+
+	char hdr[64];
+	struct iovec iov[2] = {
+		{ hdr, snprintf(hdr, sizeof(hdr), "%zu:", len) },
+		{ e->m + off, len },
+	};
+	return writev(fd, iov, 2);
+}
+
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Start a process which reads and discards all data from the socket pair */
+static pid_t sink_start(int sk[2])
+{
+	pid_t p = fork();
+	if (p == 0) {
+		close(sk[0]); // otherwise we never get EOF
+		char buf[64*1024];
+		while (read(sk[1], buf, sizeof(buf)) > 0) {
+		}
+		_exit(0);
+	}
+	return p;
+}
+
+void bench(unsigned int nfiles, unsigned int file_kb)
+{
+	char name[64];
+	char *data = malloc(file_kb * 1024);
+	memset(data, 'x', file_kb * 1024);
+	for (unsigned int i = 0;  i != nfiles;  i++) {
+		snprintf(name, sizeof(name), "fmap-cache.%u.tmp", i);
+		int f = open(name, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+		assert(f != -1);
+		assert(file_kb * 1024 == write(f, data, file_kb * 1024));
+		close(f);
+	}
+
+	const unsigned int requests = 200000, slice = 16*1024;
+	int sk[2];
+	assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sk));
+	pid_t p = sink_start(sk);
+
+	// mmap + writev
+	fcache c;
+	fcache_init(&c, nfiles * file_kb * 1024ULL);
+	unsigned int x = 1;
+	double t = time_sec();
+	for (unsigned int i = 0;  i != requests;  i++) {
+		x = x * 1103515245 + 12345;
+		snprintf(name, sizeof(name), "fmap-cache.%u.tmp", (x >> 8) % nfiles);
+		assert(0 < fcache_serve(&c, sk[0], name, ((x >> 4) % file_kb) * 1024, slice));
+	}
+	double t_map = time_sec() - t;
+	printf("mmap+writev: %.0f req/s  (hits:%llu misses:%llu evictions:%llu)\n"
+		, requests / t_map, c.hits, c.misses, c.evictions);
+	fcache_destroy(&c);
+
+	// descriptors are opened once; each request copies the data into a buffer
+	int *fds = calloc(nfiles, sizeof(int));
+	for (unsigned int i = 0;  i != nfiles;  i++) {
+		snprintf(name, sizeof(name), "fmap-cache.%u.tmp", i);
+		assert(-1 != (fds[i] = open(name, O_RDONLY)));
+	}
+	x = 1;
+	t = time_sec();
+	for (unsigned int i = 0;  i != requests;  i++) {
+		x = x * 1103515245 + 12345;
+		ssize_t n = pread(fds[(x >> 8) % nfiles], data, slice, ((x >> 4) % file_kb) * 1024);
+		assert(n >= 0);
+		char hdr[64];
+		int hn = snprintf(hdr, sizeof(hdr), "%zd:", n);
+		struct iovec iov[2] = { { hdr, hn }, { data, n } };
+		assert(0 < writev(sk[0], iov, 2));
+	}
+	double t_read = time_sec() - t;
+	printf("read+writev: %.0f req/s\n", requests / t_read);
+
+	close(sk[0]);
+	close(sk[1]);
+	waitpid(p, NULL, 0);
+	for (unsigned int i = 0;  i != nfiles;  i++) {
+		close(fds[i]);
+		snprintf(name, sizeof(name), "fmap-cache.%u.tmp", i);
+		unlink(name);
+	}
+	free(fds);
+	free(data);
+}
+
+void main(int argc, char **argv)
+{
+	if (argc > 3 && !strcmp(argv[1], "bench")) {
+		bench(atoi(argv[2]), atoi(argv[3]));
+		return;
+	}
+
+	// print the first 100 bytes of each file to stdout
+	fcache c;
+	fcache_init(&c, 64*1024*1024);
+	for (int i = 1;  i < argc;  i++) {
+		assert(0 < fcache_serve(&c, STDOUT_FILENO, argv[i], 0, 100));
+		assert(0 < write(STDOUT_FILENO, "\n", 1));
+	}
+	fcache_destroy(&c);
+}
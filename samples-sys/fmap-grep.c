@@ -0,0 +1,428 @@
+/* Cross-Platform System Programming Guide: Linux: parallel line indexer and fixed-string search over file mappings
+Usage:
+	./fmap-grep PATTERN FILE [THREADS]
+	./fmap-grep bench PATTERN FILE [THREADS]
+
+The file is split into large windows; worker threads take the windows one by one,
+ map them and search for new-line characters and for the pattern with AVX2 (or with a scalar fallback).
+The line-offset index is saved to FILE.idx (delta-encoded varints);
+ next time, if the file's size and mtime are the same, the index is loaded and only the pattern is searched.
+The bench mode compares the search with a single-threaded read() + memchr() + memmem() loop.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#if defined __x86_64__ || defined __i386__
+#include <immintrin.h>
+#define HAVE_AVX2_KERNELS
+#endif
+
+typedef int file;
+#define FILE_NULL  (-1)
+#define FILE_READ  O_RDONLY
+
+file file_open(const char *name, unsigned int flags)
+{
+	return open(name, flags, 0666);
+}
+
+int file_close(file f)
+{
+	return close(f);
+}
+
+typedef int filemap;
+
+#define FMAP_READ  PROT_READ
+#define FMAP_SHARED  MAP_SHARED
+
+/** Map file region into memory
+Return NULL on error */
+void* fmap_map(filemap f, unsigned long long offset, size_t size, int prot, int flags)
+{
+	void *h = mmap(NULL, size, prot, flags, f, offset);
+	return (h != MAP_FAILED) ? h : NULL;
+}
+
+/** Unmap the previously mapped region */
+int fmap_unmap(void *p, size_t sz)
+{
+	return munmap(p, sz);
+}
+
+
+/** Growable array of offsets */
+struct offsets {
+	unsigned long long *ptr;
+	size_t len, cap;
+};
+
+static inline void offsets_add(struct offsets *a, unsigned long long off)
+{
+	if (a->len == a->cap) {
+		a->cap = (a->cap != 0) ? a->cap * 2 : 1024;
+		a->ptr = realloc(a->ptr, a->cap * sizeof(*a->ptr));
+		assert(a->ptr != NULL);
+	}
+	a->ptr[a->len++] = off;
+}
+
+/** Find all new-line characters in p[0..n) */
+static void nl_scan_scalar(const char *p, size_t n, unsigned long long base, struct offsets *out)
+{
+	const char *end = p + n, *s = p;
+	while (NULL != (s = memchr(s, '\n', end - s))) {
+		offsets_add(out, base + (s - p));
+		s++;
+	}
+}
+
+/** Find all occurrences of the needle starting at p[0..n);
+ the data after p[n] is readable up to p[n + nlen - 1] */
+static void str_scan_scalar(const char *p, size_t n, const char *needle, size_t nlen, unsigned long long base, struct offsets *out)
+{
+	const char *s = p, *end = p + n + nlen - 1;
+	while (NULL != (s = memmem(s, end - s, needle, nlen))) {
+		offsets_add(out, base + (s - p));
+		s++;
+	}
+}
+
+#ifdef HAVE_AVX2_KERNELS
+
+__attribute__((target("avx2")))
+static void nl_scan_avx2(const char *p, size_t n, unsigned long long base, struct offsets *out)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	size_t i = 0;
+	for (;  i + 32 <= n;  i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+		unsigned int m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		while (m != 0) {
+			offsets_add(out, base + i + __builtin_ctz(m));
+			m &= m - 1;
+		}
+	}
+	nl_scan_scalar(p + i, n - i, base + i, out);
+}
+
+/** Compare the first and the last byte of the needle at 32 positions at once,
+ then verify the candidates with memcmp() */
+__attribute__((target("avx2")))
+static void str_scan_avx2(const char *p, size_t n, const char *needle, size_t nlen, unsigned long long base, struct offsets *out)
+{
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last = _mm256_set1_epi8(needle[nlen - 1]);
+	size_t i = 0;
+	for (;  i + 32 <= n;  i += 32) {
+		__m256i b0 = _mm256_loadu_si256((const __m256i*)(p + i));
+		__m256i b1 = _mm256_loadu_si256((const __m256i*)(p + i + nlen - 1));
+		unsigned int m = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(b0, first), _mm256_cmpeq_epi8(b1, last)));
+		while (m != 0) {
+			size_t j = i + __builtin_ctz(m);
+			if (!memcmp(p + j, needle, nlen))
+				offsets_add(out, base + j);
+			m &= m - 1;
+		}
+	}
+	str_scan_scalar(p + i, n - i, needle, nlen, base + i, out);
+}
+
+#endif
+
+static void (*nl_scan)(const char *p, size_t n, unsigned long long base, struct offsets *out) = nl_scan_scalar;
+static void (*str_scan)(const char *p, size_t n, const char *needle, size_t nlen, unsigned long long base, struct offsets *out) = str_scan_scalar;
+
+/** Select the best kernels for this CPU */
+static void scan_init()
+{
+#ifdef HAVE_AVX2_KERNELS
+	if (__builtin_cpu_supports("avx2")) {
+		nl_scan = nl_scan_avx2;
+		str_scan = str_scan_avx2;
+	}
+#endif
+}
+
+
+#define WINDOW_SIZE  (64*1024*1024)
+
+struct window {
+	struct offsets nl, match;
+};
+
+struct grep {
+	file f;
+	unsigned long long size;
+	const char *needle;
+	size_t nlen;
+	int need_nl; // the line index must be built
+	struct window *wins;
+	size_t nwins;
+	size_t next; // the next window to process (atomic)
+};
+
+static void* grep_worker(void *param)
+{
+	struct grep *g = param;
+	for (;;) {
+		size_t i = __atomic_fetch_add(&g->next, 1, __ATOMIC_RELAXED);
+		if (i >= g->nwins)
+			break;
+
+		// a match may cross the window's end: map several bytes more
+		unsigned long long off = (unsigned long long)i * WINDOW_SIZE;
+		size_t n = (g->size - off < WINDOW_SIZE) ? g->size - off : WINDOW_SIZE;
+		size_t map_n = (g->size - off < n + g->nlen - 1) ? g->size - off : n + g->nlen - 1;
+		const char *p = fmap_map(g->f, off, map_n, FMAP_READ, FMAP_SHARED | MAP_POPULATE);
+		assert(p != NULL);
+
+		struct window *w = &g->wins[i];
+		if (g->need_nl)
+			nl_scan(p, n, off, &w->nl);
+		// a match starting at any of these positions ends within the mapped data
+		if (map_n >= g->nlen)
+			str_scan(p, map_n - g->nlen + 1, g->needle, g->nlen, off, &w->match);
+
+		fmap_unmap((void*)p, map_n);
+	}
+	return NULL;
+}
+
+/** Scan the whole file in parallel.
+Return 0 on success */
+int grep_run(struct grep *g, unsigned int threads)
+{
+	g->nwins = (g->size + WINDOW_SIZE - 1) / WINDOW_SIZE;
+	g->wins = calloc(g->nwins, sizeof(struct window));
+	g->next = 0;
+
+	pthread_t th[64];
+	if (threads > 64)
+		threads = 64;
+	for (unsigned int i = 0;  i != threads;  i++) {
+		if (0 != pthread_create(&th[i], NULL, grep_worker, g))
+			return -1;
+	}
+	for (unsigned int i = 0;  i != threads;  i++) {
+		pthread_join(th[i], NULL);
+	}
+	return 0;
+}
+
+/** Merge the results of all windows in file order */
+static void merge(struct grep *g, struct offsets *nl, struct offsets *match)
+{
+	for (size_t i = 0;  i != g->nwins;  i++) {
+		struct window *w = &g->wins[i];
+		for (size_t j = 0;  j != w->nl.len;  j++)
+			offsets_add(nl, w->nl.ptr[j]);
+		for (size_t j = 0;  j != w->match.len;  j++)
+			offsets_add(match, w->match.ptr[j]);
+		free(w->nl.ptr);
+		free(w->match.ptr);
+	}
+	free(g->wins);
+}
+
+
+struct idx_hdr {
+	char magic[8];
+	unsigned long long file_size;
+	long long mtime_sec, mtime_nsec;
+	unsigned long long lines; // N of new-line characters
+};
+
+/** Save the new-line offsets as varint-encoded deltas.
+Return 0 on success */
+int index_save(const char *name, const struct stat *st, const struct offsets *nl)
+{
+	FILE *f = fopen(name, "wb");
+	if (f == NULL)
+		return -1;
+
+	struct idx_hdr h = { "cpspidx1", st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec, nl->len };
+	fwrite(&h, sizeof(h), 1, f);
+
+	unsigned long long prev = 0;
+	for (size_t i = 0;  i != nl->len;  i++) {
+		unsigned long long d = nl->ptr[i] - prev;
+		prev = nl->ptr[i];
+		do {
+			unsigned char b = d & 0x7f;
+			d >>= 7;
+			fputc(b | ((d != 0) ? 0x80 : 0), f);
+		} while (d != 0);
+	}
+	return fclose(f);
+}
+
+/** Load the index if it's up to date.
+Return 0 on success */
+int index_load(const char *name, const struct stat *st, struct offsets *nl)
+{
+	FILE *f = fopen(name, "rb");
+	if (f == NULL)
+		return -1;
+
+	struct idx_hdr h;
+	if (1 != fread(&h, sizeof(h), 1, f)
+		|| memcmp(h.magic, "cpspidx1", 8)
+		|| h.file_size != (unsigned long long)st->st_size
+		|| h.mtime_sec != st->st_mtim.tv_sec
+		|| h.mtime_nsec != st->st_mtim.tv_nsec) {
+		fclose(f);
+		return -1;
+	}
+
+	unsigned long long prev = 0;
+	for (unsigned long long i = 0;  i != h.lines;  i++) {
+		unsigned long long d = 0;
+		int c;
+		for (unsigned int shift = 0;  ;  shift += 7) {
+			if (EOF == (c = fgetc(f))) {
+				fclose(f);
+				nl->len = 0;
+				return -1;
+			}
+			d |= (unsigned long long)(c & 0x7f) << shift;
+			if (!(c & 0x80))
+				break;
+		}
+		prev += d;
+		offsets_add(nl, prev);
+	}
+	fclose(f);
+	return 0;
+}
+
+/** Get the number of the line containing the byte at 'off' */
+static size_t line_of(const struct offsets *nl, unsigned long long off)
+{
+	size_t lo = 0, hi = nl->len;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (nl->ptr[mid] < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Count lines and matches with read() into a buffer */
+void bench_read(const char *fn, const char *needle, size_t nlen)
+{
+	file f = file_open(fn, FILE_READ);
+	assert(f != FILE_NULL);
+	size_t cap = 1024*1024;
+	char *buf = malloc(cap + nlen);
+	unsigned long long lines = 0, matches = 0;
+	size_t keep = 0; // the tail of the previous block which may contain the beginning of a match
+
+	double t = time_sec();
+	for (;;) {
+		ssize_t r = read(f, buf + keep, cap);
+		assert(r >= 0);
+		if (r == 0)
+			break;
+
+		const char *s = buf + keep, *end = buf + keep + r;
+		while (NULL != (s = memchr(s, '\n', end - s))) {
+			lines++;
+			s++;
+		}
+
+		s = buf;
+		while (NULL != (s = memmem(s, end - s, needle, nlen))) {
+			matches++;
+			s++;
+		}
+
+		keep = (keep + r >= nlen - 1) ? nlen - 1 : keep + r;
+		memmove(buf, end - keep, keep);
+	}
+	double t_read = time_sec() - t;
+
+	printf("read+memchr: %.3fs  lines:%llu  matches:%llu\n", t_read, lines, matches);
+	free(buf);
+	file_close(f);
+}
+
+void main(int argc, char **argv)
+{
+	int bench = (argc > 1 && !strcmp(argv[1], "bench"));
+	if (argc < 3 + bench) {
+		puts("Usage: fmap-grep [bench] PATTERN FILE [THREADS]");
+		return;
+	}
+	const char *needle = argv[1 + bench], *fn = argv[2 + bench];
+	unsigned int threads = (argc > 3 + bench) ? atoi(argv[3 + bench]) : sysconf(_SC_NPROCESSORS_ONLN);
+	scan_init();
+
+	struct grep g = {};
+	g.needle = needle;
+	g.nlen = strlen(needle);
+	assert(g.nlen != 0);
+	assert(FILE_NULL != (g.f = file_open(fn, FILE_READ)));
+	struct stat st;
+	assert(0 == fstat(g.f, &st));
+	g.size = st.st_size;
+
+	char idx_name[4096];
+	snprintf(idx_name, sizeof(idx_name), "%s.idx", fn);
+	struct offsets nl = {}, match = {};
+	g.need_nl = (bench || 0 != index_load(idx_name, &st, &nl));
+
+	double t = time_sec();
+	assert(0 == grep_run(&g, threads));
+	merge(&g, &nl, &match);
+	double t_map = time_sec() - t;
+
+	if (bench) {
+		printf("mmap+simd:   %.3fs  lines:%zu  matches:%zu  threads:%u\n", t_map, nl.len, match.len, threads);
+		bench_read(fn, needle, g.nlen);
+
+	} else {
+		if (g.need_nl)
+			assert(0 == index_save(idx_name, &st, &nl));
+
+		// print each matching line once
+		size_t prev_line = (size_t)-1;
+		for (size_t i = 0;  i != match.len;  i++) {
+			size_t line = line_of(&nl, match.ptr[i]);
+			if (line == prev_line)
+				continue;
+			prev_line = line;
+
+			unsigned long long start = (line != 0) ? nl.ptr[line - 1] + 1 : 0;
+			unsigned long long end = (line != nl.len) ? nl.ptr[line] : g.size;
+			char buf[4096];
+			size_t n = (end - start < sizeof(buf)) ? end - start : sizeof(buf);
+			ssize_t r = pread(g.f, buf, n, start);
+			assert(r >= 0);
+			printf("%zu:%.*s\n", line + 1, (int)r, buf);
+		}
+	}
+
+	free(nl.ptr);
+	free(match.ptr);
+	file_close(g.f);
+}
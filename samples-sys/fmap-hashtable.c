@@ -0,0 +1,425 @@
+/* Cross-Platform System Programming Guide: Linux: persistent hash table inside a file mapping
+Usage:
+	./fmap-hashtable put KEY VALUE
+	./fmap-hashtable get KEY
+	./fmap-hashtable bench 1000000
+
+The table is an open-addressing hash table stored in a file.
+All references inside the file are offsets from the beginning of the mapping,
+ so a restarted process just maps the file and it's ready for lookups.
+One writer (serialized with flock()) and any number of reader processes may use the table at once:
+ the writer publishes a slot by storing its hash value last, and readers never lock anything.
+A new table file is prepared under a temporary name and then link()ed to the final name,
+ so of two writers starting at once one creates the file and the other just opens it.
+Resize is crash-safe: a new table is built in a temporary file and then atomically renamed over the old one.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef int file;
+#define FILE_NULL  (-1)
+#define _FILE_CREATE  O_CREAT
+#define FILE_READ  O_RDONLY
+#define FILE_READWRITE  O_RDWR
+
+file file_open(const char *name, unsigned int flags)
+{
+	return open(name, flags, 0666);
+}
+
+int file_close(file f)
+{
+	return close(f);
+}
+
+int file_trunc(file f, unsigned long long len)
+{
+	return ftruncate(f, len);
+}
+
+typedef int filemap;
+
+#define FMAP_READ  PROT_READ
+#define FMAP_READWRITE  (PROT_READ | PROT_WRITE)
+#define FMAP_SHARED  MAP_SHARED
+
+/** Map file region into memory
+Return NULL on error */
+void* fmap_map(filemap f, unsigned long long offset, size_t size, int prot, int flags)
+{
+	void *h = mmap(NULL, size, prot, flags, f, offset);
+	return (h != MAP_FAILED) ? h : NULL;
+}
+
+/** Unmap the previously mapped region */
+int fmap_unmap(void *p, size_t sz)
+{
+	return munmap(p, sz);
+}
+
+
+#define FHT_MAGIC  "cpsphtb1"
+
+/** File header */
+struct fht_hdr {
+	char magic[8];
+	unsigned long long size; // total file size
+	unsigned long long nslots; // power of 2
+	unsigned long long count; // N of used slots
+	unsigned long long slots_off; // offset of slots array
+	unsigned long long heap_off, heap_used, heap_cap; // key data area
+	unsigned int moved; // set when this file was replaced by a larger one
+};
+
+struct fht_slot {
+	unsigned long long hash; // 0: empty slot
+	unsigned long long key_off; // key data offset from the beginning of the file
+	unsigned long long key_len;
+	unsigned long long value;
+};
+
+typedef struct {
+	file f;
+	char *m; // the whole file is mapped
+	size_t size;
+	int writer;
+	char name[256];
+} fht;
+
+#define FHT_HDR(t)  ((struct fht_hdr*)(t)->m)
+#define FHT_SLOTS(t)  ((struct fht_slot*)((t)->m + FHT_HDR(t)->slots_off))
+
+static unsigned long long fht_hash(const char *key, size_t len)
+{
+	unsigned long long h = 14695981039346656037ULL; // FNV-1a
+	for (size_t i = 0;  i != len;  i++) {
+		h = (h ^ (unsigned char)key[i]) * 1099511628211ULL;
+	}
+	return (h != 0) ? h : 1;
+}
+
+/** Create a new empty table file */
+static int _fht_create(const char *name, unsigned long long nslots, unsigned long long heap_cap)
+{
+	file f = file_open(name, _FILE_CREATE | O_TRUNC | FILE_READWRITE);
+	if (f == FILE_NULL)
+		return -1;
+
+	struct fht_hdr h = {};
+	memcpy(h.magic, FHT_MAGIC, 8);
+	h.nslots = nslots;
+	h.slots_off = 4096;
+	h.heap_off = h.slots_off + nslots * sizeof(struct fht_slot);
+	h.heap_cap = heap_cap;
+	h.size = h.heap_off + heap_cap;
+
+	int r = -1;
+	if (0 != file_trunc(f, h.size))
+		goto end;
+	if (sizeof(h) != pwrite(f, &h, sizeof(h), 0))
+		goto end;
+	r = 0;
+
+end:
+	file_close(f);
+	return r;
+}
+
+/** Create an empty table file if it doesn't exist.
+Unlike open(O_CREAT), other processes never see the file before its header is written.
+Return 0 if the file exists or has been created */
+static int _fht_create_once(const char *name)
+{
+	char tmp[300];
+	if (sizeof(tmp) <= (size_t)snprintf(tmp, sizeof(tmp), "%s.%d.tmp", name, (int)getpid())) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (0 != _fht_create(tmp, 1024, 64*1024))
+		return -1;
+
+	// link() never replaces an existing file
+	int r = link(tmp, name);
+	if (r != 0 && errno == EEXIST)
+		r = 0;
+	unlink(tmp);
+	return r;
+}
+
+/** Map an existing table file */
+static int _fht_map(fht *t)
+{
+	if (FILE_NULL == (t->f = file_open(t->name, (t->writer) ? FILE_READWRITE : FILE_READ)))
+		return -1;
+
+	struct stat st;
+	if (0 != fstat(t->f, &st))
+		goto err;
+	t->size = st.st_size;
+
+	t->m = fmap_map(t->f, 0, t->size, (t->writer) ? FMAP_READWRITE : FMAP_READ, FMAP_SHARED);
+	if (t->m == NULL)
+		goto err;
+
+	if (t->size < sizeof(struct fht_hdr)
+		|| memcmp(FHT_HDR(t)->magic, FHT_MAGIC, 8)
+		|| FHT_HDR(t)->size != t->size) {
+		fmap_unmap(t->m, t->size);
+		errno = EINVAL;
+		goto err;
+	}
+	return 0;
+
+err:
+	file_close(t->f);
+	return -1;
+}
+
+void fht_close(fht *t)
+{
+	fmap_unmap(t->m, t->size);
+	file_close(t->f); // the writer lock is released here
+}
+
+/** Open a table.
+writer: open for writing and take the exclusive writer lock; create the file if necessary
+Return 0 on success */
+int fht_open(fht *t, const char *name, int writer)
+{
+	// leave room for the ".tmp" suffix used by _fht_grow()
+	if (strlen(name) + sizeof(".tmp") > sizeof(t->name)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(t->name, name);
+	t->writer = writer;
+
+	if (writer) {
+		if (0 != _fht_create_once(name))
+			return -1;
+	}
+
+	for (;;) {
+		if (0 != _fht_map(t))
+			return -1;
+		if (!writer)
+			return 0;
+
+		if (0 != flock(t->f, LOCK_EX)) {
+			fht_close(t);
+			return -1;
+		}
+
+		// the previous writer might have replaced the file while we were waiting for the lock
+		if (!FHT_HDR(t)->moved)
+			return 0;
+		fht_close(t);
+	}
+}
+
+/** Reader: switch to the new file if the writer has replaced the table.
+Return 0 on success */
+int fht_refresh(fht *t)
+{
+	if (!__atomic_load_n(&FHT_HDR(t)->moved, __ATOMIC_ACQUIRE))
+		return 0;
+	fht_close(t);
+	return _fht_map(t);
+}
+
+/** Find key.
+value: (output)
+Return 0 if found;
+  -1 if not found */
+int fht_get(fht *t, const char *key, size_t len, unsigned long long *value)
+{
+	const struct fht_hdr *h = FHT_HDR(t);
+	const struct fht_slot *slots = FHT_SLOTS(t);
+	unsigned long long hash = fht_hash(key, len), mask = h->nslots - 1;
+
+	for (unsigned long long i = hash & mask;  ;  i = (i + 1) & mask) {
+		const struct fht_slot *s = &slots[i];
+		unsigned long long sh = __atomic_load_n(&s->hash, __ATOMIC_ACQUIRE);
+		if (sh == 0)
+			return -1;
+		if (sh == hash
+			&& s->key_len == len
+			&& !memcmp(t->m + s->key_off, key, len)) {
+			*value = __atomic_load_n(&s->value, __ATOMIC_RELAXED);
+			return 0;
+		}
+	}
+}
+
+/** Put the key into a slot, without checking for free space */
+static void _fht_insert(char *m, unsigned long long hash, const char *key, size_t len, unsigned long long value)
+{
+	struct fht_hdr *h = (void*)m;
+	struct fht_slot *slots = (void*)(m + h->slots_off);
+	unsigned long long mask = h->nslots - 1;
+
+	for (unsigned long long i = hash & mask;  ;  i = (i + 1) & mask) {
+		struct fht_slot *s = &slots[i];
+		if (s->hash == 0) {
+			s->key_off = h->heap_off + h->heap_used;
+			s->key_len = len;
+			s->value = value;
+			memcpy(m + s->key_off, key, len);
+			h->heap_used += len;
+			h->count++;
+			// the slot becomes visible to readers only now
+			__atomic_store_n(&s->hash, hash, __ATOMIC_RELEASE);
+			return;
+		}
+		if (s->hash == hash
+			&& s->key_len == len
+			&& !memcmp(m + s->key_off, key, len)) {
+			__atomic_store_n(&s->value, value, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+}
+
+/** Rebuild the table with twice the capacity.
+The new data is durable before rename(), so after a crash we have either the old or the new table. */
+static int _fht_grow(fht *t)
+{
+	const struct fht_hdr *h = FHT_HDR(t);
+	fht n = {};
+	if (sizeof(n.name) <= (size_t)snprintf(n.name, sizeof(n.name), "%s.tmp", t->name)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	const char *tmp = n.name;
+	if (0 != _fht_create(tmp, h->nslots * 2, h->heap_cap * 2))
+		return -1;
+
+	n.writer = 1;
+	if (0 != _fht_map(&n))
+		goto err_unlink; // _fht_map() has already released what it acquired
+	if (0 != flock(n.f, LOCK_EX))
+		goto err;
+
+	const struct fht_slot *slots = FHT_SLOTS(t);
+	for (unsigned long long i = 0;  i != h->nslots;  i++) {
+		if (slots[i].hash != 0)
+			_fht_insert(n.m, slots[i].hash, t->m + slots[i].key_off, slots[i].key_len, slots[i].value);
+	}
+
+	if (0 != msync(n.m, n.size, MS_SYNC)
+		|| 0 != rename(tmp, t->name))
+		goto err;
+
+	// notify readers that they should remap the file
+	__atomic_store_n(&FHT_HDR(t)->moved, 1, __ATOMIC_RELEASE);
+	fht_close(t);
+
+	memcpy(n.name, t->name, sizeof(n.name));
+	*t = n;
+	return 0;
+
+err:
+	fht_close(&n);
+err_unlink:
+	unlink(tmp);
+	return -1;
+}
+
+/** Add or update key.
+Return 0 on success */
+int fht_put(fht *t, const char *key, size_t len, unsigned long long value)
+{
+	while ((FHT_HDR(t)->count + 1) * 4 > FHT_HDR(t)->nslots * 3
+		|| FHT_HDR(t)->heap_used + len > FHT_HDR(t)->heap_cap) {
+		if (0 != _fht_grow(t))
+			return -1;
+	}
+
+	_fht_insert(t->m, fht_hash(key, len), key, len, value);
+	return 0;
+}
+
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Compare building the table from scratch with opening the existing file */
+void bench(unsigned int n)
+{
+	const char *name = "fmap-hashtable.bench";
+	unlink(name);
+	char key[32];
+
+	double t = time_sec();
+	fht w = {};
+	assert(0 == fht_open(&w, name, 1));
+	for (unsigned int i = 0;  i != n;  i++) {
+		int len = snprintf(key, sizeof(key), "key%u", i);
+		assert(0 == fht_put(&w, key, len, i));
+	}
+	assert(0 == msync(w.m, w.size, MS_SYNC));
+	fht_close(&w);
+	double t_build = time_sec() - t;
+
+	// a reader process starts: map the file and perform the first lookup
+	t = time_sec();
+	fht r = {};
+	unsigned long long v;
+	assert(0 == fht_open(&r, name, 0));
+	assert(0 == fht_get(&r, "key0", 4, &v));
+	double t_open = time_sec() - t;
+
+	t = time_sec();
+	for (unsigned int i = 0;  i != n;  i++) {
+		int len = snprintf(key, sizeof(key), "key%u", i);
+		assert(0 == fht_get(&r, key, len, &v));
+		assert(v == i);
+	}
+	double t_get = time_sec() - t;
+	fht_close(&r);
+
+	printf("keys:%u  rebuild:%.3fs  cold start:%.6fs  lookups:%.0f/s\n"
+		, n, t_build, t_open, n / t_get);
+	unlink(name);
+}
+
+void main(int argc, char **argv)
+{
+	const char *name = "fmap-hashtable.dat";
+
+	if (argc > 2 && !strcmp(argv[1], "bench")) {
+		bench(atoi(argv[2]));
+
+	} else if (argc > 3 && !strcmp(argv[1], "put")) {
+		fht t = {};
+		assert(0 == fht_open(&t, name, 1));
+		assert(0 == fht_put(&t, argv[2], strlen(argv[2]), strtoull(argv[3], NULL, 10)));
+		fht_close(&t);
+
+	} else if (argc > 2 && !strcmp(argv[1], "get")) {
+		fht t = {};
+		assert(0 == fht_open(&t, name, 0));
+		assert(0 == fht_refresh(&t));
+		unsigned long long v;
+		if (0 == fht_get(&t, argv[2], strlen(argv[2]), &v))
+			printf("%s = %llu\n", argv[2], v);
+		else
+			printf("%s: not found\n", argv[2]);
+		fht_close(&t);
+	}
+}
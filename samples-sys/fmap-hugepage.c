@@ -0,0 +1,257 @@
+/* Cross-Platform System Programming Guide: Linux: huge pages and prefaulting for file and anonymous mappings
+Usage:
+	./fmap-hugepage anon 1024
+	./fmap-hugepage file 1024
+
+Maps a region of the specified size (in MB) with different options
+ and measures the time, page faults and dTLB misses for random 8-byte lookups.
+Anonymous memory is mapped read-write and every lookup increments the value:
+ reading an untouched anonymous page only maps the shared zero page,
+ which would make all options look alike and never allocate a huge page.
+Faults and dTLB misses are counted for the measuring thread only, not for the prefault thread.
+perf counters may be unavailable (e.g. kernel.perf_event_paranoid=3): the fault count is then taken from getrusage(RUSAGE_THREAD), and dTLB misses are shown as -1.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ  22
+#define MADV_POPULATE_WRITE  23
+#endif
+
+typedef int filemap;
+#define FMAP_ANON  (-1)
+
+#define FMAP_READ  PROT_READ
+#define FMAP_READWRITE  (PROT_READ | PROT_WRITE)
+#define FMAP_SHARED  MAP_SHARED
+#define FMAP_PRIVATE  MAP_PRIVATE
+
+enum FMAP_OPT {
+	FMAP_OPT_POPULATE = 1, // MAP_POPULATE: fault in all pages inside mmap()
+	FMAP_OPT_HUGETLB = 2, // MAP_HUGETLB: use pages from the hugetlbfs pool (anonymous mappings only)
+	FMAP_OPT_HUGEPAGE = 4, // MADV_HUGEPAGE: use transparent huge pages (anonymous, shmem, or read-only file with CONFIG_READ_ONLY_THP_FOR_FS)
+	FMAP_OPT_WILLNEED = 8, // MADV_WILLNEED: start read-ahead of the whole region
+	FMAP_OPT_SEQUENTIAL = 0x10, // MADV_SEQUENTIAL: aggressive read-ahead, pages may be freed soon after access
+	FMAP_OPT_RANDOM = 0x20, // MADV_RANDOM: disable read-ahead
+};
+
+/** Map file region (or anonymous memory if f == FMAP_ANON) into memory.
+opt: enum FMAP_OPT
+Return NULL on error */
+void* fmap_map_opt(filemap f, unsigned long long offset, size_t size, int prot, int flags, unsigned int opt)
+{
+	if (f == FMAP_ANON)
+		flags |= MAP_ANONYMOUS;
+	if (opt & FMAP_OPT_POPULATE)
+		flags |= MAP_POPULATE;
+	if (opt & FMAP_OPT_HUGETLB)
+		flags |= MAP_HUGETLB;
+
+	void *p = mmap(NULL, size, prot, flags, f, offset);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	// advice is just a hint: the kernel may not support it for this mapping type
+	static const struct {
+		unsigned int opt;
+		int advice;
+	} advices[] = {
+		{ FMAP_OPT_HUGEPAGE, MADV_HUGEPAGE },
+		{ FMAP_OPT_WILLNEED, MADV_WILLNEED },
+		{ FMAP_OPT_SEQUENTIAL, MADV_SEQUENTIAL },
+		{ FMAP_OPT_RANDOM, MADV_RANDOM },
+	};
+	for (unsigned int i = 0;  i != sizeof(advices) / sizeof(*advices);  i++) {
+		if (opt & advices[i].opt)
+			madvise(p, size, advices[i].advice);
+	}
+	return p;
+}
+
+/** Unmap the previously mapped region */
+int fmap_unmap(void *p, size_t sz)
+{
+	return munmap(p, sz);
+}
+
+struct prefault {
+	pthread_t th;
+	const char *p;
+	size_t size;
+	int write; // allocate the pages (anonymous memory) rather than just map them for reading
+};
+
+static void* _prefault_thread(void *param)
+{
+	struct prefault *pf = param;
+
+	// Linux 5.14+: fault in the page tables in a single call
+	if (0 == madvise((void*)pf->p, pf->size, (pf->write) ? MADV_POPULATE_WRITE : MADV_POPULATE_READ))
+		return NULL;
+
+	// otherwise touch every page
+	size_t page = sysconf(_SC_PAGESIZE);
+	for (size_t off = 0;  off < pf->size;  off += page) {
+		if (pf->write)
+			// atomic, so we don't overwrite the data the main thread is changing at the same time
+			__atomic_fetch_add((char*)pf->p + off, 0, __ATOMIC_RELAXED);
+		else
+			(void)*(volatile const char*)(pf->p + off);
+	}
+	return NULL;
+}
+
+/** Fault in the region's pages in a background thread,
+ so the main thread can start working with the mapping immediately.
+write: fault the pages in for writing (the mapping must be writable)
+Return 0 on success */
+int fmap_prefault_start(struct prefault *pf, const void *p, size_t size, int write)
+{
+	pf->p = p;
+	pf->size = size;
+	pf->write = write;
+	return pthread_create(&pf->th, NULL, _prefault_thread, pf);
+}
+
+/** Wait until the prefault thread has finished */
+void fmap_prefault_wait(struct prefault *pf)
+{
+	pthread_join(pf->th, NULL);
+}
+
+
+/** Open a perf counter for the current thread.
+Return -1 if not permitted */
+static int perf_open(unsigned int type, unsigned long long config)
+{
+	struct perf_event_attr a = {};
+	a.size = sizeof(a);
+	a.type = type;
+	a.config = config;
+	a.exclude_kernel = 1;
+	a.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &a, 0, -1, -1, 0);
+}
+
+static long long perf_read(int fd)
+{
+	long long v;
+	if (fd < 0 || sizeof(v) != read(fd, &v, sizeof(v)))
+		return -1;
+	return v;
+}
+
+static long long minflt()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_THREAD, &ru);
+	return ru.ru_minflt + ru.ru_majflt;
+}
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile unsigned long long lookup_sum; // don't let the compiler throw the lookups away
+
+/** Map the region with the specified options and perform random lookups */
+void bench(const char *title, filemap f, size_t size, unsigned int opt, int prefault)
+{
+	int write = (f == FMAP_ANON);
+	double t = time_sec();
+	char *p = fmap_map_opt(f, 0, size, (write) ? FMAP_READWRITE : FMAP_READ, (write) ? FMAP_PRIVATE : FMAP_SHARED, opt);
+	if (p == NULL) {
+		printf("%-12s: mmap: %s\n", title, strerror(errno));
+		return;
+	}
+	struct prefault pf;
+	if (prefault)
+		assert(0 == fmap_prefault_start(&pf, p, size, write));
+	double t_map = time_sec() - t;
+
+	int fd_flt = perf_open(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+	int fd_tlb = perf_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
+		| (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+	long long flt = minflt();
+
+	unsigned long long x = 88172645463325252ULL, sum = 0;
+	t = time_sec();
+	for (unsigned int i = 0;  i != 1000000;  i++) {
+		x ^= x << 13;  x ^= x >> 7;  x ^= x << 17; // xorshift64
+		unsigned long long *v = (unsigned long long*)(p + ((x % size) & ~7ULL));
+		if (write)
+			sum += __atomic_fetch_add(v, 1, __ATOMIC_RELAXED);
+		else
+			sum += *v;
+	}
+	double t_lookup = time_sec() - t;
+
+	long long faults = perf_read(fd_flt);
+	if (faults < 0)
+		faults = minflt() - flt;
+	long long tlb = perf_read(fd_tlb);
+
+	lookup_sum = sum;
+
+	printf("%-12s: map:%.3fs  1M lookups:%.3fs  faults:%lld  dTLB-misses:%lld\n"
+		, title, t_map, t_lookup, faults, tlb);
+
+	if (prefault)
+		fmap_prefault_wait(&pf);
+	if (fd_flt >= 0)
+		close(fd_flt);
+	if (fd_tlb >= 0)
+		close(fd_tlb);
+	fmap_unmap(p, size);
+}
+
+void main(int argc, char **argv)
+{
+	int anon = (argc > 1 && !strcmp(argv[1], "anon"));
+	size_t size = ((argc > 2) ? atoi(argv[2]) : 256) * 1024ULL * 1024;
+
+	filemap f = FMAP_ANON;
+	if (!anon) {
+		// prepare the data file
+		f = open("fmap-hugepage.dat", O_CREAT | O_RDWR | O_TRUNC, 0666);
+		assert(f != -1);
+		char buf[64*1024];
+		memset(buf, 1, sizeof(buf));
+		for (size_t off = 0;  off < size;  off += sizeof(buf)) {
+			assert(sizeof(buf) == write(f, buf, sizeof(buf)));
+		}
+	}
+
+	bench("default", f, size, 0, 0);
+	bench("random", f, size, FMAP_OPT_RANDOM, 0);
+	bench("willneed", f, size, FMAP_OPT_WILLNEED, 0);
+	bench("populate", f, size, FMAP_OPT_POPULATE, 0);
+	bench("prefault-th", f, size, 0, 1);
+	bench("hugepage", f, size, FMAP_OPT_HUGEPAGE, 0);
+	bench("hugepage+pop", f, size, FMAP_OPT_HUGEPAGE | FMAP_OPT_POPULATE, 0);
+	if (anon)
+		bench("hugetlb", f, size, FMAP_OPT_HUGETLB | FMAP_OPT_POPULATE, 0);
+
+	if (!anon) {
+		close(f);
+		unlink("fmap-hugepage.dat");
+	}
+}
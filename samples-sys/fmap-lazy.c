@@ -0,0 +1,342 @@
+/* Cross-Platform System Programming Guide: Linux: memory region filled on first access by the application
+Usage:
+	./fmap-lazy
+	./fmap-lazy bench [MB] [ACCESSES]
+
+Anonymous memory is zero-filled on first touch, and a file mapping is filled from the file.
+Here the application itself provides the data for each page when it's first accessed:
+ e.g. it may decompress or compute the data, or read it from a database.
+Only the pages that are actually accessed use memory, which is good for huge sparse tables.
+With userfaultfd the region is registered for "missing page" events:
+ a thread that touches a new page is suspended,
+ our handler thread receives the page address, prepares the data and installs the page with UFFDIO_COPY,
+ which atomically maps the page and wakes up the waiting thread.
+UFFD_USER_MODE_ONLY lets unprivileged processes use userfaultfd even if /proc/sys/vm/unprivileged_userfaultfd is 0.
+If userfaultfd isn't available (old kernel, CONFIG_USERFAULTFD is off, seccomp policy in a container),
+ the region is mapped with PROT_NONE, and the SIGSEGV handler (see signal-cpu-exception.c)
+ makes the page writable with mprotect() and fills it in the context of the faulting thread.
+ Note that here another thread may see the page before it's filled,
+ and each separate page splits the mapping, so the number of filled pages is limited by /proc/sys/vm/max_map_count.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Fill the page with data.
+off: offset of the page within the region */
+typedef void (*lazy_fill_t)(void *udata, size_t off, void *page, size_t size);
+
+enum LAZY_MODE {
+	LAZY_AUTO, // userfaultfd if available, otherwise SIGSEGV
+	LAZY_UFFD,
+	LAZY_SEGV,
+};
+
+struct lazy_region {
+	char *base;
+	size_t size, page;
+	unsigned int mode; // enum LAZY_MODE
+	lazy_fill_t fill;
+	void *udata;
+	unsigned long long faults; // (atomic)
+
+	// LAZY_UFFD:
+	int uffd, stop_fd;
+	pthread_t thread;
+	char *tmp_page;
+};
+
+#define SEGV_REGIONS_MAX  8
+static struct lazy_region *segv_regions[SEGV_REGIONS_MAX];
+
+static void* uffd_thread(void *param)
+{
+	struct lazy_region *r = param;
+	struct pollfd pfd[2] = {
+		{ r->uffd, POLLIN, 0 },
+		{ r->stop_fd, POLLIN, 0 },
+	};
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfd[1].revents)
+			break;
+
+		struct uffd_msg msg;
+		ssize_t n = read(r->uffd, &msg, sizeof(msg));
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (n != sizeof(msg))
+			break;
+		if (msg.event != UFFD_EVENT_PAGEFAULT)
+			continue;
+
+		size_t addr = msg.arg.pagefault.address & ~(r->page - 1);
+		r->fill(r->udata, addr - (size_t)r->base, r->tmp_page, r->page);
+
+		struct uffdio_copy c = {};
+		c.dst = addr;
+		c.src = (size_t)r->tmp_page;
+		c.len = r->page;
+		// count before the faulting thread is woken up, so it sees the new value
+		__atomic_fetch_add(&r->faults, 1, __ATOMIC_RELAXED);
+		if (0 != ioctl(r->uffd, UFFDIO_COPY, &c))
+			assert(errno == EEXIST); // several threads faulted on the same page: it's already installed
+	}
+	return NULL;
+}
+
+/** Return 0 on success */
+static int uffd_init(struct lazy_region *r)
+{
+	// we don't need to handle the faults from the kernel code (e.g. read() into the region)
+	r->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+	if (r->uffd < 0 && errno == EINVAL)
+		r->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK); // before Linux 5.11
+	if (r->uffd < 0)
+		return -1;
+
+	struct uffdio_api api = {};
+	api.api = UFFD_API;
+	struct uffdio_register reg = {};
+	reg.range.start = (size_t)r->base;
+	reg.range.len = r->size;
+	reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+	if (0 != ioctl(r->uffd, UFFDIO_API, &api)
+		|| 0 != ioctl(r->uffd, UFFDIO_REGISTER, &reg))
+		goto err;
+
+	r->tmp_page = mmap(NULL, r->page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r->tmp_page == MAP_FAILED)
+		goto err;
+	r->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (r->stop_fd < 0) {
+		munmap(r->tmp_page, r->page);
+		goto err;
+	}
+	if (0 != pthread_create(&r->thread, NULL, uffd_thread, r)) {
+		close(r->stop_fd);
+		munmap(r->tmp_page, r->page);
+		goto err;
+	}
+	return 0;
+
+err:
+	close(r->uffd);
+	return -1;
+}
+
+static void segv_handler(int sig, siginfo_t *info, void *ucontext)
+{
+	char *addr = info->si_addr;
+	for (unsigned int i = 0;  i != SEGV_REGIONS_MAX;  i++) {
+		struct lazy_region *r = segv_regions[i];
+		if (r != NULL && addr >= r->base && addr < r->base + r->size) {
+			char *page = (char*)((size_t)addr & ~(r->page - 1));
+			if (0 != mprotect(page, r->page, PROT_READ | PROT_WRITE))
+				break; // probably the VMA limit is reached
+			r->fill(r->udata, page - r->base, page, r->page);
+			__atomic_fetch_add(&r->faults, 1, __ATOMIC_RELAXED);
+			return; // the faulting instruction is executed again
+		}
+	}
+
+	// not our region: crash as usual
+	signal(SIGSEGV, SIG_DFL);
+}
+
+/** Return 0 on success */
+static int segv_init(struct lazy_region *r)
+{
+	unsigned int i;
+	for (i = 0;  i != SEGV_REGIONS_MAX;  i++) {
+		if (segv_regions[i] == NULL)
+			break;
+	}
+	if (i == SEGV_REGIONS_MAX)
+		return -1;
+
+	if (0 != mprotect(r->base, r->size, PROT_NONE))
+		return -1;
+
+	struct sigaction sa = {};
+	sa.sa_sigaction = segv_handler;
+	sa.sa_flags = SA_SIGINFO;
+	if (0 != sigaction(SIGSEGV, &sa, NULL))
+		return -1;
+	segv_regions[i] = r;
+	return 0;
+}
+
+/** Create a region of memory filled on demand.
+Return 0 on success */
+int lazy_init(struct lazy_region *r, size_t size, unsigned int mode, lazy_fill_t fill, void *udata)
+{
+	memset(r, 0, sizeof(*r));
+	r->page = sysconf(_SC_PAGESIZE);
+	r->size = (size + r->page - 1) & ~(r->page - 1);
+	r->fill = fill;
+	r->udata = udata;
+	r->base = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (r->base == MAP_FAILED)
+		return -1;
+
+	if (mode != LAZY_SEGV && 0 == uffd_init(r)) {
+		r->mode = LAZY_UFFD;
+		return 0;
+	}
+	if (mode != LAZY_UFFD && 0 == segv_init(r)) {
+		r->mode = LAZY_SEGV;
+		return 0;
+	}
+	munmap(r->base, r->size);
+	return -1;
+}
+
+void lazy_destroy(struct lazy_region *r)
+{
+	if (r->mode == LAZY_UFFD) {
+		eventfd_write(r->stop_fd, 1);
+		pthread_join(r->thread, NULL);
+		close(r->stop_fd);
+		close(r->uffd);
+		munmap(r->tmp_page, r->page);
+	} else {
+		for (unsigned int i = 0;  i != SEGV_REGIONS_MAX;  i++) {
+			if (segv_regions[i] == r)
+				segv_regions[i] = NULL;
+		}
+	}
+	munmap(r->base, r->size);
+}
+
+
+/** The table: value[i] = hash(i).  Here the data is computed, but it could be read from a file. */
+static unsigned long long table_value(size_t i)
+{
+	unsigned long long x = i + 1;
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	return x;
+}
+
+static void table_fill(void *udata, size_t off, void *page, size_t size)
+{
+	unsigned long long *v = page;
+	size_t first = off / sizeof(*v);
+	for (size_t i = 0;  i != size / sizeof(*v);  i++) {
+		v[i] = table_value(first + i);
+	}
+}
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Return the resident memory size (MB) */
+static double rss_mb()
+{
+	unsigned long long size = 0, rss = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f != NULL) {
+		fscanf(f, "%llu %llu", &size, &rss);
+		fclose(f);
+	}
+	return rss * sysconf(_SC_PAGESIZE) / (1024.0*1024);
+}
+
+/** Random reads from the table: the first pass includes the page faults, the second one doesn't.
+Return the time of each pass */
+static void access_run(const unsigned long long *table, const size_t *idx, unsigned int n, double t[2])
+{
+	for (unsigned int pass = 0;  pass != 2;  pass++) {
+		double t0 = time_sec();
+		for (unsigned int i = 0;  i != n;  i++) {
+			assert(table[idx[i]] == table_value(idx[i]));
+		}
+		t[pass] = time_sec() - t0;
+	}
+}
+
+/** Random access to a 'mb' MB table: filled in advance vs. on demand */
+void bench(unsigned int mb, unsigned int accesses)
+{
+	size_t size = (size_t)mb * 1024*1024;
+	size_t n = size / sizeof(unsigned long long);
+	size_t *idx = malloc(accesses * sizeof(size_t));
+	srand(1);
+	for (unsigned int i = 0;  i != accesses;  i++) {
+		idx[i] = (((size_t)rand() << 31) | rand()) % n;
+	}
+
+	double t[2], rss0 = rss_mb();
+	double t_init = time_sec();
+	unsigned long long *table = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert(table != MAP_FAILED);
+	table_fill(NULL, 0, table, size);
+	t_init = time_sec() - t_init;
+	access_run(table, idx, accesses, t);
+	printf("%-8s init:%.3fs  first access:%.0fns  next access:%.0fns  RSS:%.0fMB\n"
+		, "eager:", t_init, t[0] * 1e9 / accesses, t[1] * 1e9 / accesses, rss_mb() - rss0);
+	munmap(table, size);
+
+	static const unsigned int modes[] = { LAZY_UFFD, LAZY_SEGV };
+	static const char *names[] = { "", "uffd:", "sigsegv:" };
+	for (unsigned int m = 0;  m != 2;  m++) {
+		struct lazy_region r;
+		rss0 = rss_mb();
+		t_init = time_sec();
+		if (0 != lazy_init(&r, size, modes[m], table_fill, NULL)) {
+			printf("%-8s not available: %s\n", names[modes[m]], strerror(errno));
+			continue;
+		}
+		t_init = time_sec() - t_init;
+		access_run((void*)r.base, idx, accesses, t);
+		printf("%-8s init:%.3fs  first access:%.0fns  next access:%.0fns  RSS:%.0fMB  faults:%llu\n"
+			, names[modes[m]], t_init, t[0] * 1e9 / accesses, t[1] * 1e9 / accesses, rss_mb() - rss0, __atomic_load_n(&r.faults, __ATOMIC_RELAXED));
+		lazy_destroy(&r);
+	}
+	free(idx);
+}
+
+void main(int argc, char **argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		unsigned int mb = (argc > 2) ? atoi(argv[2]) : 1024;
+		unsigned int accesses = (argc > 3) ? atoi(argv[3]) : 20000;
+		bench(mb, accesses);
+		return;
+	}
+
+	// 1TB of virtual memory: only the accessed pages exist
+	struct lazy_region r;
+	assert(0 == lazy_init(&r, 1024ULL*1024*1024*1024, LAZY_AUTO, table_fill, NULL));
+	const unsigned long long *table = (void*)r.base;
+	size_t i = 123456789012ULL;
+	printf("%s: table[%zu] = %llx\n"
+		, (r.mode == LAZY_UFFD) ? "userfaultfd" : "SIGSEGV", i, table[i]);
+	assert(table[i] == table_value(i));
+	lazy_destroy(&r);
+}
@@ -0,0 +1,313 @@
+/* Cross-Platform System Programming Guide: Linux: growable memory-mapped append-only log
+Usage:
+	./fmap-log write 'record 1' 'record 2' ...
+	./fmap-log read
+	./fmap-log bench 1000000
+
+Records are written with plain memory stores into a shared file mapping.
+The file grows in large fallocate()'d steps, and the mapping grows inside
+ an address range reserved up front, so the pointers into the log stay valid.
+Data is persisted with ranged msync() only at commit boundaries.
+With FMLOG_SYNC the records reach the disk before the commit point that covers them.
+FMLOG_ASYNC only schedules the writeback, and the kernel may write the header page before the data pages:
+ after a power failure the commit point may cover garbage,
+ so the reader validates each record's length against the commit point.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef int file;
+#define FILE_NULL  (-1)
+#define _FILE_CREATE  O_CREAT
+#define FILE_READWRITE  O_RDWR
+
+file file_open(const char *name, unsigned int flags)
+{
+	return open(name, flags, 0666);
+}
+
+int file_close(file f)
+{
+	return close(f);
+}
+
+/** Allocate disk space for the file region.
+Fall back to ftruncate() if the file system doesn't support fallocate().
+Return 0 on success */
+int file_allocate(file f, unsigned long long len)
+{
+	if (0 == fallocate(f, 0, 0, len))
+		return 0;
+	if (errno != EOPNOTSUPP)
+		return -1;
+	return ftruncate(f, len);
+}
+
+#define FMAP_READWRITE  (PROT_READ | PROT_WRITE)
+#define FMAP_SHARED  MAP_SHARED
+
+
+/** On-disk header at offset 0 */
+struct fmlog_hdr {
+	char magic[8];
+	unsigned long long committed; // offset of the end of the last committed record
+};
+
+#define FMLOG_MAGIC  "cpsplog1"
+#define FMLOG_DATA_OFF  4096 // records start at the second page
+
+/** Record: [u32 length] [data] [padding to 8 bytes] */
+#define FMLOG_REC_SIZE(len)  ((4ULL + (len) + 7) & ~7ULL)
+
+typedef struct {
+	file f;
+	char *base; // start of the reserved address range; constant for the lifetime of the log
+	size_t reserve; // size of the reserved address range
+	size_t mapped; // size of the file-backed part of the reserved range (== file size)
+	size_t grow; // file growth step
+	unsigned long long tail; // offset of the end of the last appended record
+	unsigned long long synced; // offset up to which data was already passed to msync()
+} fmlog;
+
+#define FMLOG_SYNC  MS_SYNC
+#define FMLOG_ASYNC  MS_ASYNC
+
+/** Map 'n' more bytes of the file at the end of the mapped region.
+The new pages replace the PROT_NONE reservation at a fixed address,
+ so the region never moves and the pointers returned by fmlog_append() remain valid. */
+static int _fmlog_grow(fmlog *l, size_t need)
+{
+	size_t n = l->mapped;
+	while (n < need)
+		n += l->grow;
+	if (n > l->reserve) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (0 != file_allocate(l->f, n))
+		return -1;
+
+	void *p = mmap(l->base + l->mapped, n - l->mapped, FMAP_READWRITE, FMAP_SHARED | MAP_FIXED, l->f, l->mapped);
+	if (p == MAP_FAILED)
+		return -1;
+
+	l->mapped = n;
+	return 0;
+}
+
+/** Open or create a log file.
+reserve: maximum log size; this much address space is reserved, but not committed
+grow: file growth step (rounded up to page size)
+Return 0 on success */
+int fmlog_open(fmlog *l, const char *name, size_t reserve, size_t grow)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	l->grow = (grow + page - 1) & ~(page - 1);
+	l->reserve = (reserve + page - 1) & ~(page - 1);
+	l->base = NULL;
+
+	if (FILE_NULL == (l->f = file_open(name, _FILE_CREATE | FILE_READWRITE)))
+		return -1;
+
+	struct stat st;
+	if (0 != fstat(l->f, &st))
+		goto err;
+
+	// reserve the address range without allocating any memory for it
+	l->base = mmap(NULL, l->reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (l->base == MAP_FAILED)
+		goto err;
+
+	// map the existing file contents, or create a new file
+	l->mapped = 0;
+	size_t need = (st.st_size > FMLOG_DATA_OFF) ? st.st_size : FMLOG_DATA_OFF;
+	if (0 != _fmlog_grow(l, need))
+		goto err;
+
+	struct fmlog_hdr *h = (void*)l->base;
+	if (st.st_size == 0 || memcmp(h->magic, FMLOG_MAGIC, 8)) {
+		memcpy(h->magic, FMLOG_MAGIC, 8);
+		h->committed = FMLOG_DATA_OFF;
+	}
+	if (h->committed < FMLOG_DATA_OFF || h->committed > l->mapped) {
+		errno = EINVAL;
+		goto err;
+	}
+
+	// everything past the last commit point is considered garbage
+	l->tail = h->committed;
+	l->synced = h->committed;
+	return 0;
+
+err:
+	if (l->base != MAP_FAILED && l->base != NULL)
+		munmap(l->base, l->reserve);
+	file_close(l->f);
+	return -1;
+}
+
+/** Close the log.
+Uncommitted records are lost. */
+void fmlog_close(fmlog *l)
+{
+	munmap(l->base, l->reserve);
+	file_close(l->f);
+}
+
+/** Append a new record.
+No system calls are made unless the file needs to grow.
+Return pointer to the record data inside the mapping;
+  NULL on error */
+void* fmlog_append(fmlog *l, const void *data, unsigned int len)
+{
+	unsigned long long n = FMLOG_REC_SIZE(len);
+	if (l->tail + n > l->mapped
+		&& 0 != _fmlog_grow(l, l->tail + n))
+		return NULL;
+
+	char *p = l->base + l->tail;
+	*(unsigned int*)p = len;
+	memcpy(p + 4, data, len);
+	l->tail += n;
+	return p + 4;
+}
+
+/** Make all appended records durable.
+flags: FMLOG_SYNC (wait until data is on disk) or FMLOG_ASYNC (schedule writeback)
+Only the pages modified since the previous commit are flushed.
+Note: the order "data, then commit point" on disk is guaranteed only with FMLOG_SYNC.
+Return 0 on success */
+int fmlog_commit(fmlog *l, int flags)
+{
+	if (l->tail == l->synced)
+		return 0;
+
+	// 1. flush the records
+	size_t page = sysconf(_SC_PAGESIZE);
+	unsigned long long off = l->synced & ~(page - 1);
+	if (0 != msync(l->base + off, l->tail - off, flags))
+		return -1;
+
+	// 2. only then publish the new commit point (with MS_ASYNC step 1 hasn't necessarily finished yet)
+	struct fmlog_hdr *h = (void*)l->base;
+	h->committed = l->tail;
+	if (0 != msync(l->base, page, flags))
+		return -1;
+
+	l->synced = l->tail;
+	return 0;
+}
+
+/** Get the next committed record.
+off: (in/out) iterator; initialize with 0
+Return record data;
+  NULL if there are no more records (errno = 0) or the record is corrupt (errno = EBADMSG) */
+const void* fmlog_next(fmlog *l, unsigned long long *off, unsigned int *len)
+{
+	const struct fmlog_hdr *h = (void*)l->base;
+	if (*off == 0)
+		*off = FMLOG_DATA_OFF;
+	errno = 0;
+	if (*off + 4 > h->committed)
+		return NULL;
+
+	const char *p = l->base + *off;
+	*len = *(unsigned int*)p;
+	if (*len > h->committed - *off - 4
+		|| *off + FMLOG_REC_SIZE(*len) > h->committed) {
+		// torn or corrupt length: the record would extend past the commit point
+		errno = EBADMSG;
+		return NULL;
+	}
+	*off += FMLOG_REC_SIZE(*len);
+	return p + 4;
+}
+
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Compare appending N records via the mapping against a write() per record */
+void bench(unsigned int n)
+{
+	char rec[100];
+	memset(rec, 'x', sizeof(rec));
+	unlink("fmap-log.bench");
+	unlink("fmap-log.bench2");
+
+	fmlog l = {};
+	assert(0 == fmlog_open(&l, "fmap-log.bench", 4ULL*1024*1024*1024, 64*1024*1024));
+	double t = time_sec();
+	for (unsigned int i = 0;  i != n;  i++) {
+		assert(NULL != fmlog_append(&l, rec, sizeof(rec)));
+		if (i % 10000 == 9999)
+			assert(0 == fmlog_commit(&l, FMLOG_ASYNC));
+	}
+	assert(0 == fmlog_commit(&l, FMLOG_SYNC));
+	double t_map = time_sec() - t;
+	fmlog_close(&l);
+
+	file f = file_open("fmap-log.bench2", _FILE_CREATE | FILE_READWRITE);
+	assert(f != FILE_NULL);
+	t = time_sec();
+	for (unsigned int i = 0;  i != n;  i++) {
+		unsigned int len = sizeof(rec);
+		assert(4 == write(f, &len, 4));
+		assert(sizeof(rec) == write(f, rec, sizeof(rec)));
+	}
+	assert(0 == fsync(f));
+	double t_write = time_sec() - t;
+	file_close(f);
+
+	printf("records:%u  mmap:%.3fs (%.0f rec/s)  write:%.3fs (%.0f rec/s)\n"
+		, n, t_map, n / t_map, t_write, n / t_write);
+	unlink("fmap-log.bench");
+	unlink("fmap-log.bench2");
+}
+
+void main(int argc, char **argv)
+{
+	if (argc > 2 && !strcmp(argv[1], "bench")) {
+		bench(atoi(argv[2]));
+		return;
+	}
+
+	fmlog l = {};
+	assert(0 == fmlog_open(&l, "fmap-log.dat", 1024*1024*1024, 1024*1024));
+
+	if (argc > 1 && !strcmp(argv[1], "write")) {
+		// append records and make them durable at once
+		for (int i = 2;  i < argc;  i++) {
+			assert(NULL != fmlog_append(&l, argv[i], strlen(argv[i])));
+		}
+		assert(0 == fmlog_commit(&l, FMLOG_SYNC));
+
+	} else {
+		// print all committed records
+		unsigned long long off = 0;
+		unsigned int len;
+		const char *d;
+		while (NULL != (d = fmlog_next(&l, &off, &len))) {
+			printf("%.*s\n", (int)len, d);
+		}
+		if (errno == EBADMSG)
+			printf("corrupt record at offset %llu\n", off);
+	}
+
+	fmlog_close(&l);
+}
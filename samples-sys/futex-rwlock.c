@@ -0,0 +1,407 @@
+/* Cross-Platform System Programming Guide: Linux: reader-writer lock and sequence lock in shared memory
+Usage:
+	./futex-rwlock
+	./futex-rwlock bench [MAX_READERS]
+
+A semaphore (semaphore.c, futex-sem.c) lets only one process into the protected region,
+ even if all of them only read the shared data.
+The reader-writer lock lets any number of readers in at once, or one writer:
+ the state word holds the number of active readers and the WRITER flag;
+ a waiting writer sets the WRITER_WAITING flag, and new readers don't enter until it's done,
+ so a constant stream of readers can't starve the writer.
+Readers sleep on one futex and writers on another, so a writer wakes either the next writer or all the readers.
+
+The sequence lock is for small records that are read very often:
+ the readers don't write to the shared memory at all, so they don't fight over the lock's cache line.
+The writer increments the sequence number before and after the update (it's odd during the update);
+ a reader copies the record and retries if the sequence number was odd or has changed.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined __x86_64__ || defined __i386__
+	#define cpu_pause()  __builtin_ia32_pause()
+#elif defined __aarch64__
+	#define cpu_pause()  __asm__ volatile("yield")
+#else
+	#define cpu_pause()
+#endif
+
+#define SPIN  100
+
+static int futex_wait(unsigned int *addr, unsigned int val)
+{
+	return syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static int futex_wake(unsigned int *addr, unsigned int n)
+{
+	return syscall(SYS_futex, addr, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+#define RW_WRITER  0x80000000
+#define RW_WRITER_WAITING  0x40000000
+#define RW_READERS  0x3fffffff
+
+/** Process-shared writer-preferring reader-writer lock.
+Must be placed in shared memory (MAP_SHARED) and zero-initialized. */
+typedef struct rwlock {
+	unsigned int state; // RW_WRITER | RW_WRITER_WAITING | N of active readers
+	unsigned int writers_waiting;
+	unsigned int rseq, wseq; // futex words: incremented on each wake-up of readers/writers
+} rwlock;
+
+void rwlock_rdlock(rwlock *l)
+{
+	for (unsigned int i = 0;  ;  i++) {
+		unsigned int s = __atomic_load_n(&l->state, __ATOMIC_RELAXED);
+		if (!(s & (RW_WRITER | RW_WRITER_WAITING))) {
+			if (__atomic_compare_exchange_n(&l->state, &s, s + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+			continue;
+		}
+
+		if (i < SPIN) {
+			cpu_pause();
+			continue;
+		}
+
+		// read the sequence number before the final check: a wake-up after the check changes it
+		unsigned int seq = __atomic_load_n(&l->rseq, __ATOMIC_SEQ_CST);
+		s = __atomic_load_n(&l->state, __ATOMIC_SEQ_CST);
+		if (s & (RW_WRITER | RW_WRITER_WAITING))
+			futex_wait(&l->rseq, seq);
+	}
+}
+
+void rwlock_rdunlock(rwlock *l)
+{
+	unsigned int s = __atomic_sub_fetch(&l->state, 1, __ATOMIC_SEQ_CST);
+	if ((s & RW_READERS) == 0 && (s & RW_WRITER_WAITING)) {
+		// the last reader is out: let the writer in
+		__atomic_fetch_add(&l->wseq, 1, __ATOMIC_SEQ_CST);
+		futex_wake(&l->wseq, 1);
+	}
+}
+
+void rwlock_wrlock(rwlock *l)
+{
+	unsigned int s = 0;
+	if (__atomic_compare_exchange_n(&l->state, &s, RW_WRITER, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return; // fast path
+
+	__atomic_fetch_add(&l->writers_waiting, 1, __ATOMIC_SEQ_CST);
+	__atomic_fetch_or(&l->state, RW_WRITER_WAITING, __ATOMIC_SEQ_CST); // stop new readers
+
+	for (unsigned int i = 0;  ;  i++) {
+		s = __atomic_load_n(&l->state, __ATOMIC_RELAXED);
+		if (!(s & (RW_WRITER | RW_READERS))) {
+			// keep RW_WRITER_WAITING: the unlocking writer decides whether there are more writers
+			if (__atomic_compare_exchange_n(&l->state, &s, RW_WRITER | RW_WRITER_WAITING, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				break;
+			continue;
+		}
+
+		if (i < SPIN) {
+			cpu_pause();
+			continue;
+		}
+
+		unsigned int seq = __atomic_load_n(&l->wseq, __ATOMIC_SEQ_CST);
+		s = __atomic_load_n(&l->state, __ATOMIC_SEQ_CST);
+		if (s & (RW_WRITER | RW_READERS))
+			futex_wait(&l->wseq, seq);
+	}
+
+	__atomic_fetch_sub(&l->writers_waiting, 1, __ATOMIC_SEQ_CST);
+}
+
+void rwlock_wrunlock(rwlock *l)
+{
+	// only writers change the state while RW_WRITER is set: the new state depends on whether they wait
+	unsigned int waiting;
+	unsigned int s = __atomic_load_n(&l->state, __ATOMIC_RELAXED);
+	do {
+		waiting = __atomic_load_n(&l->writers_waiting, __ATOMIC_SEQ_CST);
+	} while (!__atomic_compare_exchange_n(&l->state, &s, (waiting) ? RW_WRITER_WAITING : 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	if (waiting) {
+		__atomic_fetch_add(&l->wseq, 1, __ATOMIC_SEQ_CST);
+		futex_wake(&l->wseq, 1);
+	} else {
+		__atomic_fetch_add(&l->rseq, 1, __ATOMIC_SEQ_CST);
+		futex_wake(&l->rseq, INT_MAX);
+	}
+}
+
+
+/** Sequence lock: the sequence number is odd while the writer updates the data */
+typedef struct seqlock {
+	unsigned int seq;
+} seqlock;
+
+/** Begin the update.
+Writers are serialized by the lock itself: they spin while the number is odd. */
+void seqlock_write_begin(seqlock *l)
+{
+	for (;;) {
+		unsigned int s = __atomic_load_n(&l->seq, __ATOMIC_RELAXED);
+		if (!(s & 1)
+			&& __atomic_compare_exchange_n(&l->seq, &s, s + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+		cpu_pause();
+	}
+	// the data stores must not become visible before the odd number
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void seqlock_write_end(seqlock *l)
+{
+	__atomic_fetch_add(&l->seq, 1, __ATOMIC_RELEASE);
+}
+
+/** Begin reading: wait until no update is in progress.
+Return the sequence number for seqlock_read_retry() */
+unsigned int seqlock_read_begin(const seqlock *l)
+{
+	for (;;) {
+		unsigned int s = __atomic_load_n(&l->seq, __ATOMIC_ACQUIRE);
+		if (!(s & 1))
+			return s;
+		cpu_pause();
+	}
+}
+
+/** Return 1 if the data was modified while we were reading it: the copy must be thrown away */
+int seqlock_read_retry(const seqlock *l, unsigned int seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&l->seq, __ATOMIC_RELAXED) != seq;
+}
+
+
+/** The record that the writer keeps consistent: all values are equal */
+struct record {
+	unsigned long long v[8];
+};
+
+/** Copy the record; the source may be modified concurrently when read under seqlock */
+static void record_copy(struct record *dst, const volatile struct record *src)
+{
+	for (unsigned int i = 0;  i != 8;  i++) {
+		dst->v[i] = src->v[i];
+	}
+}
+
+static void record_update(volatile struct record *r)
+{
+	unsigned long long n = r->v[0] + 1;
+	for (unsigned int i = 0;  i != 8;  i++) {
+		r->v[i] = n;
+	}
+}
+
+static int record_valid(const struct record *r)
+{
+	for (unsigned int i = 1;  i != 8;  i++) {
+		if (r->v[i] != r->v[0])
+			return 0;
+	}
+	return 1;
+}
+
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define READERS_MAX  32
+
+struct shared {
+	rwlock rw;
+	seqlock sl;
+	sem_t sem; // process-shared semaphore used as a mutex
+	struct record rec;
+	unsigned int stop;
+	struct {
+		unsigned long long reads;
+		char pad[56]; // a separate cache line for each reader
+	} counters[READERS_MAX];
+};
+
+enum LOCK {
+	L_SEM,
+	L_RWLOCK,
+	L_SEQLOCK,
+};
+
+static void reader(struct shared *sh, unsigned int kind, unsigned int idx)
+{
+	unsigned long long n = 0;
+	struct record r;
+	while (!__atomic_load_n(&sh->stop, __ATOMIC_RELAXED)) {
+		switch (kind) {
+		case L_SEM:
+			while (0 != sem_wait(&sh->sem)) {
+			}
+			record_copy(&r, &sh->rec);
+			sem_post(&sh->sem);
+			break;
+
+		case L_RWLOCK:
+			rwlock_rdlock(&sh->rw);
+			record_copy(&r, &sh->rec);
+			rwlock_rdunlock(&sh->rw);
+			break;
+
+		case L_SEQLOCK: {
+			unsigned int seq;
+			do {
+				seq = seqlock_read_begin(&sh->sl);
+				record_copy(&r, &sh->rec);
+			} while (seqlock_read_retry(&sh->sl, seq));
+			break;
+		}
+		}
+		assert(record_valid(&r));
+		n++;
+	}
+	sh->counters[idx].reads = n;
+}
+
+/** Update the record every 100us until stopped */
+static void writer(struct shared *sh, unsigned int kind)
+{
+	while (!__atomic_load_n(&sh->stop, __ATOMIC_RELAXED)) {
+		switch (kind) {
+		case L_SEM:
+			while (0 != sem_wait(&sh->sem)) {
+			}
+			record_update(&sh->rec);
+			sem_post(&sh->sem);
+			break;
+
+		case L_RWLOCK:
+			rwlock_wrlock(&sh->rw);
+			record_update(&sh->rec);
+			rwlock_wrunlock(&sh->rw);
+			break;
+
+		case L_SEQLOCK:
+			seqlock_write_begin(&sh->sl);
+			record_update(&sh->rec);
+			seqlock_write_end(&sh->sl);
+			break;
+		}
+		usleep(100);
+	}
+}
+
+/** N reader processes and 1 writer process access the shared record for 0.5 seconds */
+void bench(unsigned int max_readers)
+{
+	static const char *names[] = { "semaphore", "rwlock", "seqlock" };
+
+	struct shared *sh = mmap(NULL, sizeof(struct shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	assert(sh != MAP_FAILED);
+	sem_init(&sh->sem, /*pshared*/ 1, 1);
+
+	for (unsigned int kind = 0;  kind != 3;  kind++) {
+		for (unsigned int nr = 1;  nr <= max_readers;  nr *= 2) {
+			sh->stop = 0;
+			pid_t pids[READERS_MAX + 1];
+			for (unsigned int i = 0;  i != nr + 1;  i++) {
+				pids[i] = fork();
+				assert(pids[i] >= 0);
+				if (pids[i] == 0) {
+					if (i == nr)
+						writer(sh, kind);
+					else
+						reader(sh, kind, i);
+					_exit(0);
+				}
+			}
+
+			double t = time_sec();
+			usleep(500*1000);
+			__atomic_store_n(&sh->stop, 1, __ATOMIC_RELAXED);
+			unsigned long long total = 0;
+			for (unsigned int i = 0;  i != nr + 1;  i++) {
+				int status;
+				waitpid(pids[i], &status, 0);
+				assert(WIFEXITED(status));
+			}
+			t = time_sec() - t;
+			for (unsigned int i = 0;  i != nr;  i++) {
+				total += sh->counters[i].reads;
+			}
+			printf("%-10s readers:%2u  %.1fM reads/s\n"
+				, names[kind], nr, total / t / 1e6);
+		}
+	}
+
+	sem_destroy(&sh->sem);
+	munmap(sh, sizeof(struct shared));
+}
+
+void main(int argc, char **argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		unsigned int n = (argc > 2) ? atoi(argv[2]) : READERS_MAX;
+		assert(n != 0 && n <= READERS_MAX);
+		bench(n);
+		return;
+	}
+
+	struct shared *sh = mmap(NULL, sizeof(struct shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	assert(sh != MAP_FAILED);
+
+	// the writer process waits until the 2 readers are out
+	rwlock_rdlock(&sh->rw);
+	rwlock_rdlock(&sh->rw);
+	pid_t pid = fork();
+	if (pid == 0) {
+		rwlock_wrlock(&sh->rw);
+		puts("writer: entered");
+		fflush(stdout);
+		record_update(&sh->rec);
+		rwlock_wrunlock(&sh->rw);
+		_exit(0);
+	}
+	usleep(100*1000);
+	puts("readers: leaving");
+	fflush(stdout);
+	rwlock_rdunlock(&sh->rw);
+	rwlock_rdunlock(&sh->rw);
+	waitpid(pid, NULL, 0);
+
+	rwlock_rdlock(&sh->rw);
+	printf("reader: value %llu\n", sh->rec.v[0]);
+	rwlock_rdunlock(&sh->rw);
+
+	unsigned int seq;
+	struct record r;
+	do {
+		seq = seqlock_read_begin(&sh->sl);
+		record_copy(&r, &sh->rec);
+	} while (seqlock_read_retry(&sh->sl, seq));
+	assert(record_valid(&r));
+
+	munmap(sh, sizeof(struct shared));
+}
@@ -0,0 +1,405 @@
+/* Cross-Platform System Programming Guide: Linux: process-shared semaphore and robust mutex built on futex
+Usage:
+	./futex-sem
+	./futex-sem bench [PROCESSES]
+
+semaphore.c uses POSIX named semaphores.
+Here the semaphore is a 32-bit counter in a shared memory object (/dev/shm/NAME):
+ cpsem_wait() decrements the counter with a single compare-and-swap if it's positive;
+ otherwise it spins for a while, then sleeps in the kernel with FUTEX_WAIT on the counter's address.
+cpsem_post() increments the counter and calls FUTEX_WAKE only if someone is sleeping.
+The futex calls are not FUTEX_PRIVATE: the waiters are in different processes.
+
+The mutex stores the owner's thread ID in the lock word, so it can be robust:
+ each thread registers a list of the mutexes it holds with set_robust_list(),
+ and when a thread dies, the kernel marks its mutexes with FUTEX_OWNER_DIED and wakes a waiter.
+The next owner gets EOWNERDEAD and must repair the protected data.
+Note: set_robust_list() replaces glibc's list for the thread,
+ so don't use PTHREAD_MUTEX_ROBUST mutexes in the same thread.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined __x86_64__ || defined __i386__
+	#define cpu_pause()  __builtin_ia32_pause()
+#elif defined __aarch64__
+	#define cpu_pause()  __asm__ volatile("yield")
+#else
+	#define cpu_pause()
+#endif
+
+#define FSEM_SPIN  100
+
+static int futex_wait(unsigned int *addr, unsigned int val)
+{
+	return syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static int futex_wake(unsigned int *addr, unsigned int n)
+{
+	return syscall(SYS_futex, addr, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+#define FSEM_MAGIC  0x6d657366
+
+struct fsem {
+	unsigned int value;
+	unsigned int waiters; // N of processes sleeping (or about to sleep) in FUTEX_WAIT
+	unsigned int magic; // FSEM_MAGIC after the creator has initialized the object
+};
+
+typedef struct fsem* cpsem;
+#define CPSEM_NULL  NULL
+#define CPSEM_CREATE  O_CREAT
+
+/** Open or create a semaphore
+flags: 0 or CPSEM_CREATE
+value: initial value
+Return CPSEM_NULL on error */
+cpsem cpsem_open(const char *name, unsigned int flags, unsigned int value)
+{
+	int created = 0;
+	int fd = -1;
+	if (flags & CPSEM_CREATE) {
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+		created = (fd != -1);
+	}
+	if (fd == -1)
+		fd = shm_open(name, O_RDWR, 0);
+	if (fd == -1)
+		return CPSEM_NULL;
+
+	if (created && 0 != ftruncate(fd, sizeof(struct fsem))) {
+		close(fd);
+		return CPSEM_NULL;
+	}
+
+	// the creator may not have set the size yet
+	struct stat st;
+	while (0 == fstat(fd, &st) && st.st_size < (off_t)sizeof(struct fsem)) {
+		usleep(1000);
+	}
+
+	struct fsem *s = mmap(NULL, sizeof(struct fsem), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED)
+		return CPSEM_NULL;
+
+	if (created) {
+		s->value = value;
+		s->waiters = 0;
+		__atomic_store_n(&s->magic, FSEM_MAGIC, __ATOMIC_RELEASE);
+	} else {
+		while (__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != FSEM_MAGIC) {
+			usleep(1000);
+		}
+	}
+	return s;
+}
+
+/** Close semaphore */
+void cpsem_close(cpsem s)
+{
+	munmap(s, sizeof(struct fsem));
+}
+
+/** Delete semaphore */
+int cpsem_unlink(const char *name)
+{
+	return shm_unlink(name);
+}
+
+/** Try to decrease the counter without blocking.
+Return 1 on success */
+static int _fsem_trywait(struct fsem *s)
+{
+	unsigned int v = __atomic_load_n(&s->value, __ATOMIC_RELAXED);
+	while (v != 0) {
+		if (__atomic_compare_exchange_n(&s->value, &v, v - 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return 1;
+	}
+	return 0;
+}
+
+/** Decrease semaphore value, blocking if necessary */
+int cpsem_wait(cpsem s)
+{
+	if (_fsem_trywait(s))
+		return 0; // fast path
+
+	for (unsigned int i = 0;  i != FSEM_SPIN;  i++) {
+		cpu_pause();
+		if (_fsem_trywait(s))
+			return 0;
+	}
+
+	__atomic_fetch_add(&s->waiters, 1, __ATOMIC_SEQ_CST);
+	while (!_fsem_trywait(s)) {
+		// sleeps only if the value is still 0: a post between the check and the call isn't lost
+		futex_wait(&s->value, 0);
+	}
+	__atomic_fetch_sub(&s->waiters, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/** Increase semaphore value */
+int cpsem_post(cpsem s)
+{
+	__atomic_fetch_add(&s->value, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->waiters, __ATOMIC_SEQ_CST) != 0)
+		futex_wake(&s->value, 1);
+	return 0;
+}
+
+
+/** Process-shared robust mutex.
+The lock word: 0 (free) or owner TID | FUTEX_WAITERS | FUTEX_OWNER_DIED */
+typedef struct fmutex {
+	unsigned int lock;
+	struct robust_list list; // the owner's robust list entry (its pointers are valid in the owner process only)
+} fmutex;
+
+static __thread struct robust_list_head robust_head;
+static __thread int robust_registered;
+static __thread unsigned int self_tid;
+
+/** A forked child is a new thread with glibc's robust list: register ours again on the first lock */
+static void _robust_atfork_child()
+{
+	robust_registered = 0;
+}
+
+static void _robust_atfork_register()
+{
+	pthread_atfork(NULL, NULL, _robust_atfork_child);
+}
+
+/** Register the robust list of this thread */
+static void _robust_init()
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, _robust_atfork_register);
+
+	robust_head.list.next = &robust_head.list; // empty circular list
+	robust_head.futex_offset = offsetof(fmutex, lock) - offsetof(fmutex, list);
+	robust_head.list_op_pending = NULL;
+	syscall(SYS_set_robust_list, &robust_head, sizeof(robust_head));
+	self_tid = gettid();
+	robust_registered = 1;
+}
+
+static void _robust_add(fmutex *m)
+{
+	m->list.next = robust_head.list.next;
+	robust_head.list.next = &m->list;
+}
+
+static void _robust_remove(fmutex *m)
+{
+	struct robust_list *p = &robust_head.list;
+	while (p->next != &m->list) {
+		p = p->next;
+	}
+	p->next = m->list.next;
+}
+
+void fmutex_init(fmutex *m)
+{
+	memset(m, 0, sizeof(*m));
+}
+
+/** Acquire the mutex.
+Return 0 on success;
+  EOWNERDEAD: the mutex is acquired, but the previous owner died while holding it */
+int fmutex_lock(fmutex *m)
+{
+	if (!robust_registered)
+		_robust_init();
+
+	// if we die between locking and adding to the list, the kernel checks list_op_pending
+	robust_head.list_op_pending = &m->list;
+
+	unsigned int v = 0;
+	int r = 0;
+	if (!__atomic_compare_exchange_n(&m->lock, &v, self_tid, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		for (unsigned int i = 0;  ;  i++) {
+			v = __atomic_load_n(&m->lock, __ATOMIC_RELAXED);
+			if ((v & FUTEX_TID_MASK) == 0) {
+				// free, or the owner has died.
+				// After sleeping we don't know whether there are other waiters, so keep FUTEX_WAITERS.
+				unsigned int nv = self_tid | ((i >= FSEM_SPIN) ? FUTEX_WAITERS : (v & FUTEX_WAITERS));
+				if (__atomic_compare_exchange_n(&m->lock, &v, nv, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+					if (v & FUTEX_OWNER_DIED)
+						r = EOWNERDEAD;
+					break;
+				}
+				continue;
+			}
+
+			if (i < FSEM_SPIN) {
+				cpu_pause();
+				continue;
+			}
+
+			// tell the owner to wake us up, then sleep
+			if (!(v & FUTEX_WAITERS)
+				&& !__atomic_compare_exchange_n(&m->lock, &v, v | FUTEX_WAITERS, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				continue;
+			futex_wait(&m->lock, v | FUTEX_WAITERS);
+		}
+	}
+
+	_robust_add(m);
+	robust_head.list_op_pending = NULL;
+	return r;
+}
+
+/** Release the mutex */
+void fmutex_unlock(fmutex *m)
+{
+	robust_head.list_op_pending = &m->list;
+	_robust_remove(m);
+
+	unsigned int v = self_tid;
+	if (!__atomic_compare_exchange_n(&m->lock, &v, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		// there are waiters
+		__atomic_store_n(&m->lock, 0, __ATOMIC_RELEASE);
+		futex_wake(&m->lock, 1);
+	}
+	robust_head.list_op_pending = NULL;
+}
+
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct shared {
+	fmutex m;
+	sem_t psem; // process-shared POSIX semaphore
+	unsigned long long counter; // protected by the lock being tested
+};
+
+enum LOCK {
+	L_FSEM,
+	L_POSIX_SEM,
+	L_FMUTEX,
+};
+
+static void lock_run(unsigned int kind, cpsem fs, struct shared *sh, unsigned int n)
+{
+	for (unsigned int i = 0;  i != n;  i++) {
+		switch (kind) {
+		case L_FSEM:
+			cpsem_wait(fs);
+			sh->counter++;
+			cpsem_post(fs);
+			break;
+		case L_POSIX_SEM:
+			sem_wait(&sh->psem);
+			sh->counter++;
+			sem_post(&sh->psem);
+			break;
+		case L_FMUTEX:
+			fmutex_lock(&sh->m);
+			sh->counter++;
+			fmutex_unlock(&sh->m);
+			break;
+		}
+	}
+}
+
+/** 'procs' processes acquire and release the same lock 'n' times each */
+void bench(unsigned int procs)
+{
+	static const char *names[] = { "futex cpsem", "sem_wait/sem_post", "futex mutex" };
+	const unsigned int n = 1000000;
+
+	cpsem fs = cpsem_open("/cpspg-bench.fsem", CPSEM_CREATE, 1);
+	assert(fs != CPSEM_NULL);
+	cpsem_unlink("/cpspg-bench.fsem");
+
+	struct shared *sh = mmap(NULL, sizeof(struct shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	assert(sh != MAP_FAILED);
+	fmutex_init(&sh->m);
+	sem_init(&sh->psem, /*pshared*/ 1, 1);
+
+	for (unsigned int kind = 0;  kind != 3;  kind++) {
+		unsigned int np[] = { 1, procs };
+		for (unsigned int k = 0;  k != 2;  k++) {
+			sh->counter = 0;
+			double t = time_sec();
+			for (unsigned int i = 0;  i != np[k];  i++) {
+				if (0 == fork()) {
+					lock_run(kind, fs, sh, n);
+					_exit(0);
+				}
+			}
+			for (unsigned int i = 0;  i != np[k];  i++) {
+				wait(NULL);
+			}
+			t = time_sec() - t;
+			assert(sh->counter == (unsigned long long)n * np[k]);
+			printf("%-18s processes:%u  %.1f ns/op\n"
+				, names[kind], np[k], t * 1e9 / (n * np[k]));
+		}
+	}
+
+	sem_destroy(&sh->psem);
+	munmap(sh, sizeof(struct shared));
+	cpsem_close(fs);
+}
+
+void main(int argc, char **argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		bench((argc > 2) ? atoi(argv[2]) : 4);
+		return;
+	}
+
+	// the same sequence as in semaphore.c
+	const char *name = "/cpspg.fsem";
+	cpsem s = cpsem_open(name, CPSEM_CREATE, 1);
+	assert(s != CPSEM_NULL);
+	assert(0 == cpsem_wait(s));
+	puts("Entered semaphore-protected region");
+	assert(0 == cpsem_post(s));
+	cpsem_close(s);
+	assert(0 == cpsem_unlink(name));
+
+	// robust mutex: the child dies while holding the lock
+	fmutex *m = mmap(NULL, sizeof(fmutex), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	assert(m != MAP_FAILED);
+	fmutex_init(m);
+	if (0 == fork()) {
+		assert(0 == fmutex_lock(m));
+		_exit(0); // exit without unlocking
+	}
+	wait(NULL);
+	int r = fmutex_lock(m);
+	printf("fmutex_lock(): %s\n", (r == EOWNERDEAD) ? "EOWNERDEAD: the previous owner died" : "OK");
+	assert(r == EOWNERDEAD);
+	fmutex_unlock(m);
+	assert(0 == fmutex_lock(m));
+	fmutex_unlock(m);
+	munmap(m, sizeof(fmutex));
+}
@@ -0,0 +1,314 @@
+/* Cross-Platform System Programming Guide: Linux: IPC latency and throughput benchmark
+Usage:
+	./ipc-bench [-a CPU] [-b CPU] [-m MB] [pipe] [unix] [shm]
+	./ipc-bench -a 0 -b 1 -m 64 >results.csv
+
+Compares the transports shown in the other samples:
+ anonymous pipes (pipe.c), UNIX stream sockets (pipe-named.c),
+ and shared memory (file-mapping.c) with process-shared semaphores (semaphore.c) for signaling.
+For each message size from 8B to 1MB:
+ "latency" test: ping-pong between 2 processes, the result is the round-trip time;
+ "throughput" test: one process streams the messages, the other reads them.
+The processes may be pinned to the specified CPUs: on the same CPU each message means a context switch,
+ on different CPUs the data moves between caches.
+The results are printed in CSV format.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MSG_MAX  (1024*1024)
+#define SHM_SLOTS  4
+
+/** Shared memory channel: a ring of slots; the semaphores count the free and the filled slots */
+struct shm_chan {
+	sem_t empty, full;
+	unsigned int rd, wr; // slot index of the reader and the writer (each used by one process only)
+	char slots[SHM_SLOTS][MSG_MAX];
+};
+
+/** Two one-way channels: dir=0: parent -> child;  dir=1: child -> parent */
+struct ipc {
+	int fd[2][2]; // pipe: [dir][read end, write end];  unix socket: fd[0][0] (parent), fd[0][1] (child)
+	struct shm_chan *shm; // [2]
+};
+
+struct transport {
+	const char *name;
+	int (*open)(struct ipc *c);
+	void (*close)(struct ipc *c);
+	/** Send/receive the whole message */
+	int (*send)(struct ipc *c, int dir, const void *buf, size_t len);
+	int (*recv)(struct ipc *c, int dir, void *buf, size_t len);
+};
+
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	while (len != 0) {
+		ssize_t r = write(fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buf = (char*)buf + r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	while (len != 0) {
+		ssize_t r = read(fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buf = (char*)buf + r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int pipe_open(struct ipc *c)
+{
+	if (0 != pipe(c->fd[0]))
+		return -1;
+	if (0 != pipe(c->fd[1]))
+		return -1;
+	return 0;
+}
+
+static void pipe_close(struct ipc *c)
+{
+	for (int i = 0;  i != 2;  i++) {
+		close(c->fd[i][0]);
+		close(c->fd[i][1]);
+	}
+}
+
+static int pipe_send(struct ipc *c, int dir, const void *buf, size_t len)
+{
+	return write_all(c->fd[dir][1], buf, len);
+}
+
+static int pipe_recv(struct ipc *c, int dir, void *buf, size_t len)
+{
+	return read_all(c->fd[dir][0], buf, len);
+}
+
+static int unix_open(struct ipc *c)
+{
+	return socketpair(AF_UNIX, SOCK_STREAM, 0, c->fd[0]);
+}
+
+static void unix_close(struct ipc *c)
+{
+	close(c->fd[0][0]);
+	close(c->fd[0][1]);
+}
+
+/* parent uses fd[0][0], child uses fd[0][1] */
+static int unix_send(struct ipc *c, int dir, const void *buf, size_t len)
+{
+	return write_all(c->fd[0][dir], buf, len);
+}
+
+static int unix_recv(struct ipc *c, int dir, void *buf, size_t len)
+{
+	return read_all(c->fd[0][!dir], buf, len);
+}
+
+static int shm_open_(struct ipc *c)
+{
+	c->shm = mmap(NULL, 2 * sizeof(struct shm_chan), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (c->shm == MAP_FAILED)
+		return -1;
+	for (int i = 0;  i != 2;  i++) {
+		sem_init(&c->shm[i].empty, /*pshared*/ 1, SHM_SLOTS);
+		sem_init(&c->shm[i].full, 1, 0);
+		c->shm[i].rd = c->shm[i].wr = 0;
+	}
+	return 0;
+}
+
+static void shm_close(struct ipc *c)
+{
+	for (int i = 0;  i != 2;  i++) {
+		sem_destroy(&c->shm[i].empty);
+		sem_destroy(&c->shm[i].full);
+	}
+	munmap(c->shm, 2 * sizeof(struct shm_chan));
+}
+
+static int shm_send(struct ipc *c, int dir, const void *buf, size_t len)
+{
+	struct shm_chan *ch = &c->shm[dir];
+	while (0 != sem_wait(&ch->empty)) {
+	}
+	memcpy(ch->slots[ch->wr], buf, len);
+	ch->wr = (ch->wr + 1) % SHM_SLOTS;
+	sem_post(&ch->full);
+	return 0;
+}
+
+static int shm_recv(struct ipc *c, int dir, void *buf, size_t len)
+{
+	struct shm_chan *ch = &c->shm[dir];
+	while (0 != sem_wait(&ch->full)) {
+	}
+	memcpy(buf, ch->slots[ch->rd], len);
+	ch->rd = (ch->rd + 1) % SHM_SLOTS;
+	sem_post(&ch->empty);
+	return 0;
+}
+
+static const struct transport transports[] = {
+	{ "pipe", pipe_open, pipe_close, pipe_send, pipe_recv },
+	{ "unix", unix_open, unix_close, unix_send, unix_recv },
+	{ "shm", shm_open_, shm_close, shm_send, shm_recv },
+};
+
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void cpu_pin(int cpu)
+{
+	if (cpu < 0)
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (0 != sched_setaffinity(0, sizeof(set), &set))
+		fprintf(stderr, "sched_setaffinity(%d): %s\n", cpu, strerror(errno));
+}
+
+enum TEST {
+	T_LATENCY,
+	T_THROUGHPUT,
+};
+
+/** Run one test in 2 processes.
+Return the time measured by the parent */
+static double run(const struct transport *tr, unsigned int test, size_t size, unsigned int count, int cpu_a, int cpu_b)
+{
+	struct ipc c = {};
+	assert(0 == tr->open(&c));
+	char *buf = malloc(size);
+	memset(buf, 'x', size);
+
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		cpu_pin(cpu_b);
+		if (test == T_LATENCY) {
+			for (unsigned int i = 0;  i != count;  i++) {
+				assert(0 == tr->recv(&c, 0, buf, size));
+				assert(0 == tr->send(&c, 1, buf, size));
+			}
+		} else {
+			for (unsigned int i = 0;  i != count;  i++) {
+				assert(0 == tr->recv(&c, 0, buf, size));
+			}
+			assert(0 == tr->send(&c, 1, buf, 1)); // "all received"
+		}
+		_exit(0);
+	}
+
+	cpu_pin(cpu_a);
+	double t = time_sec();
+	if (test == T_LATENCY) {
+		for (unsigned int i = 0;  i != count;  i++) {
+			assert(0 == tr->send(&c, 0, buf, size));
+			assert(0 == tr->recv(&c, 1, buf, size));
+		}
+	} else {
+		for (unsigned int i = 0;  i != count;  i++) {
+			assert(0 == tr->send(&c, 0, buf, size));
+		}
+		assert(0 == tr->recv(&c, 1, buf, 1));
+	}
+	t = time_sec() - t;
+
+	waitpid(pid, NULL, 0);
+	tr->close(&c);
+	free(buf);
+	return t;
+}
+
+void main(int argc, char **argv)
+{
+	int cpu_a = -1, cpu_b = -1;
+	unsigned int total_mb = 256;
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "a:b:m:"))) {
+		switch (opt) {
+		case 'a':
+			cpu_a = atoi(optarg); break;
+		case 'b':
+			cpu_b = atoi(optarg); break;
+		case 'm':
+			total_mb = atoi(optarg); break;
+		default:
+			return;
+		}
+	}
+
+	// restore the original affinity after each test
+	cpu_set_t orig;
+	sched_getaffinity(0, sizeof(orig), &orig);
+
+	printf("transport,test,msg_size,count,seconds,rtt_us,mb_per_s\n");
+	for (unsigned int ti = 0;  ti != sizeof(transports) / sizeof(*transports);  ti++) {
+		const struct transport *tr = &transports[ti];
+		if (optind < argc) {
+			int found = 0;
+			for (int i = optind;  i < argc;  i++) {
+				if (!strcmp(argv[i], tr->name))
+					found = 1;
+			}
+			if (!found)
+				continue;
+		}
+
+		static const size_t sizes[] = { 8, 64, 512, 4*1024, 32*1024, 256*1024, MSG_MAX };
+		for (unsigned int si = 0;  si != sizeof(sizes) / sizeof(*sizes);  si++) {
+			size_t size = sizes[si];
+			size_t total = (size_t)total_mb * 1024*1024;
+
+			unsigned int count = total / 16 / size; // latency test moves less data
+			count = (count < 100) ? 100 : (count > 20000) ? 20000 : count;
+			double t = run(tr, T_LATENCY, size, count, cpu_a, cpu_b);
+			sched_setaffinity(0, sizeof(orig), &orig);
+			printf("%s,latency,%zu,%u,%.6f,%.3f,%.1f\n"
+				, tr->name, size, count, t, t / count * 1e6, size * 2.0 * count / t / (1024*1024));
+			fflush(stdout);
+
+			count = total / size;
+			count = (count < 100) ? 100 : (count > 500000) ? 500000 : count;
+			t = run(tr, T_THROUGHPUT, size, count, cpu_a, cpu_b);
+			sched_setaffinity(0, sizeof(orig), &orig);
+			printf("%s,throughput,%zu,%u,%.6f,,%.1f\n"
+				, tr->name, size, count, t, size * 1.0 * count / t / (1024*1024));
+			fflush(stdout);
+		}
+	}
+}
@@ -0,0 +1,248 @@
+/* Cross-Platform System Programming Guide: Linux: share anonymous memory between processes via memfd
+Usage:
+	./memfd-share server
+						./memfd-share client
+						data from memfd
+
+	./memfd-share exec
+	child: data from memfd
+
+The shared memory object is created with memfd_create(), so no file system and no disk I/O is involved.
+The creator seals the object (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) before passing it to other processes,
+ so the receiver may safely read from it without expecting the size or the contents to change.
+The descriptor is passed either over a UNIX socket (SCM_RIGHTS message) or by inheritance to a new process.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef int shmem;
+#define SHMEM_NULL  (-1)
+
+#define SHMEM_SEAL_ALL  (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+
+/** Create an anonymous shared memory object of the specified size.
+Return SHMEM_NULL on error */
+shmem shmem_create(const char *name, size_t size)
+{
+	shmem m = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (m < 0)
+		return SHMEM_NULL;
+	if (0 != ftruncate(m, size)) {
+		close(m);
+		return SHMEM_NULL;
+	}
+	return m;
+}
+
+void shmem_close(shmem m)
+{
+	close(m);
+}
+
+/** Seal the object, so nobody can modify it anymore.
+All writable mappings must be unmapped before this call.
+Return 0 on success */
+int shmem_seal(shmem m)
+{
+	return fcntl(m, F_ADD_SEALS, SHMEM_SEAL_ALL);
+}
+
+/** Check that the object received from another process is sealed */
+int shmem_sealed(shmem m)
+{
+	int seals = fcntl(m, F_GET_SEALS);
+	return (seals >= 0 && (seals & SHMEM_SEAL_ALL) == SHMEM_SEAL_ALL);
+}
+
+/** Get object size */
+long long shmem_size(shmem m)
+{
+	return lseek(m, 0, SEEK_END);
+}
+
+#define FMAP_READ  PROT_READ
+#define FMAP_READWRITE  (PROT_READ | PROT_WRITE)
+#define FMAP_SHARED  MAP_SHARED
+
+/** Map file region into memory
+Return NULL on error */
+void* fmap_map(int f, unsigned long long offset, size_t size, int prot, int flags)
+{
+	void *h = mmap(NULL, size, prot, flags, f, offset);
+	return (h != MAP_FAILED) ? h : NULL;
+}
+
+/** Unmap the previously mapped region */
+int fmap_unmap(void *p, size_t sz)
+{
+	return munmap(p, sz);
+}
+
+
+/** Send a descriptor over a UNIX socket.
+Return 0 on success */
+int unixsock_send_fd(int sk, int fd)
+{
+	char data = '\0';
+	struct iovec iov = { &data, 1 };
+	char ctl[CMSG_SPACE(sizeof(int))] = {};
+
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl;
+	msg.msg_controllen = sizeof(ctl);
+
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(c), &fd, sizeof(int));
+
+	return (1 == sendmsg(sk, &msg, 0)) ? 0 : -1;
+}
+
+/** Receive a descriptor from a UNIX socket.
+Return -1 on error */
+int unixsock_recv_fd(int sk)
+{
+	char data;
+	struct iovec iov = { &data, 1 };
+	char ctl[CMSG_SPACE(sizeof(int))] = {};
+
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl;
+	msg.msg_controllen = sizeof(ctl);
+
+	if (1 != recvmsg(sk, &msg, MSG_CMSG_CLOEXEC))
+		return -1;
+
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+	if (c == NULL
+		|| c->cmsg_level != SOL_SOCKET
+		|| c->cmsg_type != SCM_RIGHTS) {
+		errno = EBADMSG;
+		return -1;
+	}
+	int fd;
+	memcpy(&fd, CMSG_DATA(c), sizeof(int));
+	return fd;
+}
+
+static int unixsock_addr(struct sockaddr_un *a, const char *name)
+{
+	a->sun_family = AF_UNIX;
+	size_t len = strlen(name);
+	if (len + 1 > sizeof(a->sun_path)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(a->sun_path, name, len + 1);
+	return 0;
+}
+
+
+/** Create a sealed memory object with the data */
+shmem create_data(const char *data)
+{
+	size_t size = 4096;
+	shmem m = shmem_create("cpspg-data", size);
+	assert(m != SHMEM_NULL);
+
+	char *p = fmap_map(m, 0, size, FMAP_READWRITE, FMAP_SHARED);
+	assert(p != NULL);
+	memcpy(p, data, strlen(data) + 1);
+	fmap_unmap(p, size);
+
+	assert(0 == shmem_seal(m));
+	return m;
+}
+
+/** Map the received object and print its contents */
+void print_data(const char *prefix, shmem m)
+{
+	assert(shmem_sealed(m));
+	long long size = shmem_size(m);
+	assert(size > 0);
+
+	const char *p = fmap_map(m, 0, size, FMAP_READ, FMAP_SHARED);
+	assert(p != NULL);
+	printf("%s%.*s\n", prefix, (int)strnlen(p, size), p);
+	fmap_unmap((void*)p, size);
+}
+
+void main(int argc, char **argv)
+{
+	const char *name = "/tmp/cpspg.memfd";
+	struct sockaddr_un a = {};
+	assert(0 == unixsock_addr(&a, name));
+
+	if (argc > 1 && !strcmp(argv[1], "server")) {
+		shmem m = create_data("data from memfd");
+
+		unlink(name);
+		int lsk = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		assert(lsk != -1);
+		assert(0 == bind(lsk, (struct sockaddr*)&a, sizeof(a)));
+		assert(0 == listen(lsk, 0));
+
+		// pass the descriptor to the client
+		int sk = accept(lsk, NULL, NULL);
+		assert(sk != -1);
+		assert(0 == unixsock_send_fd(sk, m));
+
+		close(sk);
+		close(lsk);
+		unlink(name);
+		shmem_close(m);
+
+	} else if (argc > 1 && !strcmp(argv[1], "client")) {
+		int sk = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		assert(sk != -1);
+		assert(0 == connect(sk, (struct sockaddr*)&a, sizeof(a)));
+
+		shmem m = unixsock_recv_fd(sk);
+		assert(m != SHMEM_NULL);
+		close(sk);
+
+		print_data("", m);
+		shmem_close(m);
+
+	} else if (argc > 1 && !strcmp(argv[1], "exec")) {
+		shmem m = create_data("data from memfd");
+
+		// the child process inherits the descriptor: clear close-on-exec flag and pass its number via command line
+		assert(0 == fcntl(m, F_SETFD, 0));
+		char sfd[16];
+		snprintf(sfd, sizeof(sfd), "%d", m);
+		char *args[] = { argv[0], "child", sfd, NULL };
+
+		extern char **environ;
+		pid_t p = vfork();
+		if (p == 0) {
+			execve("/proc/self/exe", args, environ);
+			_exit(255);
+		}
+		assert(p > 0);
+		shmem_close(m);
+		assert(p == waitpid(p, NULL, 0));
+
+	} else if (argc > 2 && !strcmp(argv[1], "child")) {
+		shmem m = atoi(argv[2]);
+		print_data("child: ", m);
+		shmem_close(m);
+	}
+}
@@ -0,0 +1,386 @@
+/* Cross-Platform System Programming Guide: Linux: multiplexed UNIX socket server with message framing
+Usage:
+	./pipe-named-server server
+	./pipe-named-server client
+	./pipe-named-server bench 8 100000
+
+pipe-named.c's server accepts one client and uses blocking read/write with a stream socket.
+Here the server serves many clients from one epoll loop:
+ SOCK_SEQPACKET keeps message boundaries, so there's no need for our own framing;
+ the socket name is in the abstract namespace ("@name": the first byte of the path is '\0'),
+ so no file is created and nothing needs to be unlinked;
+ all requests available on a connection are read with one recvmmsg() call,
+ and all the replies are sent with one sendmmsg() call.
+The replies that don't fit into the socket buffer wait in the client's queue for EPOLLOUT;
+ meanwhile the server stops reading the client's requests, so a client that doesn't read its replies
+ can't make the queue grow without limit.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MSG_MAX  4096
+#define BATCH  64
+
+/** Prepare UNIX socket address.
+name: file name or "@name" for the abstract namespace
+Return address length;
+  0 on error */
+static socklen_t unix_addr(struct sockaddr_un *a, const char *name)
+{
+	memset(a, 0, sizeof(*a));
+	a->sun_family = AF_UNIX;
+	size_t len = strlen(name);
+	if (len + 1 > sizeof(a->sun_path)) {
+		errno = EINVAL;
+		return 0;
+	}
+	memcpy(a->sun_path, name, len + 1);
+	if (name[0] != '@')
+		return sizeof(struct sockaddr_un);
+
+	// abstract name: not '\0'-terminated, the length is defined by the address length
+	a->sun_path[0] = '\0';
+	return offsetof(struct sockaddr_un, sun_path) + len;
+}
+
+/** Create a listening message socket.
+Return -1 on error */
+int msgsock_listen(const char *name)
+{
+	struct sockaddr_un a;
+	socklen_t alen = unix_addr(&a, name);
+	if (alen == 0)
+		return -1;
+
+	int sk = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sk == -1)
+		return -1;
+	if (0 != bind(sk, (struct sockaddr*)&a, alen)
+		|| 0 != listen(sk, 1024)) {
+		close(sk);
+		return -1;
+	}
+	return sk;
+}
+
+/** Connect to a message socket.
+Return -1 on error */
+int msgsock_connect(const char *name)
+{
+	struct sockaddr_un a;
+	socklen_t alen = unix_addr(&a, name);
+	if (alen == 0)
+		return -1;
+
+	int sk = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sk == -1)
+		return -1;
+	if (0 != connect(sk, (struct sockaddr*)&a, alen)) {
+		close(sk);
+		return -1;
+	}
+	return sk;
+}
+
+
+struct context {
+	void (*handler)(struct context *obj, unsigned int events);
+};
+
+struct client {
+	struct context ctx; // must be the first
+	int sk;
+	char *outq; // replies waiting for EPOLLOUT: [u16 length, data]...
+	size_t outq_len, outq_off, outq_cap;
+	unsigned int want_write;
+};
+
+struct server {
+	struct context ctx;
+	int kq, lsk;
+};
+
+static struct server srv;
+
+/** Process a request: here we just prepend "ok:" */
+static size_t handle_request(const char *req, size_t len, char *resp)
+{
+	if (len > MSG_MAX - 3)
+		len = MSG_MAX - 3;
+	memcpy(resp, "ok:", 3);
+	memcpy(resp + 3, req, len);
+	return len + 3;
+}
+
+static void client_close(struct client *c)
+{
+	close(c->sk); // the descriptor isn't shared: close() also removes it from epoll
+	free(c->outq);
+	free(c);
+}
+
+/** Wait for EPOLLOUT only (the output queue isn't empty) or for EPOLLIN only */
+static void client_watch_write(struct client *c, unsigned int on)
+{
+	if (c->want_write == on)
+		return;
+	c->want_write = on;
+	struct epoll_event event = {};
+	event.events = (on) ? EPOLLOUT : EPOLLIN;
+	event.data.ptr = c;
+	epoll_ctl(srv.kq, EPOLL_CTL_MOD, c->sk, &event);
+}
+
+static void outq_add(struct client *c, const char *data, size_t len)
+{
+	if (c->outq_cap - c->outq_len < 2 + len) {
+		c->outq_cap = (c->outq_cap + 2 + len) * 2;
+		c->outq = realloc(c->outq, c->outq_cap);
+	}
+	unsigned short n = len;
+	memcpy(c->outq + c->outq_len, &n, 2);
+	memcpy(c->outq + c->outq_len + 2, data, len);
+	c->outq_len += 2 + len;
+}
+
+/** Send the queued replies.
+Return 0 if the queue is empty;
+  1 if the socket is full;
+  -1 on error */
+static int outq_flush(struct client *c)
+{
+	while (c->outq_off != c->outq_len) {
+		struct mmsghdr mm[BATCH] = {};
+		struct iovec iov[BATCH];
+		unsigned int n = 0;
+		for (size_t off = c->outq_off;  off != c->outq_len && n != BATCH;  n++) {
+			unsigned short len;
+			memcpy(&len, c->outq + off, 2);
+			iov[n].iov_base = c->outq + off + 2;
+			iov[n].iov_len = len;
+			mm[n].msg_hdr.msg_iov = &iov[n];
+			mm[n].msg_hdr.msg_iovlen = 1;
+			off += 2 + len;
+		}
+
+		int r = sendmmsg(c->sk, mm, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (r < 0)
+			return (errno == EAGAIN) ? 1 : -1;
+		for (int i = 0;  i != r;  i++) {
+			c->outq_off += 2 + iov[i].iov_len;
+		}
+	}
+	c->outq_off = c->outq_len = 0;
+	return 0;
+}
+
+static void client_handler(struct context *obj, unsigned int events)
+{
+	struct client *c = (void*)obj;
+
+	if (events & EPOLLOUT) {
+		int r = outq_flush(c);
+		if (r < 0) {
+			client_close(c);
+			return;
+		}
+		client_watch_write(c, (r == 1));
+	}
+
+	if (c->outq_len != 0 || !(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		return; // don't read new requests until all replies are sent
+
+	static char req[BATCH][MSG_MAX], resp[BATCH][MSG_MAX];
+	for (;;) {
+		// receive all available requests at once
+		struct mmsghdr mm[BATCH] = {};
+		struct iovec iov[BATCH];
+		for (unsigned int i = 0;  i != BATCH;  i++) {
+			iov[i].iov_base = req[i];
+			iov[i].iov_len = MSG_MAX;
+			mm[i].msg_hdr.msg_iov = &iov[i];
+			mm[i].msg_hdr.msg_iovlen = 1;
+		}
+		int n = recvmmsg(c->sk, mm, BATCH, MSG_DONTWAIT, NULL);
+		if (n < 0 && errno == EAGAIN)
+			return;
+		if (n <= 0) {
+			client_close(c); // disconnected (an empty message is also treated as EOF)
+			return;
+		}
+		for (int i = 0;  i != n;  i++) {
+			if (mm[i].msg_len == 0) {
+				client_close(c);
+				return;
+			}
+		}
+
+		// process the requests and send all replies at once
+		struct mmsghdr out[BATCH] = {};
+		struct iovec oiov[BATCH];
+		for (int i = 0;  i != n;  i++) {
+			oiov[i].iov_base = resp[i];
+			oiov[i].iov_len = handle_request(req[i], mm[i].msg_len, resp[i]);
+			out[i].msg_hdr.msg_iov = &oiov[i];
+			out[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		// the output queue is empty here
+		int sent = sendmmsg(c->sk, out, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0 && errno != EAGAIN) {
+			client_close(c);
+			return;
+		}
+		if (sent < 0)
+			sent = 0;
+		if (sent != n) {
+			// the socket is full: queue the rest (at most BATCH replies) and stop reading
+			for (int i = sent;  i != n;  i++) {
+				outq_add(c, resp[i], oiov[i].iov_len);
+			}
+			client_watch_write(c, 1);
+			return;
+		}
+
+		if (n != BATCH)
+			return;
+	}
+}
+
+static void accept_handler(struct context *obj, unsigned int events)
+{
+	for (;;) {
+		int sk = accept4(srv.lsk, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sk == -1)
+			return;
+
+		struct client *c = calloc(1, sizeof(struct client));
+		c->ctx.handler = client_handler;
+		c->sk = sk;
+		struct epoll_event event = {};
+		event.events = EPOLLIN;
+		event.data.ptr = c;
+		assert(0 == epoll_ctl(srv.kq, EPOLL_CTL_ADD, sk, &event));
+	}
+}
+
+void server(const char *name)
+{
+	srv.lsk = msgsock_listen(name);
+	assert(srv.lsk != -1);
+	srv.kq = epoll_create1(EPOLL_CLOEXEC);
+	assert(srv.kq != -1);
+	srv.ctx.handler = accept_handler;
+
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.ptr = &srv.ctx;
+	assert(0 == epoll_ctl(srv.kq, EPOLL_CTL_ADD, srv.lsk, &event));
+
+	for (;;) {
+		struct epoll_event events[64];
+		int n = epoll_wait(srv.kq, events, 64, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		assert(n > 0);
+
+		for (int i = 0;  i != n;  i++) {
+			struct context *o = events[i].data.ptr;
+			o->handler(o, events[i].events);
+		}
+	}
+}
+
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Client: send 'n' requests, keeping up to 'window' of them in flight */
+static void bench_client(const char *name, unsigned int n, unsigned int window)
+{
+	int sk = msgsock_connect(name);
+	assert(sk != -1);
+
+	char buf[MSG_MAX];
+	unsigned int sent = 0, received = 0;
+	while (received != n) {
+		while (sent != n && sent - received < window) {
+			int len = snprintf(buf, sizeof(buf), "request #%u", sent);
+			assert(len == send(sk, buf, len, 0));
+			sent++;
+		}
+		ssize_t r = recv(sk, buf, sizeof(buf), 0);
+		assert(r > 3 && !memcmp(buf, "ok:", 3));
+		received++;
+	}
+	close(sk);
+}
+
+void main(int argc, char **argv)
+{
+	const char *name = "@cpspg.pipe";
+
+	if (argc > 1 && !strcmp(argv[1], "server")) {
+		server(name);
+		return;
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		unsigned int clients = (argc > 2) ? atoi(argv[2]) : 8;
+		unsigned int total = (argc > 3) ? atoi(argv[3]) : 100000;
+
+		pid_t srv_pid = fork();
+		assert(srv_pid >= 0);
+		if (srv_pid == 0) {
+			server(name);
+			_exit(0);
+		}
+		usleep(100*1000);
+
+		double t = time_sec();
+		for (unsigned int i = 0;  i != clients;  i++) {
+			if (0 == fork()) {
+				bench_client(name, total / clients, 32);
+				_exit(0);
+			}
+		}
+		for (unsigned int i = 0;  i != clients;  i++) {
+			wait(NULL);
+		}
+		t = time_sec() - t;
+		printf("clients:%u  messages:%u  %.3fs  %.0f messages/s\n"
+			, clients, total / clients * clients, t, total / clients * clients / t);
+
+		kill(srv_pid, SIGTERM);
+		waitpid(srv_pid, NULL, 0);
+		return;
+	}
+
+	// client: send a message and print the reply
+	int sk = msgsock_connect(name);
+	assert(sk != -1);
+	assert(6 == send(sk, "hello!", 6, 0));
+	char buf[MSG_MAX];
+	ssize_t r = recv(sk, buf, sizeof(buf), 0);
+	assert(r > 0);
+	printf("%.*s\n", (int)r, buf);
+	close(sk);
+}
@@ -0,0 +1,420 @@
+/* Cross-Platform System Programming Guide: Linux: zero-copy pipe I/O with splice(), vmsplice() and tee()
+Usage:
+	./pipe-splice cat <file.txt | cat
+	./pipe-splice tee OUT1 OUT2 <file.txt | cat
+	./pipe-splice bench [MB]
+
+pipe.c and std-echo.c copy the data twice: from the kernel into the user buffer with read(),
+ then back into the kernel with write().
+splice() moves the data between a pipe and another descriptor inside the kernel:
+ the pipe holds references to page cache pages, nothing is copied through user space.
+If neither side is a pipe, we splice through an intermediate pipe: file -> pipe -> socket.
+vmsplice() with SPLICE_F_GIFT gives our own memory pages to the pipe:
+ the buffer must be page-aligned, and we must never touch it again, so each chunk is a fresh mapping.
+tee() duplicates the pipe contents into another pipe without consuming them: fan-out to several consumers.
+If stdin isn't a pipe (e.g. a file), tee mode first splices it into an intermediate pipe.
+An output that doesn't support splicing (a terminal, a file opened with O_APPEND) is written with write().
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PIPE_SIZE  (1024*1024)
+#define SPLICE_CHUNK  (1024*1024)
+
+static int is_pipe(int fd)
+{
+	struct stat st;
+	return (0 == fstat(fd, &st) && S_ISFIFO(st.st_mode));
+}
+
+/** Copy with read() and write(): the fallback for descriptors that don't support splicing */
+static long long rw_copy(int in, int out, size_t buf_size)
+{
+	char *buf = malloc(buf_size);
+	long long total = 0;
+	for (;;) {
+		ssize_t r = read(in, buf, buf_size);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			if (r < 0)
+				total = -1;
+			break;
+		}
+		for (ssize_t off = 0;  off != r;) {
+			ssize_t w = write(out, buf + off, r - off);
+			if (w < 0) {
+				free(buf);
+				return -1;
+			}
+			off += w;
+		}
+		total += r;
+	}
+	free(buf);
+	return total;
+}
+
+/** Copy exactly 'n' bytes with read() and write().
+Return 0 on success */
+static int rw_copy_n(int in, int out, size_t n)
+{
+	char buf[64*1024];
+	while (n != 0) {
+		ssize_t r = read(in, buf, (n < sizeof(buf)) ? n : sizeof(buf));
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		for (ssize_t off = 0;  off != r;) {
+			ssize_t w = write(out, buf + off, r - off);
+			if (w < 0 && errno == EINTR)
+				continue;
+			if (w < 0)
+				return -1;
+			off += w;
+		}
+		n -= r;
+	}
+	return 0;
+}
+
+/** Move all data from 'in' to 'out' until EOF without copying it through user space.
+One of the descriptors should be a pipe; otherwise an intermediate pipe is used.
+Return N of bytes transferred;
+  <0 on error */
+long long splice_all(int in, int out)
+{
+	int mid[2] = { -1, -1 };
+	if (!is_pipe(in) && !is_pipe(out)) {
+		if (0 != pipe2(mid, O_CLOEXEC))
+			return -1;
+		fcntl(mid[1], F_SETPIPE_SZ, PIPE_SIZE);
+	}
+
+	long long total = 0;
+	for (;;) {
+		ssize_t r;
+		size_t pending = 0; // the data already moved from 'in' into the intermediate pipe
+		if (mid[0] == -1) {
+			r = splice(in, NULL, out, NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+		} else {
+			r = splice(in, NULL, mid[1], NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+			for (ssize_t n = r;  n > 0;) {
+				ssize_t w = splice(mid[0], NULL, out, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+				if (w < 0 && errno == EINTR)
+					continue;
+				if (w <= 0) {
+					pending = n;
+					r = -1;
+					break;
+				}
+				n -= w;
+			}
+		}
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno == EINVAL && total == 0) {
+			// this file type doesn't support splicing, e.g. a terminal or a file opened with O_APPEND:
+			//  don't lose the data that is already in the intermediate pipe
+			if (pending != 0 && 0 != rw_copy_n(mid[0], out, pending)) {
+				total = -1;
+				break;
+			}
+			total = rw_copy(in, out, 64*1024);
+			if (total >= 0)
+				total += pending;
+			break;
+		}
+		if (r <= 0) {
+			if (r < 0)
+				total = -1;
+			break;
+		}
+		total += r;
+	}
+
+	if (mid[0] != -1) {
+		close(mid[0]);
+		close(mid[1]);
+	}
+	return total;
+}
+
+/** Write user data into the pipe by giving the memory pages to the kernel.
+The buffer must be obtained from gift_alloc() and mustn't be used after the call:
+ it's unmapped, and the pages are freed when the consumer has read them.
+Return 0 on success */
+int pipe_vmsplice_gift(int pipe_wr, void *buf, size_t len)
+{
+	struct iovec iov = { buf, len };
+	while (iov.iov_len != 0) {
+		ssize_t r = vmsplice(pipe_wr, &iov, 1, SPLICE_F_GIFT);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			munmap(buf, len);
+			return -1;
+		}
+		iov.iov_base = (char*)iov.iov_base + r;
+		iov.iov_len -= r;
+	}
+	munmap(buf, len);
+	return 0;
+}
+
+/** Allocate page-aligned memory for pipe_vmsplice_gift() */
+void* gift_alloc(size_t len)
+{
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return (p != MAP_FAILED) ? p : NULL;
+}
+
+/** Move exactly 'n' bytes from the pipe;
+ copy them with read() and write() if 'out' doesn't support splicing.
+Return 0 on success */
+static int splice_n(int in_pipe, int out, size_t n)
+{
+	while (n != 0) {
+		ssize_t r = splice(in_pipe, NULL, out, NULL, n, SPLICE_F_MOVE);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno == EINVAL)
+			return rw_copy_n(in_pipe, out, n);
+		if (r <= 0)
+			return -1;
+		n -= r;
+	}
+	return 0;
+}
+
+/** Copy all data from the input to 'out' and to each of the 'n' additional outputs until EOF.
+tee() only works between 2 pipes, so each additional output gets an intermediate pipe,
+ at least as large as the input pipe, so that tee() always takes the same data for each output.
+If the input isn't a pipe, each chunk is first spliced into another intermediate pipe.
+Return N of bytes transferred;
+  <0 on error */
+long long tee_all(int in, int out, const int *outs, unsigned int n)
+{
+	if (n == 0)
+		return splice_all(in, out);
+
+	int src[2] = { -1, -1 };
+	int in_pipe = in;
+	if (!is_pipe(in)) {
+		if (0 != pipe2(src, O_CLOEXEC))
+			return -1;
+		fcntl(src[1], F_SETPIPE_SZ, PIPE_SIZE);
+		in_pipe = src[0];
+	}
+
+	int in_size = fcntl(in_pipe, F_GETPIPE_SZ);
+	int (*mid)[2] = calloc(n, sizeof(int[2]));
+	long long total = -1;
+	unsigned int i;
+	for (i = 0;  i != n;  i++) {
+		if (0 != pipe2(mid[i], O_CLOEXEC))
+			goto end;
+		if (fcntl(mid[i][1], F_SETPIPE_SZ, in_size) < in_size) {
+			close(mid[i][0]);
+			close(mid[i][1]);
+			goto end;
+		}
+	}
+
+	total = 0;
+	for (;;) {
+		if (src[0] != -1) {
+			// the intermediate pipe is empty here: fill it with the next chunk
+			ssize_t r = splice(in, NULL, src[1], NULL, in_size, SPLICE_F_MOVE);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0)
+				total = -1;
+			if (r <= 0)
+				goto end;
+		}
+
+		// duplicate the input data: tee() blocks until there's data or returns 0 on EOF
+		size_t len = SPLICE_CHUNK;
+		for (unsigned int k = 0;  k != n;  k++) {
+			ssize_t r = tee(in_pipe, mid[k][1], len, 0);
+			if (r < 0 && errno == EINTR) {
+				k--;
+				continue;
+			}
+			if (r < 0 || (k != 0 && (size_t)r != len)) {
+				total = -1;
+				goto end;
+			}
+			len = r;
+			if (len == 0)
+				goto end; // EOF
+		}
+
+		for (unsigned int k = 0;  k != n;  k++) {
+			if (0 != splice_n(mid[k][0], outs[k], len)) {
+				total = -1;
+				goto end;
+			}
+		}
+		// now consume the data from the input pipe
+		if (0 != splice_n(in_pipe, out, len)) {
+			total = -1;
+			goto end;
+		}
+		total += len;
+	}
+
+end:
+	while (i != 0) {
+		i--;
+		close(mid[i][0]);
+		close(mid[i][1]);
+	}
+	free(mid);
+	if (src[0] != -1) {
+		close(src[0]);
+		close(src[1]);
+	}
+	return total;
+}
+
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Start a child process that reads the pipe to the end and throws the data away */
+static pid_t consumer_start(int p[2])
+{
+	assert(0 == pipe2(p, O_CLOEXEC));
+	fcntl(p[1], F_SETPIPE_SZ, PIPE_SIZE);
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		close(p[1]);
+		int null = open("/dev/null", O_WRONLY);
+		splice_all(p[0], null);
+		_exit(0);
+	}
+	close(p[0]);
+	return pid;
+}
+
+static void bench_result(const char *name, double t, size_t size)
+{
+	printf("%-22s %.3fs  %.2f GB/s\n", name, t, size / t / (1024*1024*1024));
+}
+
+/** Transfer a file through a pipe to the consumer process in different ways */
+void bench(unsigned int mb)
+{
+	size_t size = (size_t)mb * 1024*1024;
+	const char *fn = "pipe-splice.tmp";
+	int f = open(fn, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0666);
+	assert(f >= 0);
+	char *buf = malloc(SPLICE_CHUNK);
+	memset(buf, 'x', SPLICE_CHUNK);
+	for (size_t off = 0;  off < size;  off += SPLICE_CHUNK) {
+		assert(SPLICE_CHUNK == write(f, buf, SPLICE_CHUNK));
+	}
+
+	static const struct {
+		const char *name;
+		size_t buf_size;
+	} rw[] = {
+		{ "read/write 1000B:", 1000 }, // std-echo.c
+		{ "read/write 64KB:", 64*1024 },
+	};
+	for (unsigned int i = 0;  i != 2;  i++) {
+		int p[2];
+		lseek(f, 0, SEEK_SET);
+		double t = time_sec();
+		pid_t pid = consumer_start(p);
+		assert((long long)size == rw_copy(f, p[1], rw[i].buf_size));
+		close(p[1]);
+		waitpid(pid, NULL, 0);
+		bench_result(rw[i].name, time_sec() - t, size);
+	}
+
+	int p[2];
+	lseek(f, 0, SEEK_SET);
+	double t = time_sec();
+	pid_t pid = consumer_start(p);
+	assert((long long)size == splice_all(f, p[1]));
+	close(p[1]);
+	waitpid(pid, NULL, 0);
+	bench_result("splice:", time_sec() - t, size);
+
+	// generate data in memory
+	t = time_sec();
+	pid = consumer_start(p);
+	for (size_t off = 0;  off < size;  off += SPLICE_CHUNK) {
+		memset(buf, 'y', SPLICE_CHUNK);
+		for (size_t w = 0;  w != SPLICE_CHUNK;) {
+			ssize_t r = write(p[1], buf + w, SPLICE_CHUNK - w);
+			assert(r > 0);
+			w += r;
+		}
+	}
+	close(p[1]);
+	waitpid(pid, NULL, 0);
+	bench_result("memory + write:", time_sec() - t, size);
+
+	t = time_sec();
+	pid = consumer_start(p);
+	for (size_t off = 0;  off < size;  off += SPLICE_CHUNK) {
+		char *g = gift_alloc(SPLICE_CHUNK);
+		assert(g != NULL);
+		memset(g, 'y', SPLICE_CHUNK);
+		assert(0 == pipe_vmsplice_gift(p[1], g, SPLICE_CHUNK));
+	}
+	close(p[1]);
+	waitpid(pid, NULL, 0);
+	bench_result("memory + vmsplice:", time_sec() - t, size);
+
+	free(buf);
+	close(f);
+	unlink(fn);
+}
+
+void main(int argc, char **argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "cat")) {
+		// std-echo without copying through user space
+		assert(0 <= splice_all(STDIN_FILENO, STDOUT_FILENO));
+
+	} else if (argc > 1 && !strcmp(argv[1], "tee")) {
+		unsigned int n = argc - 2;
+		int *outs = calloc(n, sizeof(int));
+		for (unsigned int i = 0;  i != n;  i++) {
+			outs[i] = open(argv[2 + i], O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0666);
+			assert(outs[i] >= 0);
+		}
+		assert(0 <= tee_all(STDIN_FILENO, STDOUT_FILENO, outs, n));
+		for (unsigned int i = 0;  i != n;  i++) {
+			close(outs[i]);
+		}
+		free(outs);
+
+	} else if (argc > 1 && !strcmp(argv[1], "bench")) {
+		bench((argc > 2) ? atoi(argv[2]) : 1024);
+	}
+}
@@ -0,0 +1,383 @@
+/* Cross-Platform System Programming Guide: Linux: capture stdout/stderr of many child processes in one epoll loop
+Usage:
+	./ps-capture
+	./ps-capture bench 100 1000000
+
+ps-exec-out.c reads the output of one child with a blocking read(), and stdout and stderr share one pipe.
+Here each child gets 2 pipes: for stdout and for stderr.
+The read ends are non-blocking and are registered in a single epoll object,
+ so the output of all children is drained as soon as it arrives:
+ a child never blocks on a full pipe while we're waiting for another child.
+The pipes are enlarged with F_SETPIPE_SZ so a chatty child makes fewer context switches.
+The data is appended to per-child growable buffers or written to files.
+The child's exit is reported via its pidfd; the child is complete when both pipes are closed and it has exited.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+#define CAP_PIPE_SIZE  (1024*1024)
+
+struct context {
+	void (*handler)(struct context *obj);
+};
+
+struct cap;
+struct cap_child;
+
+struct cap_stream {
+	struct context ctx; // must be the first
+	struct cap_child *c;
+	int fd; // pipe read end; -1 after EOF
+	int file; // output file or -1
+	char *buf; // output data (if 'file' is not used)
+	size_t len, cap;
+};
+
+/** Called when the child has exited and all its output is read */
+typedef void (*cap_done_cb)(struct cap_child *c);
+
+struct cap_child {
+	struct context ctx; // pidfd handler; must be the first
+	struct cap *cp;
+	pid_t pid;
+	int pidfd;
+	int exit_code; // exit code; -signal number if the child was killed
+	unsigned int pending; // N of pipes + pidfd not yet closed
+	struct cap_stream out, err;
+	cap_done_cb on_done;
+	void *udata;
+};
+
+typedef struct cap {
+	int kq;
+	unsigned int active;
+	char *tmp; // read buffer for the file mode
+} cap;
+
+static void _cap_release(struct cap_child *c)
+{
+	if (--c->pending != 0)
+		return;
+	c->cp->active--;
+	c->on_done(c);
+}
+
+/** Read all available data from the pipe */
+static void _cap_stream_handler(struct context *obj)
+{
+	struct cap_stream *s = (void*)obj;
+	for (;;) {
+		ssize_t r;
+		if (s->file != -1) {
+			r = read(s->fd, s->c->cp->tmp, CAP_PIPE_SIZE);
+			if (r > 0 && r != write(s->file, s->c->cp->tmp, r))
+				r = -1;
+		} else {
+			if (s->cap - s->len < 64*1024) {
+				s->cap = (s->cap != 0) ? s->cap * 2 : 128*1024;
+				s->buf = realloc(s->buf, s->cap);
+				assert(s->buf != NULL);
+			}
+			r = read(s->fd, s->buf + s->len, s->cap - s->len);
+			if (r > 0)
+				s->len += r;
+		}
+
+		if (r > 0)
+			continue;
+		if (r < 0 && errno == EAGAIN)
+			return;
+		if (r < 0 && errno == EINTR)
+			continue;
+		break; // EOF or error
+	}
+
+	// a child being started may still hold a copy of the descriptor, so close() alone may leave it in epoll
+	epoll_ctl(s->c->cp->kq, EPOLL_CTL_DEL, s->fd, NULL);
+	close(s->fd);
+	s->fd = -1;
+	if (s->file != -1) {
+		close(s->file);
+		s->file = -1;
+	}
+	_cap_release(s->c);
+}
+
+/** pidfd is readable: the child has exited */
+static void _cap_exit_handler(struct context *obj)
+{
+	struct cap_child *c = (void*)obj;
+	siginfo_t si = {};
+	if (0 != waitid(P_PIDFD, c->pidfd, &si, WEXITED | WNOHANG) || si.si_pid == 0)
+		return;
+	c->exit_code = (si.si_code == CLD_EXITED) ? si.si_status : -si.si_status;
+	epoll_ctl(c->cp->kq, EPOLL_CTL_DEL, c->pidfd, NULL);
+	close(c->pidfd);
+	c->pidfd = -1;
+	_cap_release(c);
+}
+
+int cap_init(cap *cp)
+{
+	cp->active = 0;
+	cp->kq = epoll_create1(EPOLL_CLOEXEC);
+	cp->tmp = malloc(CAP_PIPE_SIZE);
+	return (cp->kq != -1 && cp->tmp != NULL) ? 0 : -1;
+}
+
+void cap_destroy(cap *cp)
+{
+	close(cp->kq);
+	free(cp->tmp);
+}
+
+static int _cap_register(cap *cp, int fd, struct context *ctx)
+{
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.ptr = ctx;
+	return epoll_ctl(cp->kq, EPOLL_CTL_ADD, fd, &event);
+}
+
+/** Start a child process and capture its stdout and stderr.
+file_prefix: write the output to files "PREFIX.PID.out" and "PREFIX.PID.err";
+  NULL: store in memory buffers
+Return child object; free it with cap_child_free() after on_done() is called
+  NULL on error */
+struct cap_child* cap_start(cap *cp, const char *filename, const char **argv, const char *file_prefix, cap_done_cb on_done, void *udata)
+{
+	int p_out[2], p_err[2];
+	if (0 != pipe2(p_out, O_CLOEXEC))
+		return NULL;
+	if (0 != pipe2(p_err, O_CLOEXEC)) {
+		close(p_out[0]);
+		close(p_out[1]);
+		return NULL;
+	}
+	fcntl(p_out[1], F_SETPIPE_SZ, CAP_PIPE_SIZE); // may fail if the limit is lower: not fatal
+	fcntl(p_err[1], F_SETPIPE_SZ, CAP_PIPE_SIZE);
+
+	posix_spawn_file_actions_t fa;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, p_out[1], 1);
+	posix_spawn_file_actions_adddup2(&fa, p_err[1], 2);
+
+	struct cap_child *c = calloc(1, sizeof(struct cap_child));
+	int r = posix_spawn(&c->pid, filename, &fa, NULL, (char**)argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	close(p_out[1]);
+	close(p_err[1]);
+	if (r != 0) {
+		close(p_out[0]);
+		close(p_err[0]);
+		free(c);
+		errno = r;
+		return NULL;
+	}
+
+	c->cp = cp;
+	c->on_done = on_done;
+	c->udata = udata;
+	c->ctx.handler = _cap_exit_handler;
+	c->pidfd = syscall(SYS_pidfd_open, c->pid, 0);
+	assert(c->pidfd != -1);
+
+	struct cap_stream *ss[2] = { &c->out, &c->err };
+	int fds[2] = { p_out[0], p_err[0] };
+	for (int i = 0;  i != 2;  i++) {
+		struct cap_stream *s = ss[i];
+		s->ctx.handler = _cap_stream_handler;
+		s->c = c;
+		s->fd = fds[i];
+		s->file = -1;
+		fcntl(s->fd, F_SETFL, O_NONBLOCK);
+		if (file_prefix != NULL) {
+			char name[4096];
+			snprintf(name, sizeof(name), "%s.%d.%s", file_prefix, (int)c->pid, (i == 0) ? "out" : "err");
+			s->file = open(name, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0666);
+			assert(s->file != -1);
+		}
+		assert(0 == _cap_register(cp, s->fd, &s->ctx));
+	}
+	assert(0 == _cap_register(cp, c->pidfd, &c->ctx));
+	c->pending = 3;
+	cp->active++;
+	return c;
+}
+
+void cap_child_free(struct cap_child *c)
+{
+	free(c->out.buf);
+	free(c->err.buf);
+	free(c);
+}
+
+/** Process events until all children are complete */
+void cap_run(cap *cp)
+{
+	while (cp->active != 0) {
+		struct epoll_event events[64];
+		int n = epoll_wait(cp->kq, events, 64, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		assert(n > 0);
+
+		for (int i = 0;  i != n;  i++) {
+			struct context *o = events[i].data.ptr;
+			o->handler(o);
+		}
+	}
+}
+
+
+static void print_done(struct cap_child *c)
+{
+	printf("PID %d exited with %d\n  stdout: %.*s  stderr: %.*s"
+		, (int)c->pid, c->exit_code
+		, (int)c->out.len, c->out.buf
+		, (int)c->err.len, c->err.buf);
+	cap_child_free(c);
+}
+
+static unsigned long long total_bytes;
+
+static void count_done(struct cap_child *c)
+{
+	assert(c->exit_code == 0);
+	total_bytes += c->out.len + c->err.len;
+	cap_child_free(c);
+}
+
+
+/** The old way: a thread per pipe with blocking reads */
+static void* thread_reader(void *param)
+{
+	int fd = (long)param;
+	size_t len = 0, cap = 0;
+	char *buf = NULL;
+	for (;;) {
+		if (cap - len < 64*1024) {
+			cap = (cap != 0) ? cap * 2 : 128*1024;
+			buf = realloc(buf, cap);
+		}
+		ssize_t r = read(fd, buf + len, cap - len);
+		if (r <= 0)
+			break;
+		len += r;
+	}
+	close(fd);
+	free(buf);
+	return (void*)len;
+}
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Run 'n' children, each writes 'size' bytes to stdout and to stderr */
+void bench(unsigned int n, unsigned int size)
+{
+	char script[256];
+	snprintf(script, sizeof(script), "head -c %u /dev/zero; head -c %u /dev/zero >&2", size, size);
+	const char *args[] = { "sh", "-c", script, NULL };
+
+	cap cp;
+	assert(0 == cap_init(&cp));
+	double t = time_sec();
+	for (unsigned int i = 0;  i != n;  i++) {
+		assert(NULL != cap_start(&cp, "/bin/sh", args, NULL, count_done, NULL));
+	}
+	cap_run(&cp);
+	t = time_sec() - t;
+	printf("epoll:             %.3fs  %lluMB\n", t, total_bytes / (1024*1024));
+	cap_destroy(&cp);
+
+	t = time_sec();
+	total_bytes = 0;
+	pid_t *pids = calloc(n, sizeof(pid_t));
+	pthread_t *th = calloc(n * 2, sizeof(pthread_t));
+	for (unsigned int i = 0;  i != n;  i++) {
+		int p_out[2], p_err[2];
+		assert(0 == pipe2(p_out, O_CLOEXEC));
+		assert(0 == pipe2(p_err, O_CLOEXEC));
+		posix_spawn_file_actions_t fa;
+		posix_spawn_file_actions_init(&fa);
+		posix_spawn_file_actions_adddup2(&fa, p_out[1], 1);
+		posix_spawn_file_actions_adddup2(&fa, p_err[1], 2);
+		assert(0 == posix_spawn(&pids[i], "/bin/sh", &fa, NULL, (char**)args, environ));
+		posix_spawn_file_actions_destroy(&fa);
+		close(p_out[1]);
+		close(p_err[1]);
+		pthread_create(&th[i*2], NULL, thread_reader, (void*)(long)p_out[0]);
+		pthread_create(&th[i*2+1], NULL, thread_reader, (void*)(long)p_err[0]);
+	}
+	for (unsigned int i = 0;  i != n * 2;  i++) {
+		void *len;
+		pthread_join(th[i], &len);
+		total_bytes += (size_t)len;
+	}
+	for (unsigned int i = 0;  i != n;  i++) {
+		waitpid(pids[i], NULL, 0);
+	}
+	t = time_sec() - t;
+	printf("thread per pipe:   %.3fs  %lluMB\n", t, total_bytes / (1024*1024));
+	free(th);
+	free(pids);
+}
+
+void main(int argc, char **argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		unsigned int n = (argc > 2) ? atoi(argv[2]) : 100;
+		unsigned int size = (argc > 3) ? atoi(argv[3]) : 1000000;
+		bench(n, size);
+		return;
+	}
+
+	cap cp;
+	assert(0 == cap_init(&cp));
+
+	const char *a1[] = { "sh", "-c", "echo out1; echo err1 >&2; exit 1", NULL };
+	const char *a2[] = { "sh", "-c", "echo err2 >&2; sleep .1; echo out2", NULL };
+	assert(NULL != cap_start(&cp, "/bin/sh", a1, NULL, print_done, NULL));
+	assert(NULL != cap_start(&cp, "/bin/sh", a2, NULL, print_done, NULL));
+
+	// large output that doesn't fit into the pipe buffer
+	const char *a3[] = { "sh", "-c", "head -c 5000000 /dev/zero; head -c 1000 /dev/zero >&2", NULL };
+	struct cap_child *c = cap_start(&cp, "/bin/sh", a3, "ps-capture", count_done, NULL);
+	assert(c != NULL);
+	pid_t pid = c->pid;
+
+	cap_run(&cp);
+	cap_destroy(&cp);
+
+	char name[64];
+	snprintf(name, sizeof(name), "ps-capture.%d.out", (int)pid);
+	FILE *f = fopen(name, "r");
+	assert(f != NULL);
+	fseek(f, 0, SEEK_END);
+	assert(ftell(f) == 5000000);
+	fclose(f);
+	unlink(name);
+	snprintf(name, sizeof(name), "ps-capture.%d.err", (int)pid);
+	unlink(name);
+}
@@ -0,0 +1,360 @@
+/* Cross-Platform System Programming Guide: Linux: parallel job runner ("xargs -P")
+Usage:
+	./ps-jobs [-P JOBS] [-t TIMEOUT_MS] [-m MEM_MB] [-c CPU_SEC] <commands.txt
+	./ps-jobs bench 5000 4
+
+Each line of stdin is a command with arguments separated by spaces (no quoting).
+Up to JOBS commands are run concurrently.
+A child is created with vfork(), becomes the leader of a new process group, sets its resource limits with setrlimit(),
+ reads stdin from /dev/null (so it can't consume our list of commands), redirects stdout and stderr into a pipe
+ and executes the command.
+On timeout SIGKILL is sent to the whole process group, so the processes started by the job are killed too
+ and don't keep the output pipe open.
+The pipes (non-blocking) and the children's pidfds are registered in one epoll loop.
+When the child exits, wait4() returns its exit status together with the CPU time it used.
+The output of a job is printed as a whole after it's complete, so the outputs of different jobs are never mixed.
+All jobs have the same timeout, so the running jobs are kept in the start order
+ and the first one always has the nearest deadline.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOB_ARGS_MAX  64
+
+struct context {
+	void (*handler)(struct context *obj);
+};
+
+struct runner;
+
+struct job {
+	struct context ctx_out; // output pipe handler
+	struct context ctx_exit; // pidfd handler
+	struct runner *r;
+	struct job *prev, *next; // running jobs in the start order
+	unsigned long long id;
+	char *cmd;
+	pid_t pid;
+	int pidfd, out;
+	unsigned int pending; // pipe + pidfd
+	unsigned int timed_out;
+	double start;
+	int status;
+	struct rusage ru;
+	char *buf; // output
+	size_t len, cap;
+};
+
+typedef struct runner {
+	int kq;
+	unsigned int max_jobs, running;
+	unsigned int timeout_ms; // 0: no timeout
+	unsigned int mem_mb, cpu_sec; // resource limits; 0: no limit
+	struct job *first, *last;
+	unsigned long long started, failed;
+	int quiet;
+} runner;
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int _epoll_add(runner *r, int fd, struct context *ctx)
+{
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.ptr = ctx;
+	return epoll_ctl(r->kq, EPOLL_CTL_ADD, fd, &event);
+}
+
+/** Unregister and close the descriptor.
+close() alone isn't enough: a child that is being started may still hold a copy of the descriptor
+ (close-on-exec descriptors are closed after vfork() parent is resumed),
+ and epoll keeps reporting events while the file is open. */
+static void _epoll_close(runner *r, int fd)
+{
+	epoll_ctl(r->kq, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+}
+
+/** The job is complete: print the report and the output */
+static void _job_done(struct job *j)
+{
+	runner *r = j->r;
+	if (j->prev != NULL)
+		j->prev->next = j->next;
+	else
+		r->first = j->next;
+	if (j->next != NULL)
+		j->next->prev = j->prev;
+	else
+		r->last = j->prev;
+	r->running--;
+
+	int code = (WIFEXITED(j->status)) ? WEXITSTATUS(j->status) : -WTERMSIG(j->status);
+	if (code != 0)
+		r->failed++;
+
+	if (!r->quiet || code != 0) {
+		printf("[%llu] %s: exit:%d%s  wall:%.3fs  user:%.3fs  sys:%.3fs  maxrss:%ldKB\n"
+			, j->id, j->cmd, code, (j->timed_out) ? " (timed out)" : ""
+			, time_sec() - j->start
+			, j->ru.ru_utime.tv_sec + j->ru.ru_utime.tv_usec / 1e6
+			, j->ru.ru_stime.tv_sec + j->ru.ru_stime.tv_usec / 1e6
+			, j->ru.ru_maxrss);
+		fwrite(j->buf, 1, j->len, stdout);
+	}
+
+	free(j->buf);
+	free(j->cmd);
+	free(j);
+}
+
+static void _job_out_handler(struct context *obj)
+{
+	struct job *j = (void*)((char*)obj - offsetof(struct job, ctx_out));
+	for (;;) {
+		if (j->cap - j->len < 4096) {
+			j->cap = (j->cap != 0) ? j->cap * 2 : 16*1024;
+			j->buf = realloc(j->buf, j->cap);
+			assert(j->buf != NULL);
+		}
+		ssize_t n = read(j->out, j->buf + j->len, j->cap - j->len);
+		if (n > 0) {
+			j->len += n;
+			continue;
+		}
+		if (n < 0 && errno == EAGAIN)
+			return;
+		if (n < 0 && errno == EINTR)
+			continue;
+		break;
+	}
+
+	_epoll_close(j->r, j->out);
+	if (--j->pending == 0)
+		_job_done(j);
+}
+
+static void _job_exit_handler(struct context *obj)
+{
+	struct job *j = (void*)((char*)obj - offsetof(struct job, ctx_exit));
+	if (j->pid != wait4(j->pid, &j->status, WNOHANG, &j->ru))
+		return;
+
+	_epoll_close(j->r, j->pidfd);
+	if (--j->pending == 0)
+		_job_done(j);
+}
+
+
+/** Start a job.
+cmd: command line, words separated by spaces
+Return 0 on success */
+int job_start(runner *r, const char *cmd)
+{
+	char *line = strdup(cmd);
+	char *args[JOB_ARGS_MAX + 1];
+	unsigned int n = 0;
+	for (char *tok = strtok(line, " \t");  tok != NULL && n != JOB_ARGS_MAX;  tok = strtok(NULL, " \t")) {
+		args[n++] = tok;
+	}
+	args[n] = NULL;
+	if (n == 0) {
+		free(line);
+		return -1;
+	}
+
+	int pp[2];
+	if (0 != pipe2(pp, O_CLOEXEC)) {
+		free(line);
+		return -1;
+	}
+
+	struct rlimit rl_mem = { (rlim_t)r->mem_mb * 1024*1024, (rlim_t)r->mem_mb * 1024*1024 };
+	struct rlimit rl_cpu = { r->cpu_sec, r->cpu_sec + 1 };
+
+	// the child runs in our memory until exec(): only system calls here
+	pid_t pid = vfork();
+	if (pid == 0) {
+		setpgid(0, 0);
+		if (r->mem_mb != 0)
+			setrlimit(RLIMIT_AS, &rl_mem);
+		if (r->cpu_sec != 0)
+			setrlimit(RLIMIT_CPU, &rl_cpu);
+		int nul = open("/dev/null", O_RDONLY);
+		if (nul >= 0) {
+			dup2(nul, 0);
+			if (nul != 0)
+				close(nul);
+		}
+		dup2(pp[1], 1);
+		dup2(pp[1], 2);
+		execvp(args[0], args);
+		_exit(127);
+	}
+	close(pp[1]);
+	free(line);
+	if (pid < 0) {
+		close(pp[0]);
+		return -1;
+	}
+
+	struct job *j = calloc(1, sizeof(struct job));
+	j->r = r;
+	j->id = ++r->started;
+	j->cmd = strdup(cmd);
+	j->pid = pid;
+	j->start = time_sec();
+	j->out = pp[0];
+	j->ctx_out.handler = _job_out_handler;
+	j->ctx_exit.handler = _job_exit_handler;
+	j->pidfd = syscall(SYS_pidfd_open, pid, 0);
+	assert(j->pidfd != -1);
+	fcntl(j->out, F_SETFL, O_NONBLOCK);
+	assert(0 == _epoll_add(r, j->out, &j->ctx_out));
+	assert(0 == _epoll_add(r, j->pidfd, &j->ctx_exit));
+	j->pending = 2;
+
+	j->prev = r->last;
+	if (r->last != NULL)
+		r->last->next = j;
+	else
+		r->first = j;
+	r->last = j;
+	r->running++;
+	return 0;
+}
+
+/** Kill the jobs whose deadline has passed.
+Return the time until the nearest deadline (msec);
+  -1: no deadline */
+static int _jobs_expire(runner *r)
+{
+	if (r->timeout_ms == 0)
+		return -1;
+
+	double now = time_sec();
+	for (struct job *j = r->first;  j != NULL;  j = j->next) {
+		double left_ms = (j->start + r->timeout_ms / 1000.0 - now) * 1000;
+		if (left_ms > 0)
+			return (int)left_ms + 1;
+		if (!j->timed_out) {
+			j->timed_out = 1;
+			// the group ID stays valid while any of its members is alive
+			kill(-j->pid, SIGKILL);
+		}
+	}
+	return -1;
+}
+
+/** Process events until at least one job is complete */
+static void _jobs_wait(runner *r)
+{
+	unsigned int running = r->running;
+	while (r->running == running) {
+		struct epoll_event events[64];
+		int n = epoll_wait(r->kq, events, 64, _jobs_expire(r));
+		if (n < 0 && errno == EINTR)
+			continue;
+		assert(n >= 0);
+
+		for (int i = 0;  i != n;  i++) {
+			struct context *o = events[i].data.ptr;
+			o->handler(o);
+		}
+	}
+}
+
+/** Execute all commands from the file */
+void jobs_run(runner *r, FILE *f)
+{
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t n;
+	while (0 < (n = getline(&line, &cap, f))) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0')
+			continue;
+
+		while (r->running == r->max_jobs) {
+			_jobs_wait(r);
+		}
+		if (0 != job_start(r, line)) {
+			printf("%s: %s\n", line, strerror(errno));
+			r->failed++;
+		}
+	}
+	free(line);
+
+	while (r->running != 0) {
+		_jobs_wait(r);
+	}
+	fflush(stdout);
+}
+
+void main(int argc, char **argv)
+{
+	runner r = {};
+	r.max_jobs = 4;
+	r.kq = epoll_create1(EPOLL_CLOEXEC);
+	assert(r.kq != -1);
+
+	if (argc > 2 && !strcmp(argv[1], "bench")) {
+		// run many short jobs
+		unsigned int n = atoi(argv[2]);
+		r.max_jobs = (argc > 3) ? atoi(argv[3]) : 4;
+		r.quiet = 1;
+		size_t size = n * sizeof("true\n");
+		char *cmds = malloc(size);
+		for (unsigned int i = 0;  i != n;  i++) {
+			memcpy(cmds + i * (sizeof("true\n") - 1), "true\n", sizeof("true\n") - 1);
+		}
+		FILE *f = fmemopen(cmds, n * (sizeof("true\n") - 1), "r");
+		double t = time_sec();
+		jobs_run(&r, f);
+		t = time_sec() - t;
+		printf("jobs:%llu  failed:%llu  parallel:%u  %.3fs  %.0f jobs/s\n"
+			, r.started, r.failed, r.max_jobs, t, r.started / t);
+		fclose(f);
+		free(cmds);
+		return;
+	}
+
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "P:t:m:c:"))) {
+		switch (opt) {
+		case 'P':
+			r.max_jobs = atoi(optarg); break;
+		case 't':
+			r.timeout_ms = atoi(optarg); break;
+		case 'm':
+			r.mem_mb = atoi(optarg); break;
+		case 'c':
+			r.cpu_sec = atoi(optarg); break;
+		default:
+			return;
+		}
+	}
+	assert(r.max_jobs != 0);
+
+	jobs_run(&r, stdin);
+	close(r.kq);
+}
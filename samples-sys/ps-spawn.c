@@ -0,0 +1,279 @@
+/* Cross-Platform System Programming Guide: Linux: fast process spawning with posix_spawn() and clone(CLONE_VM | CLONE_VFORK)
+Usage:
+	./ps-spawn
+	./ps-spawn bench [RSS_MB] [N]
+
+fork() copies the parent's page tables, so it gets slower as the parent's memory grows,
+ and then exec() throws the copy away.
+vfork() or clone(CLONE_VM | CLONE_VFORK) runs the child in the parent's memory until it calls exec(),
+ the parent is suspended until then.
+glibc's posix_spawn() works this way, and file actions describe what the child must do before exec():
+ here we redirect stdin/stdout/stderr and close all other descriptors (closefrom, via close_range() system call).
+With raw clone() we pass the child a small stack of our own, and CLONE_PIDFD returns a process descriptor (pidfd):
+ it can't be confused with another process after our child's PID is reused.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD  0x00001000
+#endif
+
+extern char **environ;
+
+static int _pidfd_open(pid_t pid)
+{
+	return syscall(SYS_pidfd_open, pid, 0);
+}
+
+typedef struct {
+	const char **argv;
+	int in, out, err; // -1: inherit from the parent
+} ps_execinfo;
+
+typedef struct {
+	pid_t pid;
+	int pidfd;
+} ps;
+
+enum PS_SPAWN {
+	PS_SPAWN_FORK,
+	PS_SPAWN_VFORK,
+	PS_SPAWN_POSIX, // posix_spawn()
+	PS_SPAWN_CLONE, // clone(CLONE_VM | CLONE_VFORK | CLONE_PIDFD)
+};
+
+/** Close all descriptors starting from 'fd' */
+static void close_from(int fd)
+{
+	if (0 != syscall(SYS_close_range, fd, ~0U, 0)) {
+		// Linux <5.9
+		int n = sysconf(_SC_OPEN_MAX);
+		for (;  fd < n;  fd++) {
+			close(fd);
+		}
+	}
+}
+
+/** Prepare the standard descriptors of the child; executed in the child before exec() */
+static void _ps_child_fds(const ps_execinfo *ei)
+{
+	if (ei->in != -1)
+		dup2(ei->in, 0);
+	if (ei->out != -1)
+		dup2(ei->out, 1);
+	if (ei->err != -1)
+		dup2(ei->err, 2);
+	close_from(3);
+}
+
+struct _ps_clone_arg {
+	const char *filename;
+	const ps_execinfo *ei;
+	sigset_t mask;
+	int err; // the child sets it if exec() fails
+};
+
+static int _ps_clone_child(void *param)
+{
+	// the child shares the memory with the suspended parent: only async-signal-safe calls here
+	struct _ps_clone_arg *a = param;
+	_ps_child_fds(a->ei);
+	sigprocmask(SIG_SETMASK, &a->mask, NULL);
+	execve(a->filename, (char**)a->ei->argv, environ);
+	a->err = errno;
+	_exit(127);
+	return 0;
+}
+
+#define PS_CLONE_STACK  (16*1024)
+
+/** Create a new process.
+method: enum PS_SPAWN
+Return 0 on success: p->pid, p->pidfd are set */
+int ps_spawn(ps *p, const char *filename, const ps_execinfo *ei, unsigned int method)
+{
+	p->pidfd = -1;
+
+	switch (method) {
+	case PS_SPAWN_FORK:
+	case PS_SPAWN_VFORK:
+		p->pid = (method == PS_SPAWN_FORK) ? fork() : vfork();
+		if (p->pid < 0)
+			return -1;
+		if (p->pid == 0) {
+			_ps_child_fds(ei);
+			execve(filename, (char**)ei->argv, environ);
+			_exit(127);
+		}
+		break;
+
+	case PS_SPAWN_POSIX: {
+		posix_spawn_file_actions_t fa;
+		posix_spawn_file_actions_init(&fa);
+		if (ei->in != -1)
+			posix_spawn_file_actions_adddup2(&fa, ei->in, 0);
+		if (ei->out != -1)
+			posix_spawn_file_actions_adddup2(&fa, ei->out, 1);
+		if (ei->err != -1)
+			posix_spawn_file_actions_adddup2(&fa, ei->err, 2);
+		posix_spawn_file_actions_addclosefrom_np(&fa, 3);
+
+		int r = posix_spawn(&p->pid, filename, &fa, NULL, (char**)ei->argv, environ);
+		posix_spawn_file_actions_destroy(&fa);
+		if (r != 0) {
+			errno = r;
+			return -1;
+		}
+		break;
+	}
+
+	case PS_SPAWN_CLONE: {
+		// The parent is suspended until the child calls exec() or exits,
+		//  so the child may use a part of the parent's stack.
+		char stack[PS_CLONE_STACK] __attribute__((aligned(16)));
+		struct _ps_clone_arg a = {
+			.filename = filename,
+			.ei = ei,
+		};
+
+		// don't let the signal handlers run in the child while it shares our memory
+		sigset_t all;
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &a.mask);
+		p->pid = clone(_ps_clone_child, stack + sizeof(stack)
+			, CLONE_VM | CLONE_VFORK | CLONE_PIDFD | SIGCHLD, &a, &p->pidfd);
+		pthread_sigmask(SIG_SETMASK, &a.mask, NULL);
+		if (p->pid < 0)
+			return -1;
+
+		if (a.err != 0) {
+			// exec() failed: reap the child
+			waitpid(p->pid, NULL, 0);
+			close(p->pidfd);
+			errno = a.err;
+			return -1;
+		}
+		return 0;
+	}
+
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	// the child is not reaped yet, so its PID can't be reused
+	p->pidfd = _pidfd_open(p->pid);
+	return 0;
+}
+
+/** Wait for the process to exit and close its descriptor.
+Return 0 on success */
+int ps_wait(ps *p, int *exit_code)
+{
+	siginfo_t s = {};
+	int r = (p->pidfd != -1)
+		? waitid(P_PIDFD, p->pidfd, &s, WEXITED)
+		: waitid(P_PID, p->pid, &s, WEXITED);
+	if (r != 0)
+		return -1;
+
+	if (exit_code != NULL) {
+		if (s.si_code == CLD_EXITED)
+			*exit_code = s.si_status;
+		else
+			*exit_code = -s.si_status;
+	}
+	if (p->pidfd != -1)
+		close(p->pidfd);
+	p->pidfd = -1;
+	return 0;
+}
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Spawn /bin/true 'n' times with each method; the parent has 'rss_mb' MB of touched memory */
+void bench(unsigned int rss_mb, unsigned int n)
+{
+	size_t size = (size_t)rss_mb * 1024*1024;
+	char *mem = NULL;
+	if (size != 0) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		assert(mem != MAP_FAILED);
+		memset(mem, 1, size);
+	}
+
+	static const char *names[] = { "fork", "vfork", "posix_spawn", "clone" };
+	const char *args[] = { "true", NULL };
+	ps_execinfo ei = { args, -1, -1, -1 };
+
+	for (unsigned int m = 0;  m != 4;  m++) {
+		double t = time_sec();
+		for (unsigned int i = 0;  i != n;  i++) {
+			ps p;
+			assert(0 == ps_spawn(&p, "/bin/true", &ei, m));
+			int code;
+			assert(0 == ps_wait(&p, &code));
+			assert(code == 0);
+		}
+		t = time_sec() - t;
+		printf("RSS:%uMB  %-12s %.0f processes/s\n", rss_mb, names[m], n / t);
+	}
+
+	if (mem != NULL)
+		munmap(mem, size);
+}
+
+void main(int argc, char **argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		unsigned int rss_mb = (argc > 2) ? atoi(argv[2]) : 1024;
+		unsigned int n = (argc > 3) ? atoi(argv[3]) : 1000;
+		bench(rss_mb, n);
+		return;
+	}
+
+	// run 'echo' with stdout redirected into a pipe
+	int pp[2];
+	assert(0 == pipe2(pp, O_CLOEXEC));
+	const char *args[] = { "echo", "Hello from child", NULL };
+	ps_execinfo ei = { args, -1, pp[1], -1 };
+
+	ps p;
+	assert(0 == ps_spawn(&p, "/bin/echo", &ei, PS_SPAWN_CLONE));
+	close(pp[1]);
+	printf("child PID: %d  pidfd: %d\n", (int)p.pid, p.pidfd);
+
+	char buf[1000];
+	ssize_t r = read(pp[0], buf, sizeof(buf));
+	assert(r > 0);
+	printf("child says: %.*s", (int)r, buf);
+	close(pp[0]);
+
+	int code;
+	assert(0 == ps_wait(&p, &code));
+	assert(code == 0);
+
+	// exec() error is reported by ps_spawn()
+	assert(0 != ps_spawn(&p, "/nonexistent", &ei, PS_SPAWN_CLONE));
+	assert(errno == ENOENT);
+}
@@ -0,0 +1,339 @@
+/* Cross-Platform System Programming Guide: Linux: supervise many child processes with pidfd and epoll
+Usage:
+	./ps-supervise
+	./ps-supervise bench 1000
+
+ps-exec-wait.c waits for one child with waitid(): blocking, or polling with WNOHANG.
+Here each child is represented by a process descriptor (pidfd, Linux 5.3+)
+ which becomes readable when the child exits, so one thread waits for thousands of children in a single epoll loop.
+Timeouts: the deadlines of all children are kept in a binary heap,
+ and a single timerfd object is armed for the nearest one.
+A child whose deadline has passed is killed with pidfd_send_signal():
+ unlike kill(), it can't hit an unrelated process that got the same PID after our child was reaped.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static int _pidfd_open(pid_t pid)
+{
+	return syscall(SYS_pidfd_open, pid, 0);
+}
+
+static int _pidfd_send_signal(int pidfd, int sig)
+{
+	return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+}
+
+static unsigned long long time_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+struct context {
+	void (*handler)(struct context *obj);
+};
+
+struct sv;
+struct sv_child;
+
+/** Called when the child has exited.
+exit_code: exit code; -signal number if the child was killed by a signal */
+typedef void (*sv_exit_cb)(struct sv_child *c, int exit_code);
+
+struct sv_child {
+	struct context ctx; // must be the first
+	struct sv *sv;
+	pid_t pid;
+	int pidfd;
+	unsigned long long deadline_ms; // 0: no timeout
+	unsigned int heap_idx;
+	unsigned int timed_out; // the child has been killed by the supervisor
+	sv_exit_cb on_exit;
+	void *udata;
+};
+
+typedef struct sv {
+	int kq; // epoll
+	struct context timer_ctx;
+	int tfd; // timerfd
+	struct sv_child **heap; // children with a timeout; the nearest deadline is the first
+	unsigned int heap_n, heap_cap;
+	unsigned int active;
+} sv;
+
+
+static void _heap_swap(struct sv *s, unsigned int a, unsigned int b)
+{
+	struct sv_child *c = s->heap[a];
+	s->heap[a] = s->heap[b];
+	s->heap[b] = c;
+	s->heap[a]->heap_idx = a;
+	s->heap[b]->heap_idx = b;
+}
+
+static void _heap_up(struct sv *s, unsigned int i)
+{
+	while (i != 0) {
+		unsigned int parent = (i - 1) / 2;
+		if (s->heap[parent]->deadline_ms <= s->heap[i]->deadline_ms)
+			break;
+		_heap_swap(s, i, parent);
+		i = parent;
+	}
+}
+
+static void _heap_down(struct sv *s, unsigned int i)
+{
+	for (;;) {
+		unsigned int min = i, l = i * 2 + 1, r = l + 1;
+		if (l < s->heap_n && s->heap[l]->deadline_ms < s->heap[min]->deadline_ms)
+			min = l;
+		if (r < s->heap_n && s->heap[r]->deadline_ms < s->heap[min]->deadline_ms)
+			min = r;
+		if (min == i)
+			break;
+		_heap_swap(s, i, min);
+		i = min;
+	}
+}
+
+static void _heap_remove(struct sv *s, struct sv_child *c)
+{
+	unsigned int i = c->heap_idx;
+	s->heap_n--;
+	if (i != s->heap_n) {
+		_heap_swap(s, i, s->heap_n);
+		_heap_up(s, i);
+		_heap_down(s, i);
+	}
+}
+
+/** Arm the timer for the nearest deadline */
+static void _sv_timer_update(struct sv *s)
+{
+	struct itimerspec its = {};
+	if (s->heap_n != 0) {
+		unsigned long long d = s->heap[0]->deadline_ms;
+		its.it_value.tv_sec = d / 1000;
+		its.it_value.tv_nsec = (d % 1000) * 1000000;
+		if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+			its.it_value.tv_nsec = 1;
+	}
+	timerfd_settime(s->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/** Timer has expired: kill all children whose deadline has passed */
+static void _sv_timer_handler(struct context *obj)
+{
+	struct sv *s = (void*)((char*)obj - offsetof(struct sv, timer_ctx));
+	unsigned long long val;
+	read(s->tfd, &val, 8);
+
+	unsigned long long now = time_ms();
+	while (s->heap_n != 0 && s->heap[0]->deadline_ms <= now) {
+		struct sv_child *c = s->heap[0];
+		_heap_remove(s, c);
+		c->timed_out = 1;
+		_pidfd_send_signal(c->pidfd, SIGKILL); // the exit event will follow
+	}
+	_sv_timer_update(s);
+}
+
+/** pidfd is readable: the child has exited */
+static void _sv_child_handler(struct context *obj)
+{
+	struct sv_child *c = (void*)obj;
+	struct sv *s = c->sv;
+
+	siginfo_t si = {};
+	if (0 != waitid(P_PIDFD, c->pidfd, &si, WEXITED | WNOHANG) || si.si_pid == 0)
+		return;
+
+	if (c->deadline_ms != 0 && !c->timed_out) {
+		_heap_remove(s, c);
+		_sv_timer_update(s);
+	}
+	// a child being started may still hold a copy of the pidfd, so close() alone may leave it in epoll
+	epoll_ctl(s->kq, EPOLL_CTL_DEL, c->pidfd, NULL);
+	close(c->pidfd);
+	s->active--;
+
+	int code = (si.si_code == CLD_EXITED) ? si.si_status : -si.si_status;
+	c->on_exit(c, code);
+	free(c);
+}
+
+/** Prepare the supervisor.
+Return 0 on success */
+int sv_init(sv *s)
+{
+	memset(s, 0, sizeof(*s));
+	if (-1 == (s->kq = epoll_create1(EPOLL_CLOEXEC)))
+		return -1;
+	if (-1 == (s->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))) {
+		close(s->kq);
+		return -1;
+	}
+	s->timer_ctx.handler = _sv_timer_handler;
+
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.ptr = &s->timer_ctx;
+	if (0 != epoll_ctl(s->kq, EPOLL_CTL_ADD, s->tfd, &event)) {
+		close(s->tfd);
+		close(s->kq);
+		return -1;
+	}
+	return 0;
+}
+
+void sv_destroy(sv *s)
+{
+	close(s->tfd);
+	close(s->kq);
+	free(s->heap);
+}
+
+/** Start a new child process.
+timeout_ms: kill the child after this time; 0: no timeout
+Return child object; it's freed after on_exit() returns
+  NULL on error */
+struct sv_child* sv_start(sv *s, const char *filename, const char **argv, unsigned int timeout_ms, sv_exit_cb on_exit, void *udata)
+{
+	struct sv_child *c = calloc(1, sizeof(struct sv_child));
+	if (c == NULL)
+		return NULL;
+	c->ctx.handler = _sv_child_handler;
+	c->sv = s;
+	c->on_exit = on_exit;
+	c->udata = udata;
+
+	int r = posix_spawn(&c->pid, filename, NULL, NULL, (char**)argv, environ);
+	if (r != 0) {
+		free(c);
+		errno = r;
+		return NULL;
+	}
+
+	// the child is not reaped yet, so its PID can't be reused
+	c->pidfd = _pidfd_open(c->pid);
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.ptr = c;
+	if (c->pidfd == -1
+		|| 0 != epoll_ctl(s->kq, EPOLL_CTL_ADD, c->pidfd, &event)) {
+		kill(c->pid, SIGKILL);
+		waitpid(c->pid, NULL, 0);
+		if (c->pidfd != -1)
+			close(c->pidfd);
+		free(c);
+		return NULL;
+	}
+
+	if (timeout_ms != 0) {
+		c->deadline_ms = time_ms() + timeout_ms;
+		if (s->heap_n == s->heap_cap) {
+			s->heap_cap = (s->heap_cap != 0) ? s->heap_cap * 2 : 64;
+			s->heap = realloc(s->heap, s->heap_cap * sizeof(struct sv_child*));
+		}
+		c->heap_idx = s->heap_n;
+		s->heap[s->heap_n++] = c;
+		_heap_up(s, c->heap_idx);
+		if (s->heap[0] == c)
+			_sv_timer_update(s);
+	}
+
+	s->active++;
+	return c;
+}
+
+/** Send a signal to the child */
+int sv_kill(struct sv_child *c, int sig)
+{
+	return _pidfd_send_signal(c->pidfd, sig);
+}
+
+/** Process events until all children have exited */
+void sv_run(sv *s)
+{
+	while (s->active != 0) {
+		struct epoll_event events[64];
+		int n = epoll_wait(s->kq, events, 64, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		assert(n > 0);
+
+		for (int i = 0;  i != n;  i++) {
+			struct context *o = events[i].data.ptr;
+			o->handler(o);
+		}
+	}
+}
+
+
+static void print_exit(struct sv_child *c, int exit_code)
+{
+	printf("%s: PID %d exited with %d%s\n"
+		, (char*)c->udata, (int)c->pid, exit_code, (c->timed_out) ? " (timed out)" : "");
+}
+
+static unsigned int n_exited;
+
+static void count_exit(struct sv_child *c, int exit_code)
+{
+	assert(exit_code == 0);
+	n_exited++;
+}
+
+void main(int argc, char **argv)
+{
+	sv s;
+	assert(0 == sv_init(&s));
+
+	if (argc > 2 && !strcmp(argv[1], "bench")) {
+		// supervise many children at once
+		unsigned int n = atoi(argv[2]);
+		const char *args[] = { "sleep", "0.5", NULL };
+		unsigned long long t = time_ms();
+		for (unsigned int i = 0;  i != n;  i++) {
+			assert(NULL != sv_start(&s, "/bin/sleep", args, 60*1000, count_exit, NULL));
+		}
+		unsigned long long t_start = time_ms() - t;
+		sv_run(&s);
+		printf("children:%u  started in %llums  all exited in %llums\n"
+			, n_exited, t_start, time_ms() - t);
+		sv_destroy(&s);
+		return;
+	}
+
+	const char *a_true[] = { "true", NULL };
+	const char *a_exit[] = { "sh", "-c", "exit 3", NULL };
+	const char *a_sleep[] = { "sleep", "10", NULL };
+	const char *a_sleep2[] = { "sleep", "10", NULL };
+	assert(NULL != sv_start(&s, "/bin/true", a_true, 0, print_exit, "true"));
+	assert(NULL != sv_start(&s, "/bin/sh", a_exit, 0, print_exit, "exit 3"));
+	assert(NULL != sv_start(&s, "/bin/sleep", a_sleep, 200, print_exit, "sleep, timeout 200ms"));
+	struct sv_child *c = sv_start(&s, "/bin/sleep", a_sleep2, 0, print_exit, "sleep, SIGTERM");
+	assert(c != NULL);
+	assert(0 == sv_kill(c, SIGTERM));
+	sv_run(&s);
+	sv_destroy(&s);
+}
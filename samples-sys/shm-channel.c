@@ -0,0 +1,348 @@
+/* Cross-Platform System Programming Guide: Linux: inter-process message channel in shared memory
+Usage:
+	./shm-channel
+	./shm-channel bench 1000000 64
+
+A single-producer single-consumer ring buffer is placed into a memfd mapping shared by parent and child.
+Messages are framed as [u32 length] [data] [padding to 8 bytes].
+A side blocks on a futex word only after it has found the ring empty (or full),
+ and the peer issues FUTEX_WAKE only when it sees that flag set,
+ so while both processes are busy no system calls are made at all.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INT_READONCE(obj)  (*(volatile __typeof__(obj)*)&(obj))
+
+#if defined __x86_64__ || defined __i386__
+	#define cpu_pause()  __builtin_ia32_pause()
+#else
+	#define cpu_pause()  __asm volatile("" : : : "memory")
+#endif
+
+/** Wait while *addr == val; works across processes for shared mappings */
+static int futex_wait(unsigned int *addr, unsigned int val)
+{
+	return syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+/** Wake up the processes waiting on addr */
+static int futex_wake(unsigned int *addr, unsigned int n)
+{
+	return syscall(SYS_futex, addr, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+/** Ring header shared by both processes.
+Each side writes only to its own cache line.
+The positions grow infinitely; the offset inside the ring is (position & (cap - 1)). */
+struct shmring {
+	// written by producer
+	unsigned long long whead __attribute__((aligned(64)));
+	unsigned int producer_sleeps; // producer waits for free space
+
+	// written by consumer
+	unsigned long long rtail __attribute__((aligned(64)));
+	unsigned int consumer_sleeps; // consumer waits for data
+
+	unsigned long long cap __attribute__((aligned(64)));
+	char data[0] __attribute__((aligned(64)));
+};
+
+#define SHMCH_PAD  0xffffffff // message marker: skip to the beginning of the ring
+#define SHMCH_FRAME(len)  ((4ULL + (len) + 7) & ~7ULL)
+#define SHMCH_SPIN  100
+
+typedef struct {
+	struct shmring *r;
+	size_t map_size;
+} shmch;
+
+/** Create a channel in anonymous shared memory.
+The mapping is inherited by the child processes after fork().
+cap: ring size; must be a power of 2
+Return 0 on success */
+int shmch_create(shmch *c, size_t cap)
+{
+	int fd = memfd_create("cpspg-shmch", MFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	c->map_size = sizeof(struct shmring) + cap;
+	if (0 != ftruncate(fd, c->map_size)) {
+		close(fd);
+		return -1;
+	}
+
+	void *p = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+
+	c->r = p;
+	c->r->cap = cap;
+	return 0;
+}
+
+void shmch_close(shmch *c)
+{
+	munmap(c->r, c->map_size);
+}
+
+/** Spin, then put the current side to sleep until '*pos' changes.
+sleeps: our flag the peer checks after each operation */
+static void _shmch_sleep(unsigned int *sleeps, unsigned long long *pos, unsigned long long seen)
+{
+	for (unsigned int i = 0;  i != SHMCH_SPIN;  i++) {
+		if (INT_READONCE(*pos) != seen)
+			return;
+		cpu_pause();
+	}
+
+	__atomic_store_n(sleeps, 1, __ATOMIC_SEQ_CST);
+	// re-check after announcing, otherwise we could miss the peer's update
+	if (__atomic_load_n(pos, __ATOMIC_SEQ_CST) == seen)
+		futex_wait(sleeps, 1);
+	__atomic_store_n(sleeps, 0, __ATOMIC_RELAXED);
+}
+
+/** Wake the peer up if it's sleeping */
+static void _shmch_wake(unsigned int *sleeps)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(sleeps, __ATOMIC_RELAXED)
+		&& __atomic_exchange_n(sleeps, 0, __ATOMIC_SEQ_CST))
+		futex_wake(sleeps, 1);
+}
+
+/** Send a message; block while there's not enough free space */
+void shmch_send(shmch *c, const void *data, unsigned int len)
+{
+	struct shmring *r = c->r;
+	unsigned long long n = SHMCH_FRAME(len), wh = r->whead;
+	unsigned long long i = wh & (r->cap - 1);
+	assert(n + 8 <= r->cap);
+
+	unsigned long long need = n;
+	if (i + n > r->cap)
+		need += r->cap - i; // the message can't wrap: it will start from the beginning
+
+	for (;;) {
+		unsigned long long rt = __atomic_load_n(&r->rtail, __ATOMIC_ACQUIRE);
+		if (r->cap - (wh - rt) >= need)
+			break;
+		_shmch_sleep(&r->producer_sleeps, &r->rtail, rt);
+	}
+
+	if (i + n > r->cap) {
+		*(unsigned int*)&r->data[i] = SHMCH_PAD;
+		wh += r->cap - i;
+		i = 0;
+	}
+
+	*(unsigned int*)&r->data[i] = len;
+	memcpy(&r->data[i + 4], data, len);
+	__atomic_store_n(&r->whead, wh + n, __ATOMIC_RELEASE);
+
+	_shmch_wake(&r->consumer_sleeps);
+}
+
+/** Receive a message; block while the ring is empty.
+Return message length (the data is truncated to 'cap') */
+unsigned int shmch_recv(shmch *c, void *buf, unsigned int cap)
+{
+	struct shmring *r = c->r;
+	unsigned long long rt = r->rtail, wh;
+
+	for (;;) {
+		wh = __atomic_load_n(&r->whead, __ATOMIC_ACQUIRE);
+		if (wh != rt)
+			break;
+		_shmch_sleep(&r->consumer_sleeps, &r->whead, wh);
+	}
+
+	unsigned long long i = rt & (r->cap - 1);
+	unsigned int len = *(unsigned int*)&r->data[i];
+	if (len == SHMCH_PAD) {
+		rt += r->cap - i;
+		i = 0;
+		len = *(unsigned int*)&r->data[0];
+	}
+
+	memcpy(buf, &r->data[i + 4], (len < cap) ? len : cap);
+	__atomic_store_n(&r->rtail, rt + SHMCH_FRAME(len), __ATOMIC_RELEASE);
+
+	_shmch_wake(&r->producer_sleeps);
+	return len;
+}
+
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Read exactly 'n' bytes from a stream descriptor */
+static void read_full(int fd, void *buf, size_t n)
+{
+	for (size_t off = 0;  off != n;) {
+		ssize_t r = read(fd, (char*)buf + off, n - off);
+		assert(r > 0);
+		off += r;
+	}
+}
+
+static void write_full(int fd, const void *buf, size_t n)
+{
+	for (size_t off = 0;  off != n;) {
+		ssize_t r = write(fd, (char*)buf + off, n - off);
+		assert(r > 0);
+		off += r;
+	}
+}
+
+/** Stream N messages one way, then measure N/10 (at least 1) round trips */
+void bench_shm(unsigned int n, unsigned int size)
+{
+	unsigned int rt = (n >= 10) ? n / 10 : 1;
+	shmch c, back;
+	assert(0 == shmch_create(&c, 1024*1024));
+	assert(0 == shmch_create(&back, 1024*1024));
+	char *buf = calloc(1, size);
+
+	pid_t p = fork();
+	if (p == 0) {
+		for (unsigned int i = 0;  i != n;  i++) {
+			shmch_recv(&c, buf, size);
+		}
+		for (unsigned int i = 0;  i != rt;  i++) {
+			shmch_recv(&c, buf, size);
+			shmch_send(&back, buf, size);
+		}
+		_exit(0);
+	}
+
+	double t = time_sec();
+	for (unsigned int i = 0;  i != n;  i++) {
+		shmch_send(&c, buf, size);
+	}
+	double t_stream = time_sec() - t;
+
+	t = time_sec();
+	for (unsigned int i = 0;  i != rt;  i++) {
+		shmch_send(&c, buf, size);
+		shmch_recv(&back, buf, size);
+	}
+	double t_rtt = time_sec() - t;
+	waitpid(p, NULL, 0);
+
+	printf("shm:    %10.0f msg/s  latency:%6.2fus\n", n / t_stream, t_rtt / rt / 2 * 1e6);
+	shmch_close(&c);
+	shmch_close(&back);
+	free(buf);
+}
+
+/** The same test for a pair of stream descriptors: pipe() or socketpair() */
+void bench_fd(const char *title, int unix_socket, unsigned int n, unsigned int size)
+{
+	int fwd[2], bwd[2];
+	if (unix_socket) {
+		assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fwd));
+		bwd[0] = fwd[1];
+		bwd[1] = fwd[0];
+	} else {
+		assert(0 == pipe(fwd));
+		assert(0 == pipe(bwd));
+	}
+	char *buf = calloc(1, size + 4);
+	unsigned int rt = (n >= 10) ? n / 10 : 1;
+
+	pid_t p = fork();
+	if (p == 0) {
+		unsigned int len;
+		for (unsigned int i = 0;  i != n + rt;  i++) {
+			read_full(fwd[0], &len, 4);
+			read_full(fwd[0], buf, len);
+			if (i >= n) {
+				write_full(bwd[1], &len, 4);
+				write_full(bwd[1], buf, len);
+			}
+		}
+		_exit(0);
+	}
+
+	// write the header and the data with a single call
+	*(unsigned int*)buf = size;
+	double t = time_sec();
+	for (unsigned int i = 0;  i != n;  i++) {
+		write_full(fwd[1], buf, size + 4);
+	}
+	double t_stream = time_sec() - t;
+
+	t = time_sec();
+	for (unsigned int i = 0;  i != rt;  i++) {
+		write_full(fwd[1], buf, size + 4);
+		read_full(bwd[0], buf, size + 4);
+	}
+	double t_rtt = time_sec() - t;
+	waitpid(p, NULL, 0);
+
+	printf("%-7s %10.0f msg/s  latency:%6.2fus\n", title, n / t_stream, t_rtt / rt / 2 * 1e6);
+	close(fwd[0]);
+	close(fwd[1]);
+	if (!unix_socket) {
+		close(bwd[0]);
+		close(bwd[1]);
+	}
+	free(buf);
+}
+
+void main(int argc, char **argv)
+{
+	if (argc > 3 && !strcmp(argv[1], "bench")) {
+		unsigned int n = atoi(argv[2]), size = atoi(argv[3]);
+		bench_shm(n, size);
+		bench_fd("pipe:", 0, n, size);
+		bench_fd("unix:", 1, n, size);
+		return;
+	}
+
+	shmch c;
+	assert(0 == shmch_create(&c, 4096));
+
+	pid_t p = fork();
+	assert(p >= 0);
+	if (p == 0) {
+		// child: print messages until the empty one
+		char buf[100];
+		unsigned int n;
+		while (0 != (n = shmch_recv(&c, buf, sizeof(buf)))) {
+			printf("child received: %.*s\n", (int)n, buf);
+			fflush(stdout);
+		}
+		_exit(0);
+	}
+
+	// parent: send several messages of different length
+	const char *msgs[] = { "hello", "from", "the parent process!" };
+	for (int i = 0;  i != 3;  i++) {
+		shmch_send(&c, msgs[i], strlen(msgs[i]));
+	}
+	shmch_send(&c, "", 0);
+
+	assert(p == waitpid(p, NULL, 0));
+	shmch_close(&c);
+}
@@ -0,0 +1,584 @@
+/* Cross-Platform System Programming Guide: Linux: crash reporter with async-signal-safe handler
+Usage:
+	./signal-crash-report segv|stack|fpe|abort
+	cat crash-PID.txt
+	./signal-crash-report bench [MB]
+
+signal-cpu-exception.c prints the signal info with printf(), which isn't safe inside a signal handler:
+ the crash may have happened inside printf() or malloc() with their locks held.
+Here the handler uses only async-signal-safe system calls, and all memory is allocated beforehand:
+ the report is formatted into a preallocated buffer by our own simple functions,
+ the handler runs on its own stack (sigaltstack) so that even a stack overflow is reported,
+ and then the report is written to "crash-PID.txt".
+The report contains:
+ the signal and the faulting address;
+ CPU registers from the signal context;
+ the backtrace made by following the frame pointers (build with -fno-omit-frame-pointer),
+  or by scanning the stack for code addresses if there are no frame pointers;
+  each address is shown as "module+offset" for addr2line;
+ the memory map from /proc/self/maps.
+The memory is read with process_vm_readv(), which returns EFAULT for a bad address instead of crashing again.
+After writing the report the default action is restored and the signal is raised again,
+ so the parent process sees the same exit status.
+Writing the report takes milliseconds, while a core dump of a large process takes seconds.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#define REPORT_CAP  (64*1024)
+#define MAPS_CAP  (256*1024)
+#define ALTSTACK_SIZE  (64*1024)
+#define FRAMES_MAX  64
+
+/** Output buffer that never reallocates */
+struct outbuf {
+	char *ptr;
+	size_t len, cap;
+};
+
+static void ob_add(struct outbuf *b, const char *s, size_t n)
+{
+	if (n > b->cap - b->len)
+		n = b->cap - b->len;
+	memcpy(b->ptr + b->len, s, n);
+	b->len += n;
+}
+
+static void ob_str(struct outbuf *b, const char *s)
+{
+	ob_add(b, s, strlen(s));
+}
+
+static void ob_hex(struct outbuf *b, unsigned long long v)
+{
+	char s[2 + 16];
+	s[0] = '0';  s[1] = 'x';
+	for (int i = 0;  i != 16;  i++) {
+		s[2 + i] = "0123456789abcdef"[(v >> (60 - i * 4)) & 0x0f];
+	}
+	ob_add(b, s, sizeof(s));
+}
+
+static void ob_dec(struct outbuf *b, long long v)
+{
+	char s[24];
+	unsigned int i = sizeof(s);
+	unsigned long long u = (v < 0) ? -(unsigned long long)v : (unsigned long long)v;
+	do {
+		s[--i] = '0' + u % 10;
+		u /= 10;
+	} while (u != 0);
+	if (v < 0)
+		s[--i] = '-';
+	ob_add(b, s + i, sizeof(s) - i);
+}
+
+/** Parse hexadecimal number.
+Return N of characters processed */
+static size_t parse_hex(const char *s, size_t n, unsigned long long *v)
+{
+	size_t i;
+	*v = 0;
+	for (i = 0;  i != n;  i++) {
+		unsigned int d;
+		if (s[i] >= '0' && s[i] <= '9')
+			d = s[i] - '0';
+		else if (s[i] >= 'a' && s[i] <= 'f')
+			d = s[i] - 'a' + 10;
+		else
+			break;
+		*v = (*v << 4) | d;
+	}
+	return i;
+}
+
+
+struct crash_reporter {
+	struct outbuf report;
+	struct outbuf maps;
+	const char *prefix;
+	int busy_tid; // the thread that is writing the report; 0: none
+};
+
+static struct crash_reporter cr;
+
+/** Safely read the process memory.
+Return 0 on success */
+static int mem_read(const void *addr, void *dst, size_t n)
+{
+	struct iovec local = { dst, n };
+	struct iovec remote = { (void*)addr, n };
+	return !(process_vm_readv(getpid(), &local, 1, &remote, 1, 0) == (ssize_t)n);
+}
+
+static void maps_read()
+{
+	cr.maps.len = 0;
+	int f = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+	if (f < 0)
+		return;
+	for (;;) {
+		ssize_t r = read(f, cr.maps.ptr + cr.maps.len, cr.maps.cap - cr.maps.len);
+		if (r <= 0)
+			break;
+		cr.maps.len += r;
+	}
+	close(f);
+}
+
+/** Find the mapping that contains the address.
+Return the line from /proc/self/maps: "start-end perms offset dev inode   path";
+  NULL if not found */
+static const char* maps_find(unsigned long long addr, const char **eol, unsigned long long *start, unsigned long long *off)
+{
+	const char *s = cr.maps.ptr, *end = cr.maps.ptr + cr.maps.len;
+	while (s != end) {
+		const char *e = memchr(s, '\n', end - s);
+		if (e == NULL)
+			e = end;
+		unsigned long long stop;
+		size_t i = parse_hex(s, e - s, start);
+		i++;
+		i += parse_hex(s + i, e - s - i, &stop);
+		if (addr >= *start && addr < stop && e - s > (ssize_t)(i + sizeof(" rwxp ") - 1)) {
+			parse_hex(s + i + sizeof(" rwxp ") - 1, e - s - i - (sizeof(" rwxp ") - 1), off);
+			*eol = e;
+			return s;
+		}
+		s = (e == end) ? end : e + 1;
+	}
+	return NULL;
+}
+
+/** Find the lowest mapping that starts at or above the address.
+Return its start address;
+  0 if not found */
+static unsigned long long maps_next_start(unsigned long long addr)
+{
+	unsigned long long next = 0;
+	const char *s = cr.maps.ptr, *end = cr.maps.ptr + cr.maps.len;
+	while (s != end) {
+		const char *e = memchr(s, '\n', end - s);
+		if (e == NULL)
+			e = end;
+		unsigned long long start;
+		parse_hex(s, e - s, &start);
+		if (start >= addr && (next == 0 || start < next))
+			next = start;
+		s = (e == end) ? end : e + 1;
+	}
+	return next;
+}
+
+/** Return 1 if the address points into executable code */
+static int addr_is_code(unsigned long long addr)
+{
+	const char *eol;
+	unsigned long long start, off;
+	const char *line = maps_find(addr, &eol, &start, &off);
+	if (line == NULL)
+		return 0;
+	const char *perms = memchr(line, ' ', eol - line);
+	return (perms != NULL && eol - perms > 3 && perms[3] == 'x');
+}
+
+/** Print the address as "path+offset" */
+static void ob_module_addr(struct outbuf *b, unsigned long long addr)
+{
+	const char *eol;
+	unsigned long long start, off;
+	const char *line = maps_find(addr, &eol, &start, &off);
+	if (line == NULL) {
+		ob_str(b, "?");
+		return;
+	}
+	const char *path = memchr(line, '/', eol - line);
+	if (path == NULL)
+		path = memchr(line, '[', eol - line);
+	if (path != NULL)
+		ob_add(b, path, eol - path);
+	ob_str(b, "+");
+	ob_hex(b, addr - start + off);
+}
+
+static void ob_frame(struct outbuf *b, unsigned int i, unsigned long long pc)
+{
+	ob_str(b, "#");
+	ob_dec(b, i);
+	ob_str(b, "\t");
+	ob_hex(b, pc);
+	ob_str(b, "\t");
+	ob_module_addr(b, pc);
+	ob_str(b, "\n");
+}
+
+static void report_registers(struct outbuf *b, const ucontext_t *uc, unsigned long long *pc, unsigned long long *fp, unsigned long long *sp)
+{
+	*pc = *fp = *sp = 0;
+	ob_str(b, "\nRegisters:\n");
+
+#if defined __x86_64__
+	static const char names[][4] = {
+		"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+		"rdi", "rsi", "rbp", "rbx", "rdx", "rax", "rcx", "rsp", "rip", "efl",
+	};
+	for (unsigned int i = 0;  i != sizeof(names) / sizeof(*names);  i++) {
+		ob_str(b, names[i]);
+		ob_str(b, "\t");
+		ob_hex(b, uc->uc_mcontext.gregs[i]);
+		ob_str(b, (i % 4 == 3) ? "\n" : "  ");
+	}
+	*pc = uc->uc_mcontext.gregs[REG_RIP];
+	*fp = uc->uc_mcontext.gregs[REG_RBP];
+	*sp = uc->uc_mcontext.gregs[REG_RSP];
+
+#elif defined __aarch64__
+	for (unsigned int i = 0;  i != 31;  i++) {
+		ob_str(b, "x");
+		ob_dec(b, i);
+		ob_str(b, "\t");
+		ob_hex(b, uc->uc_mcontext.regs[i]);
+		ob_str(b, (i % 4 == 3) ? "\n" : "  ");
+	}
+	ob_str(b, "sp\t");
+	ob_hex(b, uc->uc_mcontext.sp);
+	*pc = uc->uc_mcontext.pc;
+	*fp = uc->uc_mcontext.regs[29];
+	*sp = uc->uc_mcontext.sp;
+
+#else
+	ob_str(b, "(not supported on this CPU)");
+#endif
+	ob_str(b, "\n");
+}
+
+/** Follow the chain of frame pointers: each frame begins with {previous frame pointer, return address}.
+If the chain is broken at the first frame (e.g. the crash is inside a library built without frame pointers),
+ scan the stack for values that point into executable code: some of them may be stale. */
+static void report_backtrace(struct outbuf *b, unsigned long long pc, unsigned long long fp, unsigned long long sp)
+{
+	ob_str(b, "\nBacktrace:\n");
+	unsigned int i;
+	for (i = 0;  i != FRAMES_MAX;  i++) {
+		ob_frame(b, i, pc);
+
+		unsigned long long frame[2];
+		if (fp == 0 || (fp & (sizeof(void*) - 1))
+			|| 0 != mem_read((void*)fp, frame, sizeof(frame)))
+			break;
+		if (frame[0] <= fp || !addr_is_code(frame[1]))
+			break; // the stack grows down: the caller's frame must be higher
+		pc = frame[1];
+		fp = frame[0];
+	}
+
+	if (i != 0 || sp == 0)
+		return;
+
+	ob_str(b, "Stack scan:\n");
+	unsigned long long stack[256];
+	if (0 != mem_read((void*)sp, stack, sizeof(*stack))) {
+		// stack overflow: SP is in the unmapped gap below the stack, the live frames begin at the stack mapping
+		sp = maps_next_start(sp);
+		if (sp == 0)
+			return;
+	}
+	unsigned int n = sizeof(stack) / sizeof(*stack);
+	while (n != 0 && 0 != mem_read((void*)sp, stack, n * sizeof(*stack))) {
+		n /= 2; // the end of the stack is closer
+	}
+	for (unsigned int k = 0;  k != n && i != FRAMES_MAX;  k++) {
+		if (addr_is_code(stack[k]))
+			ob_frame(b, ++i, stack[k]);
+	}
+}
+
+static const char* sig_name(int sig)
+{
+	switch (sig) {
+	case SIGSEGV: return "SIGSEGV";
+	case SIGBUS: return "SIGBUS";
+	case SIGFPE: return "SIGFPE";
+	case SIGILL: return "SIGILL";
+	case SIGABRT: return "SIGABRT";
+	}
+	return "?";
+}
+
+static void crash_handler(int sig, siginfo_t *info, void *ucontext)
+{
+	int tid = gettid(), busy = 0;
+	if (!__atomic_compare_exchange_n(&cr.busy_tid, &busy, tid, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		if (busy == tid) {
+			// the reporter itself has crashed: die with this signal rather than wait forever
+			signal(sig, SIG_DFL);
+			sigset_t set;
+			sigemptyset(&set);
+			sigaddset(&set, sig);
+			sigprocmask(SIG_UNBLOCK, &set, NULL);
+			raise(sig);
+			_exit(128 + sig);
+		}
+		// another thread is writing the report: wait until it kills the process
+		for (;;) {
+			pause();
+		}
+	}
+
+	struct outbuf *b = &cr.report;
+	b->len = 0;
+	maps_read();
+
+	ob_str(b, "Signal: ");
+	ob_dec(b, sig);
+	ob_str(b, " (");
+	ob_str(b, sig_name(sig));
+	ob_str(b, ")  Code: ");
+	ob_dec(b, info->si_code);
+	ob_str(b, "  Address: ");
+	ob_hex(b, (unsigned long long)info->si_addr);
+	ob_str(b, "\nPID: ");
+	ob_dec(b, getpid());
+	ob_str(b, "  TID: ");
+	ob_dec(b, tid);
+	ob_str(b, "\n");
+
+	unsigned long long pc, fp, sp;
+	report_registers(b, ucontext, &pc, &fp, &sp);
+	report_backtrace(b, pc, fp, sp);
+
+	ob_str(b, "\nMemory map:\n");
+	ob_add(b, cr.maps.ptr, cr.maps.len);
+	if (cr.maps.len == cr.maps.cap)
+		ob_str(b, "...\n");
+
+	// "PREFIX-PID.txt"
+	char fn[256];
+	struct outbuf name = { fn, 0, sizeof(fn) - 1 };
+	ob_str(&name, cr.prefix);
+	ob_str(&name, "-");
+	ob_dec(&name, getpid());
+	ob_str(&name, ".txt");
+	fn[name.len] = '\0';
+
+	int f = open(fn, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+	if (f >= 0) {
+		for (size_t off = 0;  off != b->len;) {
+			ssize_t r = write(f, b->ptr + off, b->len - off);
+			if (r <= 0)
+				break;
+			off += r;
+		}
+		close(f);
+	}
+
+	struct outbuf msg = { b->ptr, 0, b->cap }; // reuse the buffer
+	ob_str(&msg, "Crash report saved to ");
+	ob_str(&msg, fn);
+	ob_str(&msg, "\n");
+	write(STDERR_FILENO, msg.ptr, msg.len);
+
+	// the handler has been reset to the default (SA_RESETHAND):
+	//  the signal is delivered again after return (or the faulting instruction is executed again)
+	raise(sig);
+}
+
+/** Set up an alternate signal stack for the current thread, so that stack overflow can be handled.
+Each thread needs its own.
+Return 0 on success */
+int crash_altstack_init()
+{
+	stack_t st = {};
+	st.ss_sp = mmap(NULL, ALTSTACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (st.ss_sp == MAP_FAILED)
+		return -1;
+	st.ss_size = ALTSTACK_SIZE;
+	return sigaltstack(&st, NULL);
+}
+
+/** Install the crash handler.
+prefix: report file name prefix
+Return 0 on success */
+int crash_report_init(const char *prefix)
+{
+	cr.prefix = prefix;
+	cr.report.cap = REPORT_CAP;
+	cr.maps.cap = MAPS_CAP;
+	cr.report.ptr = mmap(NULL, REPORT_CAP + MAPS_CAP, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (cr.report.ptr == MAP_FAILED)
+		return -1;
+	cr.maps.ptr = cr.report.ptr + REPORT_CAP;
+
+	if (0 != crash_altstack_init())
+		return -1;
+
+	struct sigaction sa = {};
+	sa.sa_sigaction = crash_handler;
+	sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESETHAND;
+	sigfillset(&sa.sa_mask);
+	static const int sigs[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+	for (unsigned int i = 0;  i != sizeof(sigs) / sizeof(*sigs);  i++) {
+		if (0 != sigaction(sigs[i], &sa, NULL))
+			return -1;
+	}
+	return 0;
+}
+
+
+static int recurse(int n)
+{
+	volatile char buf[1024];
+	buf[0] = n;
+	return recurse(n + 1) + buf[0];
+}
+
+static void crash(const char *how)
+{
+	if (!strcmp(how, "segv")) {
+		*(volatile int*)0x16 = -1;
+	} else if (!strcmp(how, "stack")) {
+		recurse(0);
+	} else if (!strcmp(how, "fpe")) {
+		volatile int i = 0;
+		i = 10 / i;
+	} else if (!strcmp(how, "abort")) {
+		abort();
+	}
+}
+
+static double time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Read a one-line setting from /proc/sys */
+static int sysctl_read(const char *path, char *buf, size_t cap)
+{
+	int f = open(path, O_RDONLY | O_CLOEXEC);
+	if (f < 0)
+		return -1;
+	ssize_t n = read(f, buf, cap - 1);
+	close(f);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+/** Get the name of the core file the kernel writes for the process.
+Only %p and %% specifiers are supported.
+Return 0 on success;
+  -1: the name can't be determined (a pipe, other specifiers) */
+static int core_file_name(pid_t pid, char *buf, size_t cap)
+{
+	char pattern[256], uses_pid[16];
+	if (0 != sysctl_read("/proc/sys/kernel/core_pattern", pattern, sizeof(pattern))
+		|| pattern[0] == '|')
+		return -1;
+
+	size_t n = 0;
+	int has_pid = 0;
+	for (const char *c = pattern;  *c != '\0' && n < cap - 1;  c++) {
+		if (*c != '%') {
+			buf[n++] = *c;
+			continue;
+		}
+		c++;
+		if (*c == '%') {
+			buf[n++] = '%';
+		} else if (*c == 'p') {
+			n += snprintf(buf + n, cap - n, "%d", (int)pid);
+			has_pid = 1;
+		} else {
+			return -1;
+		}
+	}
+	if (n >= cap - 1)
+		return -1;
+	buf[n] = '\0';
+
+	if (!has_pid
+		&& 0 == sysctl_read("/proc/sys/kernel/core_uses_pid", uses_pid, sizeof(uses_pid))
+		&& uses_pid[0] == '1')
+		snprintf(buf + n, cap - n, ".%d", (int)pid);
+	return 0;
+}
+
+/** Crash a process that uses 'mb' MB of memory: with the crash reporter and with a core dump */
+void bench(unsigned int mb)
+{
+	for (unsigned int with_report = 1;  ;  with_report = 0) {
+		time_t started = time(NULL);
+		double t = time_sec();
+		pid_t pid = fork();
+		assert(pid >= 0);
+		if (pid == 0) {
+			size_t size = (size_t)mb * 1024*1024;
+			char *p = malloc(size);
+			memset(p, 1, size);
+			if (with_report) {
+				struct rlimit rl = {};
+				setrlimit(RLIMIT_CORE, &rl);
+				crash_report_init("crash");
+			} else {
+				struct rlimit rl = { RLIM_INFINITY, RLIM_INFINITY };
+				setrlimit(RLIMIT_CORE, &rl);
+			}
+			crash("segv");
+			_exit(0);
+		}
+		int status;
+		waitpid(pid, &status, 0);
+		t = time_sec() - t;
+		printf("%-14s %.3fs  signal:%d  core dumped:%d\n"
+			, (with_report) ? "crash report:" : "core dump:", t
+			, WIFSIGNALED(status) ? WTERMSIG(status) : 0
+			, WIFSIGNALED(status) && WCOREDUMP(status));
+
+		if (with_report) {
+			char fn[64];
+			snprintf(fn, sizeof(fn), "crash-%d.txt", (int)pid);
+			unlink(fn);
+		}
+		if (!with_report) {
+			// remove the core file only if it's been written by our child, not a file that existed before
+			char fn[4096];
+			struct stat st;
+			if (0 == core_file_name(pid, fn, sizeof(fn))
+				&& 0 == stat(fn, &st)
+				&& st.st_mtime >= started)
+				unlink(fn);
+			break;
+		}
+	}
+	puts("Note: the core dump time depends on /proc/sys/kernel/core_pattern");
+}
+
+void main(int argc, char **argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		bench((argc > 2) ? atoi(argv[2]) : 256);
+		return;
+	}
+
+	assert(0 == crash_report_init("crash"));
+	crash((argc > 1) ? argv[1] : "segv");
+}
@@ -40,3 +40,98 @@ kill $!
 
 echo | ./semaphore
 ./dylib-load
+
+rm -f fmap-log.dat
+./fmap-log write 'record 1' 'record 2'
+./fmap-log write 'record 3'
+./fmap-log read
+./fmap-log bench 100000
+
+./shm-channel
+./shm-channel bench 100000 64
+
+rm -f fmap-hashtable.dat
+./fmap-hashtable put key1 1
+./fmap-hashtable put key2 2
+./fmap-hashtable get key2
+./fmap-hashtable bench 100000
+
+./fmap-hugepage anon 64
+./fmap-hugepage file 64
+
+./memfd-share server &
+sleep .5
+./memfd-share client
+./memfd-share exec
+
+./fmap-cache file-echo.log file-echo.log
+./fmap-cache bench 16 256
+
+cat ../*.c >fmap-grep.log
+./fmap-grep main fmap-grep.log
+./fmap-grep main fmap-grep.log
+./fmap-grep bench main fmap-grep.log 2
+
+./dir-list-getdents
+./dir-list-getdents create dir-list-getdents.tmp 10000
+./dir-list-getdents bench dir-list-getdents.tmp
+rm -rf dir-list-getdents.tmp
+
+./dir-walk create dir-walk.tmp 3 5 10
+./dir-walk dir-walk.tmp 2 | tail -3
+./dir-walk bench dir-walk.tmp
+rm -rf dir-walk.tmp
+
+./file-props-statx
+./dir-list-getdents create file-props-statx.tmp 10000
+./file-props-statx bench file-props-statx.tmp
+rm -rf file-props-statx.tmp
+
+./dir-index-inotify test
+
+mkdir -p file-man-bulk.tmp/a/b
+touch file-man-bulk.tmp/f1 file-man-bulk.tmp/f2 file-man-bulk.tmp/a/f3
+./file-man-bulk rename file-man-bulk.tmp .bak
+./file-man-bulk swap file-man-bulk.tmp/f1.bak file-man-bulk.tmp/f2.bak
+./file-man-bulk rm file-man-bulk.tmp 2
+./file-man-bulk bench file-man-bulk.tmp 20000
+
+./ps-spawn
+./ps-spawn bench 256 200
+
+./ps-supervise
+./ps-supervise bench 500
+
+./ps-capture
+./ps-capture bench 50 1000000
+
+printf 'echo job 1\nsleep 5\nls nonexistent-file\necho job 4\n' | ./ps-jobs -P 2 -t 500 -m 512
+./ps-jobs bench 2000 4
+
+cat ../pipe-splice.c | ./pipe-splice cat | ./pipe-splice tee pipe-splice1.tmp pipe-splice2.tmp | cmp - ../pipe-splice.c
+cmp pipe-splice1.tmp ../pipe-splice.c
+cmp pipe-splice2.tmp ../pipe-splice.c
+rm pipe-splice1.tmp pipe-splice2.tmp
+./pipe-splice cat <../pipe-splice.c | cmp - ../pipe-splice.c
+./pipe-splice bench 256
+
+./ipc-bench -m 16
+
+./pipe-named-server server &
+sleep .5
+./pipe-named-server client
+kill $!
+./pipe-named-server bench 8 100000
+./futex-sem
+./futex-sem bench 4
+./futex-rwlock
+./futex-rwlock bench 8
+./signal-crash-report segv
+cat crash-*.txt
+rm crash-*.txt
+./signal-crash-report bench 64
+./fiber-stack
+./fiber-stack overflow
+./fiber-stack bench 10000
+./fmap-lazy
+./fmap-lazy bench 256 10000